@@ -1,9 +1,359 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "bd.h"
 
+/// How many blocks load and save moves per request
+#define BLOCKDEVICE_IMAGE_CHUNK 64
+
+/// The magic at the start of a delta file
+#define BLOCKDEVICE_DELTA_MAGIC "PNFSDELT"
+
+/// The version of the delta file format
+#define BLOCKDEVICE_DELTA_VERSION 1
+
+/// The magic at the start of a sparse image
+#define BLOCKDEVICE_SPARSE_MAGIC "PNFSSPRS"
+
+/// The version of the sparse image format
+#define BLOCKDEVICE_SPARSE_VERSION 1
+
+/// The blocks in the sparse image are compressed
+#define BLOCKDEVICE_SPARSE_COMPRESSED (1 << 0)
+
+/**
+ * The header of a sparse image.
+ * It is followed by a bitmap with one bit per block, set for the blocks that are in the image. Then the blocks follow
+ * in order, if they are compressed each block starts with a uint16_t size, where BLOCK_SIZE means it is stored as it is.
+ * The blocks that are not in the image are zero.
+ */
+struct fs_blockdevice_sparseHeader {
+	/// Is always BLOCKDEVICE_SPARSE_MAGIC
+	char magic[8];
+
+	/// Is always BLOCKDEVICE_SPARSE_VERSION
+	uint32_t version;
+
+	/// BLOCKDEVICE_SPARSE_* flags
+	uint32_t flags;
+
+	/// The amount of blocks the device has
+	uint32_t blockCount;
+
+	/// The amount of blocks in the image
+	uint32_t count;
+};
+
+/**
+ * The header of a delta file.
+ * It is followed by \ref count block indices, and then the \ref count blocks in the same order.
+ */
+struct fs_blockdevice_deltaHeader {
+	/// Is always BLOCKDEVICE_DELTA_MAGIC
+	char magic[8];
+
+	/// Is always BLOCKDEVICE_DELTA_VERSION
+	uint32_t version;
+
+	/// The amount of blocks the device had when the delta was saved
+	uint32_t blockCount;
+
+	/// The amount of blocks in the delta
+	uint32_t count;
+};
+
+/**
+ * \return If every byte in the block is zero
+ */
+static bool fs_blockdevice_isZero(const struct fs_block * block) {
+	for (uint32_t i = 0; i < BLOCK_SIZE; i++)
+		if (block->data[i])
+			return false;
+	return true;
+}
+
+/**
+ * Compress a block with PackBits run-length encoding, which is fast and good at the zero filled parts of blocks.
+ * \param block The block
+ * \param out Where to write the compressed data, needs room for BLOCK_SIZE bytes
+ * \return The compressed size, or BLOCK_SIZE if it would not get smaller, then \a out is not valid
+ */
+static uint16_t fs_blockdevice_compress(const struct fs_block * block, uint8_t * out) {
+	const uint8_t * in = block->data;
+	uint32_t i = 0;
+	uint32_t size = 0;
+	while (i < BLOCK_SIZE) {
+		uint32_t run = 1;
+		while (i + run < BLOCK_SIZE && run < 128 && in[i + run] == in[i])
+			run++;
+
+		if (run >= 3) { // A run is stored as 1 - length and the byte
+			if (size + 2 >= BLOCK_SIZE)
+				return BLOCK_SIZE;
+			out[size++] = (uint8_t)(1 - (int)run);
+			out[size++] = in[i];
+			i += run;
+			continue;
+		}
+
+		// Literals are stored as length - 1 and the bytes, they last until the next run
+		uint32_t start = i;
+		while (i < BLOCK_SIZE && i - start < 128 && !(i + 2 < BLOCK_SIZE && in[i] == in[i + 1] && in[i] == in[i + 2]))
+			i++;
+		uint32_t length = i - start;
+		if (size + 1 + length >= BLOCK_SIZE)
+			return BLOCK_SIZE;
+		out[size++] = length - 1;
+		memcpy(&out[size], &in[start], length);
+		size += length;
+	}
+	return size;
+}
+
+/**
+ * Decompress a block from fs_blockdevice_compress.
+ * \return If \a in was valid and gave exactly one block
+ */
+static bool fs_blockdevice_decompress(const uint8_t * in, uint16_t size, struct fs_block * block) {
+	uint32_t i = 0;
+	uint32_t out = 0;
+	while (i < size) {
+		int8_t control = (int8_t)in[i++];
+		if (control >= 0) {
+			uint32_t length = control + 1;
+			if (i + length > size || out + length > BLOCK_SIZE)
+				return false;
+			memcpy(&block->data[out], &in[i], length);
+			i += length;
+			out += length;
+		} else if (control != -128) {
+			uint32_t length = 1 - control;
+			if (i >= size || out + length > BLOCK_SIZE)
+				return false;
+			memset(&block->data[out], in[i++], length);
+			out += length;
+		}
+	}
+	return out == BLOCK_SIZE;
+}
+
+/**
+ * Read the next block of a sparse image.
+ * \param compressed If the blocks in the image are compressed
+ * \return If a whole and valid block could be read
+ */
+static bool fs_blockdevice_readSparseBlock(FILE * fp, bool compressed, struct fs_block * block) {
+	if (!compressed)
+		return fread(block, sizeof(struct fs_block), 1, fp) == 1;
+
+	uint16_t size;
+	uint8_t data[BLOCK_SIZE];
+	if (fread(&size, sizeof(size), 1, fp) != 1 || !size || size > BLOCK_SIZE)
+		return false;
+	if (size == BLOCK_SIZE)
+		return fread(block, sizeof(struct fs_block), 1, fp) == 1;
+	return fread(data, 1, size, fp) == size && fs_blockdevice_decompress(data, size, block);
+}
+
+/**
+ * Load the rest of a sparse image, after the magic.
+ * The image is read through once to check it before the device is touched, so a broken image leaves it as it was.
+ */
+static bool fs_blockdevice_loadSparse(struct fs_blockdevice * bd, FILE * fp) {
+	struct fs_blockdevice_sparseHeader header;
+	memcpy(header.magic, BLOCKDEVICE_SPARSE_MAGIC, sizeof(header.magic));
+	if (fread((uint8_t *)&header + sizeof(header.magic), sizeof(header) - sizeof(header.magic), 1, fp) != 1
+			|| header.version != BLOCKDEVICE_SPARSE_VERSION || !header.blockCount)
+		return false;
+
+	bool compressed = header.flags & BLOCKDEVICE_SPARSE_COMPRESSED;
+	uint32_t mapSize = (header.blockCount + 7) / 8;
+	uint8_t * map = malloc(mapSize);
+	struct fs_block * chunk = malloc(BLOCKDEVICE_IMAGE_CHUNK * sizeof(struct fs_block));
+	bool ok = map && chunk && fread(map, 1, mapSize, fp) == mapSize;
+	off_t blocks = ftello(fp);
+
+	uint32_t found = 0;
+	for (fs_block_id i = 0; i < header.blockCount && ok; i++)
+		if (map[i / 8] & (1 << (i % 8)))
+			ok = ++found <= header.count && fs_blockdevice_readSparseBlock(fp, compressed, &chunk[0]);
+	ok = ok && found == header.count && blocks >= 0 && !fseeko(fp, blocks, SEEK_SET) && fs_blockdevice_resize(bd, header.blockCount);
+	if (!ok) {
+		free(map);
+		free(chunk);
+		return false;
+	}
+
+	// Only the blocks in the image are written, the rest is zero after the clear
+	fs_blockdevice_clear(bd);
+
+	struct fs_blockio ios[BLOCKDEVICE_IMAGE_CHUNK];
+	uint32_t n = 0;
+	for (fs_block_id i = 0; i < header.blockCount && ok; i++) {
+		if (!(map[i / 8] & (1 << (i % 8))))
+			continue;
+
+		ios[n].id = i;
+		ios[n].block = &chunk[n];
+		ok = fs_blockdevice_readSparseBlock(fp, compressed, &chunk[n]);
+		if (++n == BLOCKDEVICE_IMAGE_CHUNK && ok) {
+			fs_blockdevice_writeList(bd, ios, n);
+			n = 0;
+		}
+	}
+	if (ok)
+		fs_blockdevice_writeList(bd, ios, n);
+
+	free(map);
+	free(chunk);
+	return ok;
+}
+
+static uint64_t fs_blockdevice_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * \return The start time of a request, if the statistics are kept
+ */
+static uint64_t fs_blockdevice_statsBegin(struct fs_blockdevice * bd) {
+	return bd->stats ? fs_blockdevice_now() : 0;
+}
+
+/**
+ * Count a request that started at \a start.
+ */
+static void fs_blockdevice_statsEnd(struct fs_blockdevice * bd, enum fs_blockdevice_op op, uint32_t blocks, uint64_t start) {
+	if (!bd->stats)
+		return;
+
+	uint64_t nanoseconds = fs_blockdevice_now() - start;
+	struct fs_blockdevice_opStats * stats = &bd->stats->ops[op];
+	stats->calls++;
+	stats->blocks += blocks;
+	stats->nanoseconds += nanoseconds;
+
+	uint32_t bucket = 0;
+	for (uint64_t us = nanoseconds / 1000; us && bucket < BLOCKDEVICE_STATS_BUCKETS - 1; us >>= 1)
+		bucket++;
+	stats->histogram[bucket]++;
+}
+
+static void fs_blockdevice_markChanged(struct fs_blockdevice * bd, fs_block_id first, uint32_t count) {
+	if (!bd->changed)
+		return;
+	for (fs_block_id i = first; i < first + count; i++)
+		bd->changed[i / 8] |= 1 << (i % 8);
+}
+
+static bool fs_blockdevice_isChanged(struct fs_blockdevice * bd, fs_block_id idx) {
+	return bd->changed[idx / 8] & (1 << (idx % 8));
+}
+
+/**
+ * Find the first changed block from \a idx, whole bytes without any changes are skipped.
+ * \return The index of the block, or blockCount if there are no more
+ */
+static fs_block_id fs_blockdevice_nextChanged(struct fs_blockdevice * bd, fs_block_id idx) {
+	while (idx < bd->blockCount) {
+		if (!(idx % 8) && !bd->changed[idx / 8])
+			idx += 8;
+		else if (fs_blockdevice_isChanged(bd, idx))
+			return idx;
+		else
+			idx++;
+	}
+	return bd->blockCount;
+}
+
+void fs_blockdevice_free(struct fs_blockdevice * bd) {
+	if (!bd)
+		return;
+	bd->vtbl->sync(bd);
+	free(bd->changed);
+	free(bd->stats);
+	bd->vtbl->free(bd);
+}
+
+bool fs_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount) {
+	if (!blockCount)
+		return false;
+	if (blockCount == bd->blockCount)
+		return true;
+
+	uint32_t oldCount = bd->blockCount;
+	if (!bd->vtbl->resize(bd, blockCount))
+		return false;
+
+	if (bd->changed) {
+		uint8_t * changed = realloc(bd->changed, (blockCount + 7) / 8);
+		if (!changed) { // The tracking is lost, so the next image needs to be a full one
+			free(bd->changed);
+			bd->changed = NULL;
+			return true;
+		}
+		bd->changed = changed;
+
+		if (blockCount > oldCount) {
+			memset(&changed[(oldCount + 7) / 8], 0, (blockCount + 7) / 8 - (oldCount + 7) / 8);
+			fs_blockdevice_markChanged(bd, oldCount, blockCount - oldCount);
+		} else if (blockCount % 8)
+			changed[blockCount / 8] &= (1 << (blockCount % 8)) - 1;
+	}
+	return true;
+}
+
 void fs_blockdevice_clear(struct fs_blockdevice * bd) {
-	memset(bd->blocks, 0, sizeof(bd->blocks));
+	bd->vtbl->clear(bd);
+	fs_blockdevice_markChanged(bd, 0, bd->blockCount);
+}
+
+bool fs_blockdevice_trackStats(struct fs_blockdevice * bd) {
+	if (!bd->stats)
+		bd->stats = calloc(1, sizeof(struct fs_blockdevice_stats));
+	return bd->stats;
+}
+
+void fs_blockdevice_resetStats(struct fs_blockdevice * bd) {
+	if (bd->stats)
+		memset(bd->stats, 0, sizeof(struct fs_blockdevice_stats));
+}
+
+const char * fs_blockdevice_opName(enum fs_blockdevice_op op) {
+	static const char * names[BLOCKDEVICE_OP_COUNT] = {
+		"read", "write", "readv", "writev", "readList", "writeList", "get", "put", "sync"
+	};
+	return op < BLOCKDEVICE_OP_COUNT ? names[op] : "?";
+}
+
+bool fs_blockdevice_trackChanges(struct fs_blockdevice * bd) {
+	if (!bd->changed)
+		bd->changed = calloc((bd->blockCount + 7) / 8, 1);
+	return bd->changed;
+}
+
+void fs_blockdevice_resetChanges(struct fs_blockdevice * bd) {
+	if (bd->changed)
+		memset(bd->changed, 0, (bd->blockCount + 7) / 8);
+}
+
+uint32_t fs_blockdevice_changedCount(struct fs_blockdevice * bd) {
+	if (!bd->changed)
+		return bd->blockCount;
+
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < (bd->blockCount + 7) / 8; i++)
+		count += __builtin_popcount(bd->changed[i]);
+	return count;
+}
+
+void fs_blockdevice_sync(struct fs_blockdevice * bd) {
+	uint64_t start = fs_blockdevice_statsBegin(bd);
+	bd->vtbl->sync(bd);
+	fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_SYNC, 0, start);
 }
 
 bool fs_blockdevice_load(struct fs_blockdevice * bd, char * file) {
@@ -12,8 +362,40 @@ bool fs_blockdevice_load(struct fs_blockdevice * bd, char * file) {
 	if (!fp)
 		return false;
 
-	fread(bd->blocks, 1, sizeof(bd->blocks), fp);
+	char magic[8];
+	if (fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, BLOCKDEVICE_SPARSE_MAGIC, sizeof(magic))) {
+		bool ok = fs_blockdevice_loadSparse(bd, fp);
+		fclose(fp);
+		if (ok)
+			fs_blockdevice_resetChanges(bd);
+		return ok;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if (size < BLOCK_SIZE || !fs_blockdevice_resize(bd, size / BLOCK_SIZE)) {
+		fclose(fp);
+		return false;
+	}
+
+	struct fs_block * chunk = malloc(BLOCKDEVICE_IMAGE_CHUNK * sizeof(struct fs_block));
+	if (!chunk) {
+		fclose(fp);
+		return false;
+	}
+
+	for (fs_block_id i = 0; i < bd->blockCount;) {
+		uint32_t count = bd->blockCount - i < BLOCKDEVICE_IMAGE_CHUNK ? bd->blockCount - i : BLOCKDEVICE_IMAGE_CHUNK;
+		size_t got = fread(chunk, sizeof(struct fs_block), count, fp);
+		memset(&chunk[got], 0, (count - got) * sizeof(struct fs_block));
+		fs_blockdevice_writev(bd, i, count, chunk);
+		i += count;
+	}
+	free(chunk);
 	fclose(fp);
+	fs_blockdevice_resetChanges(bd);
 	return true;
 }
 
@@ -23,16 +405,361 @@ bool fs_blockdevice_save(struct fs_blockdevice * bd, char *file) {
 	if (!fp)
 		return false;
 
-	fwrite(bd->blocks, 1, sizeof(bd->blocks), fp);
+	struct fs_block * chunk = malloc(BLOCKDEVICE_IMAGE_CHUNK * sizeof(struct fs_block));
+	bool ok = chunk;
+	for (fs_block_id i = 0; i < bd->blockCount && ok;) {
+		uint32_t count = bd->blockCount - i < BLOCKDEVICE_IMAGE_CHUNK ? bd->blockCount - i : BLOCKDEVICE_IMAGE_CHUNK;
+		fs_blockdevice_readv(bd, i, count, chunk);
+		ok = fwrite(chunk, sizeof(struct fs_block), count, fp) == count;
+		i += count;
+	}
+	free(chunk);
+	ok = !fclose(fp) && ok;
+	if (ok)
+		fs_blockdevice_resetChanges(bd);
+	return ok;
+}
+
+bool fs_blockdevice_isSparseImage(char * file) {
+	FILE * fp = fopen(file, "rb");
+	if (!fp)
+		return false;
+
+	char magic[8];
+	bool sparse = fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, BLOCKDEVICE_SPARSE_MAGIC, sizeof(magic));
 	fclose(fp);
-	return true;
+	return sparse;
+}
+
+bool fs_blockdevice_saveSparse(struct fs_blockdevice * bd, char * file, const uint8_t * used, uint32_t usedCount, bool compress) {
+	struct fs_blockdevice_sparseHeader header;
+	memcpy(header.magic, BLOCKDEVICE_SPARSE_MAGIC, sizeof(header.magic));
+	header.version = BLOCKDEVICE_SPARSE_VERSION;
+	header.flags = compress ? BLOCKDEVICE_SPARSE_COMPRESSED : 0;
+	header.blockCount = bd->blockCount;
+	header.count = 0;
+
+	uint32_t mapSize = (bd->blockCount + 7) / 8;
+	uint8_t * map = calloc(mapSize, 1);
+	struct fs_block * chunk = malloc(BLOCKDEVICE_IMAGE_CHUNK * sizeof(struct fs_block));
+	FILE * fp = map && chunk ? fopen(file, "wb") : NULL;
+	if (!fp) {
+		free(map);
+		free(chunk);
+		return false;
+	}
+
+	// The header and the map are written again at the end, when they are known
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(map, 1, mapSize, fp) == mapSize;
+	for (fs_block_id i = 0; i < bd->blockCount && ok;) {
+		struct fs_blockio ios[BLOCKDEVICE_IMAGE_CHUNK];
+		uint32_t n = 0;
+		for (; i < bd->blockCount && n < BLOCKDEVICE_IMAGE_CHUNK; i++)
+			if (!used || i >= usedCount || (used[i / 8] & (1 << (i % 8)))) {
+				ios[n].id = i;
+				ios[n].block = &chunk[n];
+				n++;
+			}
+		fs_blockdevice_readList(bd, ios, n);
+
+		for (uint32_t j = 0; j < n && ok; j++) {
+			if (fs_blockdevice_isZero(ios[j].block))
+				continue;
+			map[ios[j].id / 8] |= 1 << (ios[j].id % 8);
+			header.count++;
+
+			uint8_t data[BLOCK_SIZE];
+			uint16_t size = compress ? fs_blockdevice_compress(ios[j].block, data) : BLOCK_SIZE;
+			if (compress)
+				ok = fwrite(&size, sizeof(size), 1, fp) == 1;
+			if (ok)
+				ok = fwrite(size == BLOCK_SIZE ? ios[j].block->data : data, 1, size, fp) == size;
+		}
+	}
+
+	if (ok)
+		ok = !fseek(fp, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(map, 1, mapSize, fp) == mapSize;
+	free(map);
+	free(chunk);
+	ok = !fclose(fp) && ok;
+	if (ok)
+		fs_blockdevice_resetChanges(bd);
+	return ok;
+}
+
+bool fs_blockdevice_saveChanges(struct fs_blockdevice * bd, char * file) {
+	if (!bd->changed)
+		return false;
+
+	FILE * fp = fopen(file, "r+b");
+	if (!fp)
+		return false;
+
+	// A sparse image can not be written in place, even if it happens to have the right size
+	char magic[8];
+	bool sparse = fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, BLOCKDEVICE_SPARSE_MAGIC, sizeof(magic));
+	fseeko(fp, 0, SEEK_END);
+	struct fs_block * chunk = malloc(BLOCKDEVICE_IMAGE_CHUNK * sizeof(struct fs_block));
+	bool ok = chunk && !sparse && ftello(fp) == (off_t)bd->blockCount * BLOCK_SIZE;
+
+	for (fs_block_id i = fs_blockdevice_nextChanged(bd, 0); i < bd->blockCount && ok; ) {
+		uint32_t count = 1;
+		while (count < BLOCKDEVICE_IMAGE_CHUNK && i + count < bd->blockCount && fs_blockdevice_isChanged(bd, i + count))
+			count++;
+
+		fs_blockdevice_readv(bd, i, count, chunk);
+		ok = !fseeko(fp, (off_t)i * BLOCK_SIZE, SEEK_SET) && fwrite(chunk, sizeof(struct fs_block), count, fp) == count;
+		i = fs_blockdevice_nextChanged(bd, i + count);
+	}
+	free(chunk);
+	ok = !fclose(fp) && ok;
+	if (ok)
+		fs_blockdevice_resetChanges(bd);
+	return ok;
+}
+
+bool fs_blockdevice_saveDelta(struct fs_blockdevice * bd, char * file) {
+	if (!bd->changed)
+		return false;
+
+	struct fs_blockdevice_deltaHeader header;
+	memcpy(header.magic, BLOCKDEVICE_DELTA_MAGIC, sizeof(header.magic));
+	header.version = BLOCKDEVICE_DELTA_VERSION;
+	header.blockCount = bd->blockCount;
+	header.count = fs_blockdevice_changedCount(bd);
+
+	fs_block_id * ids = malloc(header.count ? header.count * sizeof(fs_block_id) : 1);
+	struct fs_block * chunk = malloc(BLOCKDEVICE_IMAGE_CHUNK * sizeof(struct fs_block));
+	FILE * fp = ids && chunk ? fopen(file, "wb") : NULL;
+	if (!fp) {
+		free(ids);
+		free(chunk);
+		return false;
+	}
+
+	uint32_t n = 0;
+	for (fs_block_id i = fs_blockdevice_nextChanged(bd, 0); i < bd->blockCount; i = fs_blockdevice_nextChanged(bd, i + 1))
+		ids[n++] = i;
+
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(ids, sizeof(fs_block_id), header.count, fp) == header.count;
+	for (uint32_t i = 0; i < header.count && ok;) {
+		struct fs_blockio ios[BLOCKDEVICE_IMAGE_CHUNK];
+		uint32_t count = header.count - i < BLOCKDEVICE_IMAGE_CHUNK ? header.count - i : BLOCKDEVICE_IMAGE_CHUNK;
+		for (uint32_t j = 0; j < count; j++) {
+			ios[j].id = ids[i + j];
+			ios[j].block = &chunk[j];
+		}
+		fs_blockdevice_readList(bd, ios, count);
+		ok = fwrite(chunk, sizeof(struct fs_block), count, fp) == count;
+		i += count;
+	}
+	free(ids);
+	free(chunk);
+	ok = !fclose(fp) && ok;
+	if (ok)
+		fs_blockdevice_resetChanges(bd);
+	return ok;
+}
+
+bool fs_blockdevice_loadDelta(struct fs_blockdevice * bd, char * file) {
+	FILE * fp = fopen(file, "rb");
+	if (!fp)
+		return false;
+
+	struct fs_blockdevice_deltaHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, BLOCKDEVICE_DELTA_MAGIC, sizeof(header.magic))
+			|| header.version != BLOCKDEVICE_DELTA_VERSION || !header.blockCount) {
+		fclose(fp);
+		return false;
+	}
+
+	// A delta is only the changed blocks, so all of it is read and checked before the device is touched
+	fs_block_id * ids = malloc(header.count ? header.count * sizeof(fs_block_id) : 1);
+	struct fs_block * blocks = malloc(header.count ? (size_t)header.count * sizeof(struct fs_block) : 1);
+	bool ok = ids && blocks && fread(ids, sizeof(fs_block_id), header.count, fp) == header.count
+		&& fread(blocks, sizeof(struct fs_block), header.count, fp) == header.count;
+	for (uint32_t i = 0; i < header.count && ok; i++)
+		ok = ids[i] < header.blockCount;
+	fclose(fp);
+
+	if (ok)
+		ok = fs_blockdevice_resize(bd, header.blockCount);
+	for (uint32_t i = 0; i < header.count && ok;) {
+		struct fs_blockio ios[BLOCKDEVICE_IMAGE_CHUNK];
+		uint32_t count = header.count - i < BLOCKDEVICE_IMAGE_CHUNK ? header.count - i : BLOCKDEVICE_IMAGE_CHUNK;
+		for (uint32_t j = 0; j < count; j++) {
+			ios[j].id = ids[i + j];
+			ios[j].block = &blocks[i + j];
+		}
+		fs_blockdevice_writeList(bd, ios, count);
+		i += count;
+	}
+	free(ids);
+	free(blocks);
+	return ok;
 }
 
 void fs_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block) {
-	memcpy(block, &bd->blocks[idx], sizeof(*block));
+	if (idx >= bd->blockCount) {
+		memset(block, 0, sizeof(*block));
+		return;
+	}
+
+	uint64_t start = fs_blockdevice_statsBegin(bd);
+	bd->vtbl->read(bd, idx, block);
+	fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_READ, 1, start);
 }
 
 void fs_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block) {
-	memcpy(&bd->blocks[idx], block, sizeof(*block));
+	if (idx >= bd->blockCount)
+		return;
+
+	uint64_t start = fs_blockdevice_statsBegin(bd);
+	bd->vtbl->write(bd, idx, block);
+	fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_WRITE, 1, start);
+	fs_blockdevice_markChanged(bd, idx, 1);
+}
+
+/**
+ * Get how long the run of blocks at the start of \a ios is, where both the indices and the buffers follow each other.
+ */
+static uint32_t fs_blockdevice_runLength(struct fs_blockio * ios, uint32_t count) {
+	uint32_t length = 1;
+	while (length < count && ios[length].id == ios[0].id + length && ios[length].block == ios[0].block + length)
+		length++;
+	return length;
+}
+
+/**
+ * The body of fs_blockdevice_readv, which the list requests also use without counting it as a request of its own.
+ * \return How many of the blocks were inside the device
+ */
+static uint32_t fs_blockdevice_readRange(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	uint32_t inside = first >= bd->blockCount ? 0 : bd->blockCount - first;
+	if (inside > count)
+		inside = count;
+
+	if (inside > 1 && bd->vtbl->readv)
+		bd->vtbl->readv(bd, first, inside, blocks);
+	else
+		for (uint32_t i = 0; i < inside; i++)
+			bd->vtbl->read(bd, first + i, &blocks[i]);
+
+	memset(&blocks[inside], 0, (size_t)(count - inside) * sizeof(struct fs_block));
+	return inside;
+}
+
+/**
+ * The body of fs_blockdevice_writev, see fs_blockdevice_readRange.
+ * \return How many of the blocks were inside the device
+ */
+static uint32_t fs_blockdevice_writeRange(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	uint32_t inside = first >= bd->blockCount ? 0 : bd->blockCount - first;
+	if (inside > count)
+		inside = count;
+
+	if (inside > 1 && bd->vtbl->writev)
+		bd->vtbl->writev(bd, first, inside, blocks);
+	else
+		for (uint32_t i = 0; i < inside; i++)
+			bd->vtbl->write(bd, first + i, &blocks[i]);
+	fs_blockdevice_markChanged(bd, first, inside);
+	return inside;
 }
 
+void fs_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	uint64_t start = fs_blockdevice_statsBegin(bd);
+	uint32_t inside = fs_blockdevice_readRange(bd, first, count, blocks);
+	fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_READV, inside, start);
+}
+
+void fs_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	uint64_t start = fs_blockdevice_statsBegin(bd);
+	uint32_t inside = fs_blockdevice_writeRange(bd, first, count, blocks);
+	fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_WRITEV, inside, start);
+}
+
+void fs_blockdevice_readList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count) {
+	uint64_t begin = fs_blockdevice_statsBegin(bd);
+	uint32_t inside = 0;
+	uint32_t start = 0;
+	for (uint32_t i = 0; i <= count; i++) {
+		if (i < count && ios[i].id < bd->blockCount)
+			continue;
+
+		// Send the run of blocks that are inside the device as one list
+		if (i > start && bd->vtbl->readList)
+			bd->vtbl->readList(bd, &ios[start], i - start);
+		else
+			for (uint32_t j = start; j < i;) {
+				uint32_t length = fs_blockdevice_runLength(&ios[j], i - j);
+				fs_blockdevice_readRange(bd, ios[j].id, length, ios[j].block);
+				j += length;
+			}
+
+		if (i < count)
+			memset(ios[i].block, 0, sizeof(struct fs_block));
+		inside += i - start;
+		start = i + 1;
+	}
+	if (count)
+		fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_READLIST, inside, begin);
+}
+
+void fs_blockdevice_writeList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count) {
+	uint64_t begin = fs_blockdevice_statsBegin(bd);
+	uint32_t inside = 0;
+	uint32_t start = 0;
+	for (uint32_t i = 0; i <= count; i++) {
+		if (i < count && ios[i].id < bd->blockCount)
+			continue;
+
+		for (uint32_t j = start; j < i; j++)
+			fs_blockdevice_markChanged(bd, ios[j].id, 1);
+
+		if (i > start && bd->vtbl->writeList)
+			bd->vtbl->writeList(bd, &ios[start], i - start);
+		else
+			for (uint32_t j = start; j < i;) {
+				uint32_t length = fs_blockdevice_runLength(&ios[j], i - j);
+				fs_blockdevice_writeRange(bd, ios[j].id, length, ios[j].block);
+				j += length;
+			}
+
+		inside += i - start;
+		start = i + 1;
+	}
+	if (count)
+		fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_WRITELIST, inside, begin);
+}
+
+struct fs_block * fs_blockdevice_get(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * scratch) {
+	if (idx >= bd->blockCount) {
+		memset(scratch, 0, sizeof(*scratch));
+		return scratch;
+	}
+
+	uint64_t start = fs_blockdevice_statsBegin(bd);
+	struct fs_block * block = bd->vtbl->get ? bd->vtbl->get(bd, idx) : NULL;
+	if (!block) {
+		bd->vtbl->read(bd, idx, scratch);
+		block = scratch;
+	}
+	fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_GET, 1, start);
+	return block;
+}
+
+void fs_blockdevice_put(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty) {
+	if (idx >= bd->blockCount)
+		return;
+
+	uint64_t start = fs_blockdevice_statsBegin(bd);
+	if (bd->vtbl->get)
+		bd->vtbl->put(bd, idx, block, dirty);
+	else if (dirty)
+		bd->vtbl->write(bd, idx, block);
+	fs_blockdevice_statsEnd(bd, BLOCKDEVICE_OP_PUT, dirty, start);
+
+	if (dirty)
+		fs_blockdevice_markChanged(bd, idx, 1);
+}
@@ -7,25 +7,208 @@
 #include "block.h"
 
 /**
- * The maximum amount of blocks.
+ * The default amount of blocks, used when no size is given.
  * \relates fs_blockdevice
  */
-#define BLOCKDEVICE_COUNT 250
+#define BLOCKDEVICE_DEFAULT_COUNT 250
 
 /**
  * The block index type.
  * \relates fs_blockdevice
  */
-typedef uint16_t fs_block_id;
+typedef uint32_t fs_block_id;
+
+struct fs_blockdevice;
+
+/**
+ * The amount of buckets in the latency histograms.
+ * Bucket 0 counts the requests under 1us, bucket i the ones from 2^(i-1)us up to 2^i us, and the last one everything above.
+ * \relates fs_blockdevice_stats
+ */
+#define BLOCKDEVICE_STATS_BUCKETS 16
+
+/**
+ * The requests that the statistics are kept for.
+ * \relates fs_blockdevice_stats
+ */
+enum fs_blockdevice_op {
+	BLOCKDEVICE_OP_READ = 0,
+	BLOCKDEVICE_OP_WRITE,
+	BLOCKDEVICE_OP_READV,
+	BLOCKDEVICE_OP_WRITEV,
+	BLOCKDEVICE_OP_READLIST,
+	BLOCKDEVICE_OP_WRITELIST,
+	BLOCKDEVICE_OP_GET,
+	BLOCKDEVICE_OP_PUT,
+	BLOCKDEVICE_OP_SYNC,
+
+	/// The amount of requests, not a request
+	BLOCKDEVICE_OP_COUNT
+};
+
+/**
+ * The statistics for one kind of request.
+ * \relates fs_blockdevice_stats
+ */
+struct fs_blockdevice_opStats {
+	/// How many times it was requested
+	uint64_t calls;
+
+	/// How many blocks the requests moved, a put only counts if the block was dirty
+	uint64_t blocks;
+
+	/// How long the requests took in total
+	uint64_t nanoseconds;
+
+	/// The latency histogram, see ::BLOCKDEVICE_STATS_BUCKETS
+	uint64_t histogram[BLOCKDEVICE_STATS_BUCKETS];
+};
+
+/**
+ * Counters and latency histograms for the requests made to a blockdevice.
+ * \relates fs_blockdevice
+ */
+struct fs_blockdevice_stats {
+	/// Indexed with fs_blockdevice_op
+	struct fs_blockdevice_opStats ops[BLOCKDEVICE_OP_COUNT];
+};
+
+/**
+ * One block in a list of block reads or writes.
+ * \relates fs_blockdevice
+ */
+struct fs_blockio {
+	/// The blocks index
+	fs_block_id id;
+
+	/// Where to read the block to, or the block to write
+	struct fs_block * block;
+};
+
+/**
+ * The vtable for fs_blockdevice.
+ * \relates fs_blockdevice
+ */
+struct fs_blockdevice_vtbl {
+	/**
+	 * Prototype of fs_blockdevice_read.
+	 * \see fs_blockdevice_read
+	 */
+	void (*read)(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+
+	/**
+	 * Prototype of fs_blockdevice_write.
+	 * \see fs_blockdevice_write
+	 */
+	void (*write)(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+
+	/**
+	 * Prototype of fs_blockdevice_readv.
+	 * Can be NULL, then \ref read will be called for each block.
+	 * All the blocks are inside the device.
+	 * \see fs_blockdevice_readv
+	 */
+	void (*readv)(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+
+	/**
+	 * Prototype of fs_blockdevice_writev.
+	 * Can be NULL, then \ref write will be called for each block.
+	 * All the blocks are inside the device.
+	 * \see fs_blockdevice_writev
+	 */
+	void (*writev)(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+
+	/**
+	 * Prototype of fs_blockdevice_readList.
+	 * Can be NULL, then runs of adjacent blocks will be sent to \ref readv, and the rest to \ref read.
+	 * All the blocks are inside the device.
+	 * \see fs_blockdevice_readList
+	 */
+	void (*readList)(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+
+	/**
+	 * Prototype of fs_blockdevice_writeList.
+	 * Can be NULL, then runs of adjacent blocks will be sent to \ref writev, and the rest to \ref write.
+	 * All the blocks are inside the device.
+	 * \see fs_blockdevice_writeList
+	 */
+	void (*writeList)(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+
+	/**
+	 * Prototype of fs_blockdevice_get.
+	 * Can be NULL if the device can't hand out pointers to its blocks, then \ref read and \ref write will be used.
+	 * If it returns NULL the block is read into the scratch block, which \ref put will then be called with.
+	 * \see fs_blockdevice_get
+	 */
+	struct fs_block * (*get)(struct fs_blockdevice * bd, fs_block_id idx);
+
+	/**
+	 * Prototype of fs_blockdevice_put.
+	 * Can only be NULL if \ref get is NULL.
+	 * \see fs_blockdevice_put
+	 */
+	void (*put)(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty);
+
+	/**
+	 * Prototype of fs_blockdevice_resize.
+	 * \see fs_blockdevice_resize
+	 */
+	bool (*resize)(struct fs_blockdevice * bd, uint32_t blockCount);
+
+	/**
+	 * Prototype of fs_blockdevice_clear.
+	 * \see fs_blockdevice_clear
+	 */
+	void (*clear)(struct fs_blockdevice * bd);
+
+	/**
+	 * Prototype of fs_blockdevice_sync.
+	 * \see fs_blockdevice_sync
+	 */
+	void (*sync)(struct fs_blockdevice * bd);
+
+	/**
+	 * Prototype of fs_blockdevice_free.
+	 * \see fs_blockdevice_free
+	 */
+	void (*free)(struct fs_blockdevice * bd);
+};
 
 /**
- * Helper class for writing and reading blocks from the file.
+ * Helper class for writing and reading blocks.
+ * The underlying storage should inherit this for its own blockdevice structure.
  */
 struct fs_blockdevice {
-	/// The blocks
-	struct fs_block blocks[BLOCKDEVICE_COUNT];
+	/// Internal vtable stuff
+	struct fs_blockdevice_vtbl * vtbl;
+
+	/// The amount of blocks
+	uint32_t blockCount;
+
+	/// One bit per block that has been written since the last image, NULL if it is not tracked
+	uint8_t * changed;
+
+	/// The request statistics, NULL if they are not kept
+	struct fs_blockdevice_stats * stats;
 };
 
+/**
+ * Destructor for the fs_blockdevice.
+ * Everything will be synced before it is freed.
+ * \param bd The blockdevice class instance
+ * \relates fs_blockdevice
+ */
+void fs_blockdevice_free(struct fs_blockdevice * bd);
+
+/**
+ * Change the amount of blocks the device has.
+ * New blocks will be zero.
+ * \param bd The blockdevice class instance
+ * \param blockCount The new amount of blocks
+ * \return If the resize was successful
+ * \relates fs_blockdevice
+ */
+bool fs_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount);
 
 /**
  * This function sets all the blocks to zero, to emulate a format.
@@ -34,8 +217,64 @@ struct fs_blockdevice {
  */
 void fs_blockdevice_clear(struct fs_blockdevice * bd);
 
+/**
+ * Make sure all the written blocks have reached the underlying storage.
+ * \param bd The blockdevice class instance
+ * \relates fs_blockdevice
+ */
+void fs_blockdevice_sync(struct fs_blockdevice * bd);
+
+/**
+ * Start tracking which blocks are written, so images can be saved incrementally.
+ * \param bd The blockdevice class instance
+ * \return If the tracking could be started
+ * \relates fs_blockdevice
+ */
+bool fs_blockdevice_trackChanges(struct fs_blockdevice * bd);
+
+/**
+ * Forget which blocks have been written, as if the device was just saved to a image.
+ * \param bd The blockdevice class instance
+ * \relates fs_blockdevice
+ */
+void fs_blockdevice_resetChanges(struct fs_blockdevice * bd);
+
+/**
+ * Get how many blocks that have been written since the last image.
+ * \param bd The blockdevice class instance
+ * \return The amount of changed blocks, or blockCount if the changes are not tracked
+ * \relates fs_blockdevice
+ */
+uint32_t fs_blockdevice_changedCount(struct fs_blockdevice * bd);
+
+/**
+ * Start keeping statistics for the requests made to the device.
+ * \param bd The blockdevice class instance
+ * \return If the statistics could be allocated
+ * \relates fs_blockdevice
+ */
+bool fs_blockdevice_trackStats(struct fs_blockdevice * bd);
+
+/**
+ * Zero the request statistics.
+ * \param bd The blockdevice class instance
+ * \relates fs_blockdevice
+ */
+void fs_blockdevice_resetStats(struct fs_blockdevice * bd);
+
+/**
+ * Get the name of a request, for printing the statistics.
+ * \param op The request
+ * \return The name
+ * \relates fs_blockdevice_stats
+ */
+const char * fs_blockdevice_opName(enum fs_blockdevice_op op);
+
 /**
  * This functions loads all the block from a file on the host computer.
+ * The file can either be a raw image or a sparse image from fs_blockdevice_saveSparse.
+ * The device will be resized to match the size of the image.
+ * The tracked changes are reset, as the device now matches the file.
  * \param bd The blockdevice class instance
  * \param file The file on the host computer
  * \return If the load was successful
@@ -45,6 +284,7 @@ bool fs_blockdevice_load(struct fs_blockdevice * bd, char * file);
 
 /**
  * This functions saves all the block to a file on the host computer.
+ * The tracked changes are reset, as the file now matches the device.
  * \param bd The blockdevice class instance
  * \param file The file on the host computer
  * \return If the save was successful
@@ -52,6 +292,57 @@ bool fs_blockdevice_load(struct fs_blockdevice * bd, char * file);
  */
 bool fs_blockdevice_save(struct fs_blockdevice * bd, char * file);
 
+/**
+ * This functions saves the blocks to a sparse image on the host computer, which fs_blockdevice_load can load.
+ * Only blocks that are used and not zero are stored, so the size follows the used space and not the size of the device.
+ * The tracked changes are reset, as the file now matches the device.
+ * \param bd The blockdevice class instance
+ * \param file The file on the host computer
+ * \param used A bitmap of the blocks that are in use, the rest are stored as zero. NULL if all are in use
+ * \param usedCount How many blocks \a used covers, the blocks after it count as used
+ * \param compress If the blocks should be compressed
+ * \return If the save was successful
+ * \relates fs_blockdevice
+ */
+bool fs_blockdevice_saveSparse(struct fs_blockdevice * bd, char * file, const uint8_t * used, uint32_t usedCount, bool compress);
+
+/**
+ * Check if a image is a sparse image from fs_blockdevice_saveSparse, instead of a raw image.
+ * \param file The file on the host computer
+ * \return If it is a sparse image
+ * \relates fs_blockdevice
+ */
+bool fs_blockdevice_isSparseImage(char * file);
+
+/**
+ * Write the changed blocks into a image that was saved or loaded earlier, leaving the rest of it as it is.
+ * \param bd The blockdevice class instance
+ * \param file The image, it needs to have the same size as the device
+ * \return If the save was successful, if it fails a full fs_blockdevice_save is needed
+ * \relates fs_blockdevice
+ */
+bool fs_blockdevice_saveChanges(struct fs_blockdevice * bd, char * file);
+
+/**
+ * Save only the changed blocks to a delta file, which can be applied over the last image with fs_blockdevice_loadDelta.
+ * The tracked changes are reset, so the next delta will be relative to this one.
+ * \param bd The blockdevice class instance
+ * \param file The delta file on the host computer
+ * \return If the save was successful
+ * \relates fs_blockdevice
+ */
+bool fs_blockdevice_saveDelta(struct fs_blockdevice * bd, char * file);
+
+/**
+ * Apply a delta file from fs_blockdevice_saveDelta.
+ * The device will be resized to the size it had when the delta was saved, and the blocks in the delta count as changed.
+ * \param bd The blockdevice class instance
+ * \param file The delta file on the host computer
+ * \return If the load was successful, a broken delta leaves the device as it was
+ * \relates fs_blockdevice
+ */
+bool fs_blockdevice_loadDelta(struct fs_blockdevice * bd, char * file);
+
 
 /**
  * This functions reads a block at the index \a idx from the blockdevice and writes the data to \a block.
@@ -73,4 +364,79 @@ void fs_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_
  */
 void fs_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
 
+/**
+ * Read the blocks \a first to \a first + \a count - 1 into \a blocks, as one request.
+ * Blocks outside the device will be zero, like with fs_blockdevice_read.
+ * \param bd The blockdevice class instance
+ * \param first The index of the first block
+ * \param count The amount of blocks
+ * \param blocks Where to read the blocks to, room for \a count blocks
+ * \relates fs_blockdevice
+ * \relates fs_block
+ */
+void fs_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+
+/**
+ * Write \a blocks to the blocks \a first to \a first + \a count - 1, as one request.
+ * Blocks outside the device will be ignored, like with fs_blockdevice_write.
+ * \param bd The blockdevice class instance
+ * \param first The index of the first block
+ * \param count The amount of blocks
+ * \param blocks The blocks
+ * \relates fs_blockdevice
+ * \relates fs_block
+ */
+void fs_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+
+/**
+ * Read a list of blocks.
+ * The device can send them all as one batch, instead of one request per block, and blocks with adjacent
+ * indices are coalesced into one request.
+ * Blocks outside the device will be zero, like with fs_blockdevice_read.
+ * \param bd The blockdevice class instance
+ * \param ios The blocks to read, and where to read them to
+ * \param count The amount of blocks in \a ios
+ * \relates fs_blockdevice
+ * \relates fs_blockio
+ */
+void fs_blockdevice_readList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+
+/**
+ * Write a list of blocks.
+ * The device can send them all as one batch, instead of one request per block, and blocks with adjacent
+ * indices are coalesced into one request.
+ * Blocks outside the device will be ignored, like with fs_blockdevice_write.
+ * \param bd The blockdevice class instance
+ * \param ios The blocks to write
+ * \param count The amount of blocks in \a ios
+ * \relates fs_blockdevice
+ * \relates fs_blockio
+ */
+void fs_blockdevice_writeList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+
+/**
+ * Borrow the block at the index \a idx, so it can be read or modified in place.
+ * If the blockdevice can't hand out a pointer to the block, it will be read into \a scratch.
+ * The block stays pinned until it is returned with fs_blockdevice_put, the device must not be
+ * resized or freed while blocks are pinned.
+ * \param bd The blockdevice class instance
+ * \param idx The blocks index
+ * \param scratch Where to read the block to if it can't be borrowed
+ * \return The block, which is either the devices own copy or \a scratch
+ * \relates fs_blockdevice
+ * \relates fs_block
+ */
+struct fs_block * fs_blockdevice_get(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * scratch);
+
+/**
+ * Return a block that was borrowed with fs_blockdevice_get.
+ * \param bd The blockdevice class instance
+ * \param idx The blocks index
+ * \param block The block that fs_blockdevice_get returned
+ * \param dirty If the block was modified, and needs to be written
+ * \relates fs_blockdevice
+ * \relates fs_block
+ */
+void fs_blockdevice_put(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty);
+
 #endif
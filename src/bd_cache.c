@@ -0,0 +1,396 @@
+#include "bd_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+// VTables functions
+static void cache_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void cache_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void cache_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static void cache_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static void cache_blockdevice_readList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+static void cache_blockdevice_writeList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+static struct fs_block * cache_blockdevice_get(struct fs_blockdevice * bd, fs_block_id idx);
+static void cache_blockdevice_put(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty);
+static bool cache_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount);
+static void cache_blockdevice_clear(struct fs_blockdevice * bd);
+static void cache_blockdevice_sync(struct fs_blockdevice * bd);
+static void cache_blockdevice_free(struct fs_blockdevice * bd);
+
+// VTables
+static struct fs_blockdevice_vtbl cache_blockdevice_vtbl = {
+	.read = &cache_blockdevice_read,
+	.write = &cache_blockdevice_write,
+	.readv = &cache_blockdevice_readv,
+	.writev = &cache_blockdevice_writev,
+	.readList = &cache_blockdevice_readList,
+	.writeList = &cache_blockdevice_writeList,
+	.get = &cache_blockdevice_get,
+	.put = &cache_blockdevice_put,
+	.resize = &cache_blockdevice_resize,
+	.clear = &cache_blockdevice_clear,
+	.sync = &cache_blockdevice_sync,
+	.free = &cache_blockdevice_free
+};
+
+// Code
+static uint32_t cache_bucketCountFor(uint32_t capacity) {
+	uint32_t count = 64;
+	while (count < capacity && count < (UINT32_C(1) << 31))
+		count <<= 1;
+	return count;
+}
+
+static uint32_t cache_hash(struct cache_blockdevice * cache, fs_block_id id) {
+	return (id * UINT32_C(2654435761)) & (cache->bucketCount - 1);
+}
+
+static struct cache_entry * cache_find(struct cache_blockdevice * cache, fs_block_id id) {
+	for (struct cache_entry * entry = cache->buckets[cache_hash(cache, id)]; entry; entry = entry->hashNext)
+		if (entry->id == id)
+			return entry;
+	return NULL;
+}
+
+static void cache_unhash(struct cache_blockdevice * cache, struct cache_entry * entry) {
+	struct cache_entry ** it = &cache->buckets[cache_hash(cache, entry->id)];
+	while (*it != entry)
+		it = &(*it)->hashNext;
+	*it = entry->hashNext;
+}
+
+static void cache_unlink(struct cache_entry * entry) {
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+static void cache_pushFront(struct cache_blockdevice * cache, struct cache_entry * entry) {
+	entry->prev = &cache->lru;
+	entry->next = cache->lru.next;
+	cache->lru.next->prev = entry;
+	cache->lru.next = entry;
+}
+
+static void cache_writeBack(struct cache_blockdevice * cache, struct cache_entry * entry) {
+	if (!entry->dirty)
+		return;
+	fs_blockdevice_write(cache->bd, entry->id, &entry->block);
+	entry->dirty = false;
+	cache->writeBacks++;
+}
+
+/**
+ * Remove the least recently used entry that isn't pinned, dirty entries are written first.
+ * \return The entry which is no longer in the cache, or NULL if every entry is pinned
+ */
+static struct cache_entry * cache_evict(struct cache_blockdevice * cache) {
+	struct cache_entry * entry = cache->lru.prev;
+	while (entry != &cache->lru && entry->pins)
+		entry = entry->prev;
+	if (entry == &cache->lru)
+		return NULL;
+
+	cache_writeBack(cache, entry);
+	cache_unhash(cache, entry);
+	cache_unlink(entry);
+	cache->count--;
+	cache->evictions++;
+	return entry;
+}
+
+static void cache_trim(struct cache_blockdevice * cache) {
+	while (cache->count > cache->capacity) {
+		struct cache_entry * entry = cache_evict(cache);
+		if (!entry)
+			break;
+		free(entry);
+	}
+}
+
+/**
+ * Find the entry for a block, or make room for it.
+ * \param load If the block needs to be read from the cached device if it is not in the cache
+ * \return The entry, marked as the most recently used, or NULL if it could not be allocated
+ */
+static struct cache_entry * cache_lookup(struct cache_blockdevice * cache, fs_block_id id, bool load) {
+	struct cache_entry * entry = cache_find(cache, id);
+	if (entry) {
+		cache->hits++;
+		cache_unlink(entry);
+		cache_pushFront(cache, entry);
+		return entry;
+	}
+	cache->misses++;
+
+	if (cache->count >= cache->capacity)
+		entry = cache_evict(cache);
+	if (!entry)
+		entry = malloc(sizeof(struct cache_entry));
+	if (!entry)
+		return NULL;
+
+	entry->id = id;
+	entry->dirty = false;
+	entry->pins = 0;
+	if (load)
+		fs_blockdevice_read(cache->bd, id, &entry->block);
+
+	uint32_t bucket = cache_hash(cache, id);
+	entry->hashNext = cache->buckets[bucket];
+	cache->buckets[bucket] = entry;
+	cache_pushFront(cache, entry);
+	cache->count++;
+	return entry;
+}
+
+/**
+ * Throw away the entries for the blocks from \a first and up, without writing them.
+ */
+static void cache_drop(struct cache_blockdevice * cache, fs_block_id first) {
+	struct cache_entry * entry = cache->lru.next;
+	while (entry != &cache->lru) {
+		struct cache_entry * next = entry->next;
+		if (entry->id >= first) {
+			cache_unhash(cache, entry);
+			cache_unlink(entry);
+			cache->count--;
+			free(entry);
+		}
+		entry = next;
+	}
+}
+
+static bool cache_rehash(struct cache_blockdevice * cache, uint32_t bucketCount) {
+	struct cache_entry ** buckets = calloc(bucketCount, sizeof(struct cache_entry *));
+	if (!buckets)
+		return false;
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->bucketCount = bucketCount;
+	for (struct cache_entry * entry = cache->lru.next; entry != &cache->lru; entry = entry->next) {
+		uint32_t bucket = cache_hash(cache, entry->id);
+		entry->hashNext = buckets[bucket];
+		buckets[bucket] = entry;
+	}
+	return true;
+}
+
+static int cache_compareEntries(const void * a, const void * b) {
+	fs_block_id idA = (*(struct cache_entry * const *)a)->id;
+	fs_block_id idB = (*(struct cache_entry * const *)b)->id;
+	return (idA > idB) - (idA < idB);
+}
+
+struct cache_blockdevice * cache_blockdevice_init(struct fs_blockdevice * bd, uint32_t capacity) {
+	struct cache_blockdevice * cache = malloc(sizeof(struct cache_blockdevice));
+	if (!cache)
+		return NULL;
+
+	cache->base.vtbl = &cache_blockdevice_vtbl;
+	cache->base.blockCount = bd->blockCount;
+	cache->base.changed = NULL;
+	cache->base.stats = NULL;
+	cache->bd = bd;
+	cache->capacity = capacity;
+	cache->count = 0;
+	cache->bucketCount = cache_bucketCountFor(capacity);
+	cache->buckets = calloc(cache->bucketCount, sizeof(struct cache_entry *));
+	cache->lru.prev = cache->lru.next = &cache->lru;
+	cache_blockdevice_resetStats(cache);
+	if (!cache->buckets) {
+		free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+void cache_blockdevice_setCapacity(struct cache_blockdevice * cache, uint32_t capacity) {
+	cache->capacity = capacity;
+	uint32_t bucketCount = cache_bucketCountFor(capacity);
+	if (bucketCount != cache->bucketCount)
+		cache_rehash(cache, bucketCount); // If it fails the old buckets are still used, they are only slower
+	cache_trim(cache);
+}
+
+uint32_t cache_blockdevice_dirtyCount(struct cache_blockdevice * cache) {
+	uint32_t count = 0;
+	for (struct cache_entry * entry = cache->lru.next; entry != &cache->lru; entry = entry->next)
+		count += entry->dirty;
+	return count;
+}
+
+void cache_blockdevice_resetStats(struct cache_blockdevice * cache) {
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->evictions = 0;
+	cache->writeBacks = 0;
+}
+
+static void cache_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	struct cache_entry * entry = cache_lookup(cache, idx, true);
+	if (!entry)
+		return fs_blockdevice_read(cache->bd, idx, block);
+
+	memcpy(block, &entry->block, sizeof(*block));
+	cache_trim(cache);
+}
+
+static void cache_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	struct cache_entry * entry = cache_lookup(cache, idx, false);
+	if (!entry)
+		return fs_blockdevice_write(cache->bd, idx, block);
+
+	memcpy(&entry->block, block, sizeof(*block));
+	entry->dirty = true;
+	cache_trim(cache);
+}
+
+static void cache_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct fs_blockio * ios = malloc(count * sizeof(struct fs_blockio));
+	if (!ios) {
+		for (uint32_t i = 0; i < count; i++)
+			cache_blockdevice_read(bd, first + i, &blocks[i]);
+		return;
+	}
+
+	// The misses in the range will be adjacent, so the cached device gets them as few requests
+	for (uint32_t i = 0; i < count; i++) {
+		ios[i].id = first + i;
+		ios[i].block = &blocks[i];
+	}
+	cache_blockdevice_readList(bd, ios, count);
+	free(ios);
+}
+
+static void cache_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	for (uint32_t i = 0; i < count; i++)
+		cache_blockdevice_write(bd, first + i, &blocks[i]);
+}
+
+static void cache_blockdevice_readList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	struct fs_blockio * misses = malloc(count * sizeof(struct fs_blockio));
+	if (!misses) {
+		for (uint32_t i = 0; i < count; i++)
+			cache_blockdevice_read(bd, ios[i].id, ios[i].block);
+		return;
+	}
+
+	// Pin every block first, so the misses can be read from the cached device as one list
+	uint32_t missCount = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		struct cache_entry * entry = cache_find(cache, ios[i].id);
+		if (entry)
+			cache->hits++;
+		else if ((entry = cache_lookup(cache, ios[i].id, false))) {
+			misses[missCount].id = entry->id;
+			misses[missCount++].block = &entry->block;
+		}
+
+		if (entry)
+			entry->pins++;
+		else
+			fs_blockdevice_read(cache->bd, ios[i].id, ios[i].block);
+	}
+	fs_blockdevice_readList(cache->bd, misses, missCount);
+	free(misses);
+
+	for (uint32_t i = 0; i < count; i++) {
+		struct cache_entry * entry = cache_find(cache, ios[i].id);
+		if (!entry)
+			continue;
+		memcpy(ios[i].block, &entry->block, sizeof(struct fs_block));
+		cache_unlink(entry);
+		cache_pushFront(cache, entry);
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		struct cache_entry * entry = cache_find(cache, ios[i].id);
+		if (entry)
+			entry->pins--;
+	}
+	cache_trim(cache);
+}
+
+static void cache_blockdevice_writeList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count) {
+	for (uint32_t i = 0; i < count; i++)
+		cache_blockdevice_write(bd, ios[i].id, ios[i].block);
+}
+
+static struct fs_block * cache_blockdevice_get(struct fs_blockdevice * bd, fs_block_id idx) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	struct cache_entry * entry = cache_lookup(cache, idx, true);
+	if (!entry)
+		return NULL;
+
+	entry->pins++;
+	return &entry->block;
+}
+
+static void cache_blockdevice_put(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	struct cache_entry * entry = cache_find(cache, idx);
+	if (!entry || &entry->block != block) { // get fell back to the scratch block
+		if (dirty)
+			fs_blockdevice_write(cache->bd, idx, block);
+		return;
+	}
+
+	entry->pins--;
+	entry->dirty |= dirty;
+	cache_trim(cache);
+}
+
+static bool cache_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	if (!fs_blockdevice_resize(cache->bd, blockCount))
+		return false;
+
+	cache_drop(cache, blockCount);
+	cache->base.blockCount = cache->bd->blockCount;
+	return true;
+}
+
+static void cache_blockdevice_clear(struct fs_blockdevice * bd) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	cache_drop(cache, 0);
+	fs_blockdevice_clear(cache->bd);
+}
+
+static void cache_blockdevice_sync(struct fs_blockdevice * bd) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	uint32_t dirtyCount = cache_blockdevice_dirtyCount(cache);
+	struct cache_entry ** dirty = dirtyCount ? malloc(dirtyCount * sizeof(struct cache_entry *)) : NULL;
+	struct fs_blockio * ios = dirtyCount ? malloc(dirtyCount * sizeof(struct fs_blockio)) : NULL;
+
+	if (dirty && ios) { // Write in block order as one list, so the device sees it as one sequential pass
+		uint32_t i = 0;
+		for (struct cache_entry * entry = cache->lru.next; entry != &cache->lru; entry = entry->next)
+			if (entry->dirty)
+				dirty[i++] = entry;
+		qsort(dirty, dirtyCount, sizeof(struct cache_entry *), &cache_compareEntries);
+		for (i = 0; i < dirtyCount; i++) {
+			ios[i].id = dirty[i]->id;
+			ios[i].block = &dirty[i]->block;
+			dirty[i]->dirty = false;
+		}
+		cache->writeBacks += dirtyCount;
+		fs_blockdevice_writeList(cache->bd, ios, dirtyCount);
+	} else
+		for (struct cache_entry * entry = cache->lru.next; entry != &cache->lru; entry = entry->next)
+			cache_writeBack(cache, entry);
+	free(dirty);
+	free(ios);
+
+	fs_blockdevice_sync(cache->bd);
+}
+
+static void cache_blockdevice_free(struct fs_blockdevice * bd) {
+	struct cache_blockdevice * cache = (struct cache_blockdevice *)bd;
+	cache_drop(cache, 0);
+	free(cache->buckets);
+	fs_blockdevice_free(cache->bd);
+	free(cache);
+}
@@ -0,0 +1,113 @@
+#ifndef BD_CACHE_H
+#define BD_CACHE_H
+
+#include "bd.h"
+
+/**
+ * The default amount of blocks a cache_blockdevice keeps.
+ * \relates cache_blockdevice
+ */
+#define BLOCKCACHE_DEFAULT_CAPACITY 1024
+
+/**
+ * A cached block.
+ * \relates cache_blockdevice
+ */
+struct cache_entry {
+	/// The block index
+	fs_block_id id;
+
+	/// If the block has been modified since it was read
+	bool dirty;
+
+	/// How many fs_blockdevice_get that have not been put yet
+	uint32_t pins;
+
+	/// The next entry in the same hash bucket
+	struct cache_entry * hashNext;
+
+	/// The more recently used entry
+	struct cache_entry * prev;
+
+	/// The less recently used entry
+	struct cache_entry * next;
+
+	/// The data
+	struct fs_block block;
+};
+
+/**
+ * A write-back block cache in front of another blockdevice.
+ * Blocks are evicted in least recently used order, and dirty blocks are only written when they are
+ * evicted or when the device is synced.
+ * \relates fs_blockdevice
+ */
+struct cache_blockdevice {
+	/// The base cache_blockdevice extends
+	struct fs_blockdevice base;
+
+	/// The blockdevice that is cached, it is owned by the cache
+	struct fs_blockdevice * bd;
+
+	/// How many blocks that will be kept, pinned blocks can make it go over this
+	uint32_t capacity;
+
+	/// How many blocks that are currently cached
+	uint32_t count;
+
+	/// The amount of hash buckets, always a power of two
+	uint32_t bucketCount;
+
+	/// The hash buckets
+	struct cache_entry ** buckets;
+
+	/// The sentinel for the LRU list, lru.next is the most recently used entry and lru.prev the least
+	struct cache_entry lru;
+
+	/// How many block lookups that found the block in the cache
+	uint64_t hits;
+
+	/// How many block lookups that did not find the block in the cache
+	uint64_t misses;
+
+	/// How many blocks that have been evicted to make room
+	uint64_t evictions;
+
+	/// How many dirty blocks that have been written to the cached device
+	uint64_t writeBacks;
+};
+
+/**
+ * Constructor for the cache_blockdevice.
+ * \param bd The blockdevice to cache, the cache takes ownership of it if it succeeds
+ * \param capacity How many blocks to keep in memory, 0 makes it write-through
+ * \return The cache_blockdevice instance, or NULL if it could not be allocated
+ * \relates cache_blockdevice
+ */
+struct cache_blockdevice * cache_blockdevice_init(struct fs_blockdevice * bd, uint32_t capacity);
+
+/**
+ * Change how many blocks that are kept in memory.
+ * Blocks will be evicted until the cache fits.
+ * \param cache The cache_blockdevice instance
+ * \param capacity How many blocks to keep in memory, 0 makes it write-through
+ * \relates cache_blockdevice
+ */
+void cache_blockdevice_setCapacity(struct cache_blockdevice * cache, uint32_t capacity);
+
+/**
+ * Get how many of the cached blocks that are dirty.
+ * \param cache The cache_blockdevice instance
+ * \return The amount of dirty blocks
+ * \relates cache_blockdevice
+ */
+uint32_t cache_blockdevice_dirtyCount(struct cache_blockdevice * cache);
+
+/**
+ * Zero the hit, miss, eviction and write back counters.
+ * \param cache The cache_blockdevice instance
+ * \relates cache_blockdevice
+ */
+void cache_blockdevice_resetStats(struct cache_blockdevice * cache);
+
+#endif
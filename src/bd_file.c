@@ -0,0 +1,227 @@
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#undef BLOCK_SIZE // linux/fs.h has its own BLOCK_SIZE, only BLKGETSIZE64 is wanted from it
+#include "bd_file.h"
+#include "bd_uring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/**
+ * The most blocks that are coalesced into one preadv/pwritev.
+ * \relates file_blockdevice
+ */
+#define FILE_BLOCKDEVICE_MAX_RUN 64
+
+// VTables functions
+static void file_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void file_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void file_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static void file_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static void file_blockdevice_readList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+static void file_blockdevice_writeList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+static bool file_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount);
+static void file_blockdevice_clear(struct fs_blockdevice * bd);
+static void file_blockdevice_sync(struct fs_blockdevice * bd);
+static void file_blockdevice_free(struct fs_blockdevice * bd);
+
+// VTables
+static struct fs_blockdevice_vtbl file_blockdevice_vtbl = {
+	.read = &file_blockdevice_read,
+	.write = &file_blockdevice_write,
+	.readv = &file_blockdevice_readv,
+	.writev = &file_blockdevice_writev,
+	.readList = &file_blockdevice_readList,
+	.writeList = &file_blockdevice_writeList,
+	.get = NULL,
+	.put = NULL,
+	.resize = &file_blockdevice_resize,
+	.clear = &file_blockdevice_clear,
+	.sync = &file_blockdevice_sync,
+	.free = &file_blockdevice_free
+};
+
+// Code
+int file_blockdevice_open(const char * file, uint32_t * blockCount, bool * isBlockDevice) {
+	int fd = open(file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	uint64_t size = st.st_size;
+	*isBlockDevice = S_ISBLK(st.st_mode);
+	if (*isBlockDevice && ioctl(fd, BLKGETSIZE64, &size)) {
+		close(fd);
+		return -1;
+	}
+
+	if (!*blockCount)
+		*blockCount = size / BLOCK_SIZE > UINT32_MAX ? UINT32_MAX : size / BLOCK_SIZE;
+	else if (size < (uint64_t)*blockCount * BLOCK_SIZE && (*isBlockDevice || ftruncate(fd, (off_t)*blockCount * BLOCK_SIZE))) {
+		close(fd);
+		return -1;
+	}
+
+	if (!*blockCount) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+struct file_blockdevice * file_blockdevice_init(const char * file, uint32_t blockCount) {
+	bool isBlockDevice;
+	int fd = file_blockdevice_open(file, &blockCount, &isBlockDevice);
+	if (fd < 0)
+		return NULL;
+
+	struct file_blockdevice * bd = malloc(sizeof(struct file_blockdevice));
+	if (!bd) {
+		close(fd);
+		return NULL;
+	}
+
+	bd->base.vtbl = &file_blockdevice_vtbl;
+	bd->base.blockCount = blockCount;
+	bd->base.changed = NULL;
+	bd->base.stats = NULL;
+	bd->fd = fd;
+	bd->isBlockDevice = isBlockDevice;
+	bd->uring = NULL;
+	return bd;
+}
+
+bool file_blockdevice_useUring(struct file_blockdevice * bd, uint32_t depth) {
+	if (!bd->uring)
+		bd->uring = fs_uring_init(depth);
+	return bd->uring;
+}
+
+/**
+ * pread or pwrite until all of \a size is done.
+ * \return How much that was done, less than \a size if it hit the end of the file or a error
+ */
+static size_t file_blockdevice_io(int fd, bool write, void * buffer, size_t size, off_t offset) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t ret = write ? pwrite(fd, (uint8_t *)buffer + done, size - done, offset + done) : pread(fd, (uint8_t *)buffer + done, size - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) // Past the end of the file, or a error
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static void file_blockdevice_read(struct fs_blockdevice * bd_, fs_block_id idx, struct fs_block * block) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	size_t done = file_blockdevice_io(bd->fd, false, block, sizeof(struct fs_block), (off_t)idx * BLOCK_SIZE);
+	memset((uint8_t *)block + done, 0, sizeof(struct fs_block) - done);
+}
+
+static void file_blockdevice_write(struct fs_blockdevice * bd_, fs_block_id idx, struct fs_block * block) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	file_blockdevice_io(bd->fd, true, block, sizeof(struct fs_block), (off_t)idx * BLOCK_SIZE);
+}
+
+static void file_blockdevice_readv(struct fs_blockdevice * bd_, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	size_t size = (size_t)count * sizeof(struct fs_block);
+	size_t done = file_blockdevice_io(bd->fd, false, blocks, size, (off_t)first * BLOCK_SIZE);
+	memset((uint8_t *)blocks + done, 0, size - done);
+}
+
+static void file_blockdevice_writev(struct fs_blockdevice * bd_, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	file_blockdevice_io(bd->fd, true, blocks, (size_t)count * sizeof(struct fs_block), (off_t)first * BLOCK_SIZE);
+}
+
+/**
+ * Send a list of blocks with one preadv/pwritev per run of adjacent blocks.
+ */
+static void file_blockdevice_listIO(struct fs_blockdevice * bd_, bool write, struct fs_blockio * ios, uint32_t count) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	void (*single)(struct fs_blockdevice *, fs_block_id, struct fs_block *) = write ? &file_blockdevice_write : &file_blockdevice_read;
+	struct iovec iov[FILE_BLOCKDEVICE_MAX_RUN];
+
+	for (uint32_t i = 0; i < count;) {
+		uint32_t length = 1;
+		while (i + length < count && length < FILE_BLOCKDEVICE_MAX_RUN && ios[i + length].id == ios[i].id + length)
+			length++;
+
+		ssize_t ret = -1;
+		if (length > 1) {
+			for (uint32_t j = 0; j < length; j++) {
+				iov[j].iov_base = ios[i + j].block;
+				iov[j].iov_len = sizeof(struct fs_block);
+			}
+			off_t offset = (off_t)ios[i].id * BLOCK_SIZE;
+			do
+				ret = write ? pwritev(bd->fd, iov, length, offset) : preadv(bd->fd, iov, length, offset);
+			while (ret < 0 && errno == EINTR);
+		}
+
+		if (ret != (ssize_t)(length * sizeof(struct fs_block))) // A single block, or it was short, redo it one block at a time
+			for (uint32_t j = 0; j < length; j++)
+				single(bd_, ios[i + j].id, ios[i + j].block);
+		i += length;
+	}
+}
+
+static void file_blockdevice_readList(struct fs_blockdevice * bd_, struct fs_blockio * ios, uint32_t count) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	if (bd->uring && count > 1)
+		return fs_uring_transfer(bd->uring, bd->fd, false, ios, count, bd_, &file_blockdevice_read);
+	file_blockdevice_listIO(bd_, false, ios, count);
+}
+
+static void file_blockdevice_writeList(struct fs_blockdevice * bd_, struct fs_blockio * ios, uint32_t count) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	if (bd->uring && count > 1)
+		return fs_uring_transfer(bd->uring, bd->fd, true, ios, count, bd_, &file_blockdevice_write);
+	file_blockdevice_listIO(bd_, true, ios, count);
+}
+
+static bool file_blockdevice_resize(struct fs_blockdevice * bd_, uint32_t blockCount) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	if (bd->isBlockDevice || ftruncate(bd->fd, (off_t)blockCount * BLOCK_SIZE))
+		return false;
+	bd->base.blockCount = blockCount;
+	return true;
+}
+
+static void file_blockdevice_clear(struct fs_blockdevice * bd_) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	// Truncating a file is the cheap way to zero it, and it will also be sparse afterwards
+	if (!bd->isBlockDevice && !ftruncate(bd->fd, 0) && !ftruncate(bd->fd, (off_t)bd->base.blockCount * BLOCK_SIZE))
+		return;
+
+	struct fs_block zero[FILE_BLOCKDEVICE_MAX_RUN];
+	memset(zero, 0, sizeof(zero));
+	for (fs_block_id i = 0; i < bd->base.blockCount; i += FILE_BLOCKDEVICE_MAX_RUN) {
+		uint32_t count = bd->base.blockCount - i < FILE_BLOCKDEVICE_MAX_RUN ? bd->base.blockCount - i : FILE_BLOCKDEVICE_MAX_RUN;
+		file_blockdevice_writev(bd_, i, count, zero);
+	}
+}
+
+static void file_blockdevice_sync(struct fs_blockdevice * bd_) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	fsync(bd->fd);
+}
+
+static void file_blockdevice_free(struct fs_blockdevice * bd_) {
+	struct file_blockdevice * bd = (struct file_blockdevice *)bd_;
+	fs_uring_free(bd->uring);
+	close(bd->fd);
+	free(bd);
+}
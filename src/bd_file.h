@@ -0,0 +1,60 @@
+#ifndef BD_FILE_H
+#define BD_FILE_H
+
+#include "bd.h"
+
+struct fs_uring;
+
+/**
+ * A blockdevice that reads and writes the blocks directly from a file or device on the host computer.
+ * Nothing is kept in memory, every read and write is a pread/pwrite call.
+ * Lists of blocks are sent as io_uring batches, if it has been enabled with file_blockdevice_useUring.
+ * \relates fs_blockdevice
+ */
+struct file_blockdevice {
+	/// The base file_blockdevice extends
+	struct fs_blockdevice base;
+
+	/// The file descriptor
+	int fd;
+
+	/// If \ref fd is a block device, which can't be resized
+	bool isBlockDevice;
+
+	/// The io_uring used for lists of blocks, NULL if they are done with pread/pwrite
+	struct fs_uring * uring;
+};
+
+/**
+ * Constructor for the file_blockdevice.
+ * The file will be created if it does not exist.
+ * \param file The file or device on the host computer
+ * \param blockCount The amount of blocks, if 0 it will be based on the size of \a file.
+ * If the file is smaller than this, it will be extended.
+ * \return The file_blockdevice instance, or NULL if it could not be opened or allocated
+ * \relates file_blockdevice
+ */
+struct file_blockdevice * file_blockdevice_init(const char * file, uint32_t blockCount);
+
+/**
+ * Send lists of blocks to the file as io_uring batches.
+ * \param bd The file_blockdevice instance
+ * \param depth The biggest batch that is sent in one go
+ * \return If io_uring is available, else pread/pwrite will still be used
+ * \relates file_blockdevice
+ */
+bool file_blockdevice_useUring(struct file_blockdevice * bd, uint32_t depth);
+
+/**
+ * Open a file or device on the host computer to be used as a blockdevice.
+ * Helper for the backends that work on host files.
+ * \param file The file or device on the host computer
+ * \param blockCount The wanted amount of blocks, if 0 it will be set based on the size of \a file.
+ * If the file is smaller than this, it will be extended.
+ * \param isBlockDevice Returns if \a file is a block device
+ * \return The file descriptor, or -1 if it could not be opened
+ * \relates file_blockdevice
+ */
+int file_blockdevice_open(const char * file, uint32_t * blockCount, bool * isBlockDevice);
+
+#endif
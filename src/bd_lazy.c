@@ -0,0 +1,246 @@
+#include "bd_lazy.h"
+#include <stdlib.h>
+#include <string.h>
+
+// VTables functions
+static void lazy_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void lazy_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void lazy_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static void lazy_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static void lazy_blockdevice_readList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+static void lazy_blockdevice_writeList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count);
+static bool lazy_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount);
+static void lazy_blockdevice_clear(struct fs_blockdevice * bd);
+static void lazy_blockdevice_sync(struct fs_blockdevice * bd);
+static void lazy_blockdevice_free(struct fs_blockdevice * bd);
+
+// VTables
+static struct fs_blockdevice_vtbl lazy_blockdevice_vtbl = {
+	.read = &lazy_blockdevice_read,
+	.write = &lazy_blockdevice_write,
+	.readv = &lazy_blockdevice_readv,
+	.writev = &lazy_blockdevice_writev,
+	.readList = &lazy_blockdevice_readList,
+	.writeList = &lazy_blockdevice_writeList,
+	.get = NULL,
+	.put = NULL,
+	.resize = &lazy_blockdevice_resize,
+	.clear = &lazy_blockdevice_clear,
+	.sync = &lazy_blockdevice_sync,
+	.free = &lazy_blockdevice_free
+};
+
+// Code
+static bool lazy_isMissing(struct lazy_blockdevice * lazy, fs_block_id idx) {
+	return lazy->missingCount && (lazy->missing[idx / 8] & (1 << (idx % 8)));
+}
+
+static void lazy_dropImage(struct lazy_blockdevice * lazy) {
+	fs_blockdevice_free(lazy->image);
+	lazy->image = NULL;
+	lazy->missingCount = 0;
+}
+
+/**
+ * Mark a block as being in the wrapped device, the image is closed when the last one is.
+ */
+static void lazy_present(struct lazy_blockdevice * lazy, fs_block_id idx) {
+	if (!lazy_isMissing(lazy, idx))
+		return;
+
+	lazy->missing[idx / 8] &= ~(1 << (idx % 8));
+	if (!--lazy->missingCount)
+		lazy_dropImage(lazy);
+}
+
+/**
+ * Copy a run of missing blocks from the image into the wrapped device.
+ * \param blocks Where the blocks are read to, room for \a count blocks
+ */
+static void lazy_load(struct lazy_blockdevice * lazy, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	fs_blockdevice_readv(lazy->image, first, count, blocks);
+	fs_blockdevice_writev(lazy->bd, first, count, blocks);
+	for (uint32_t i = 0; i < count; i++)
+		lazy_present(lazy, first + i);
+}
+
+struct lazy_blockdevice * lazy_blockdevice_init(struct fs_blockdevice * bd) {
+	struct lazy_blockdevice * lazy = malloc(sizeof(struct lazy_blockdevice));
+	if (!lazy)
+		return NULL;
+
+	lazy->base.vtbl = &lazy_blockdevice_vtbl;
+	lazy->base.blockCount = bd->blockCount;
+	lazy->base.changed = NULL;
+	lazy->base.stats = NULL;
+	lazy->bd = bd;
+	lazy->image = NULL;
+	lazy->missing = NULL;
+	lazy->missingCount = 0;
+	return lazy;
+}
+
+bool lazy_blockdevice_setImage(struct lazy_blockdevice * lazy, struct fs_blockdevice * image) {
+	if (!fs_blockdevice_resize((struct fs_blockdevice *)lazy, image->blockCount))
+		return false;
+
+	uint8_t * missing = realloc(lazy->missing, (image->blockCount + 7) / 8);
+	if (!missing)
+		return false;
+
+	if (lazy->image)
+		fs_blockdevice_free(lazy->image);
+	memset(missing, 0xFF, (image->blockCount + 7) / 8);
+	lazy->missing = missing;
+	lazy->missingCount = image->blockCount;
+	lazy->image = image;
+	return true;
+}
+
+void lazy_blockdevice_fill(struct lazy_blockdevice * lazy) {
+	struct fs_block readahead[LAZY_BLOCKDEVICE_READAHEAD];
+	struct fs_block * blocks = lazy->missingCount ? malloc(LAZY_BLOCKDEVICE_FILL_CHUNK * sizeof(struct fs_block)) : NULL;
+	uint32_t chunk = blocks ? LAZY_BLOCKDEVICE_FILL_CHUNK : LAZY_BLOCKDEVICE_READAHEAD;
+	for (fs_block_id i = 0; lazy->missingCount && i < lazy->base.blockCount;) {
+		if (!lazy_isMissing(lazy, i)) {
+			i++;
+			continue;
+		}
+
+		uint32_t count = 1;
+		while (count < chunk && i + count < lazy->base.blockCount && lazy_isMissing(lazy, i + count))
+			count++;
+		lazy_load(lazy, i, count, blocks ? blocks : readahead);
+		i += count;
+	}
+	free(blocks);
+}
+
+static void lazy_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	if (!lazy_isMissing(lazy, idx))
+		return fs_blockdevice_read(lazy->bd, idx, block);
+
+	// The blocks after it are likely to be used next, so they are read in the same go
+	struct fs_block blocks[LAZY_BLOCKDEVICE_READAHEAD];
+	uint32_t count = 1;
+	while (count < LAZY_BLOCKDEVICE_READAHEAD && idx + count < lazy->base.blockCount && lazy_isMissing(lazy, idx + count))
+		count++;
+	lazy_load(lazy, idx, count, blocks);
+	memcpy(block, &blocks[0], sizeof(*block));
+}
+
+static void lazy_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	fs_blockdevice_write(lazy->bd, idx, block);
+	lazy_present(lazy, idx);
+}
+
+static void lazy_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct fs_blockio * ios = malloc(count * sizeof(struct fs_blockio));
+	if (!ios) {
+		for (uint32_t i = 0; i < count; i++)
+			lazy_blockdevice_read(bd, first + i, &blocks[i]);
+		return;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		ios[i].id = first + i;
+		ios[i].block = &blocks[i];
+	}
+	lazy_blockdevice_readList(bd, ios, count);
+	free(ios);
+}
+
+static void lazy_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	fs_blockdevice_writev(lazy->bd, first, count, blocks);
+	for (uint32_t i = 0; i < count; i++)
+		lazy_present(lazy, first + i);
+}
+
+static void lazy_blockdevice_readList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	if (!lazy->missingCount)
+		return fs_blockdevice_readList(lazy->bd, ios, count);
+
+	struct fs_blockio * sorted = malloc(count * sizeof(struct fs_blockio));
+	if (!sorted) {
+		for (uint32_t i = 0; i < count; i++)
+			lazy_blockdevice_read(bd, ios[i].id, ios[i].block);
+		return;
+	}
+
+	// The missing blocks go first and are read from the image as one list, the rest from the device
+	uint32_t missing = 0;
+	for (uint32_t i = 0; i < count; i++)
+		if (lazy_isMissing(lazy, ios[i].id))
+			sorted[missing++] = ios[i];
+	uint32_t present = missing;
+	for (uint32_t i = 0; i < count; i++)
+		if (!lazy_isMissing(lazy, ios[i].id))
+			sorted[present++] = ios[i];
+
+	fs_blockdevice_readList(lazy->bd, &sorted[missing], count - missing);
+	if (missing) {
+		fs_blockdevice_readList(lazy->image, sorted, missing);
+		fs_blockdevice_writeList(lazy->bd, sorted, missing);
+		for (uint32_t i = 0; i < missing; i++)
+			lazy_present(lazy, sorted[i].id);
+	}
+	free(sorted);
+}
+
+static void lazy_blockdevice_writeList(struct fs_blockdevice * bd, struct fs_blockio * ios, uint32_t count) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	fs_blockdevice_writeList(lazy->bd, ios, count);
+	for (uint32_t i = 0; i < count; i++)
+		lazy_present(lazy, ios[i].id);
+}
+
+static bool lazy_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	uint32_t oldCount = lazy->base.blockCount;
+	if (lazy->missingCount && blockCount > oldCount) {
+		uint8_t * missing = realloc(lazy->missing, (blockCount + 7) / 8);
+		if (!missing) // The new blocks can not be told apart from the missing ones, so the image is read in first
+			lazy_blockdevice_fill(lazy);
+		else { // The new blocks were never in the image
+			memset(&missing[(oldCount + 7) / 8], 0, (blockCount + 7) / 8 - (oldCount + 7) / 8);
+			if (oldCount % 8)
+				missing[oldCount / 8] &= (1 << (oldCount % 8)) - 1;
+			lazy->missing = missing;
+		}
+	}
+
+	if (!fs_blockdevice_resize(lazy->bd, blockCount))
+		return false;
+
+	// The blocks that are cut off are not missing anymore
+	for (fs_block_id i = blockCount; lazy->missingCount && i < oldCount; i++)
+		lazy_present(lazy, i);
+	lazy->base.blockCount = lazy->bd->blockCount;
+	return true;
+}
+
+static void lazy_blockdevice_clear(struct fs_blockdevice * bd) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	if (lazy->image)
+		lazy_dropImage(lazy);
+	fs_blockdevice_clear(lazy->bd);
+}
+
+static void lazy_blockdevice_sync(struct fs_blockdevice * bd) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	// The missing blocks are still in the image, only the saves of images need all of them
+	fs_blockdevice_sync(lazy->bd);
+}
+
+static void lazy_blockdevice_free(struct fs_blockdevice * bd) {
+	struct lazy_blockdevice * lazy = (struct lazy_blockdevice *)bd;
+	if (lazy->image)
+		lazy_dropImage(lazy);
+	free(lazy->missing);
+	fs_blockdevice_free(lazy->bd);
+	free(lazy);
+}
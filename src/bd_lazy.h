@@ -0,0 +1,69 @@
+#ifndef BD_LAZY_H
+#define BD_LAZY_H
+
+#include "bd.h"
+
+/**
+ * How many adjacent missing blocks that are read from the image when one of them is first used.
+ * \relates lazy_blockdevice
+ */
+#define LAZY_BLOCKDEVICE_READAHEAD 8
+
+/**
+ * How many blocks lazy_blockdevice_fill reads from the image in one go.
+ * \relates lazy_blockdevice
+ */
+#define LAZY_BLOCKDEVICE_FILL_CHUNK 64
+
+/**
+ * A blockdevice that is restored from a image on demand.
+ * The blocks are read from the image the first time they are used and then kept in the device it wraps,
+ * so a image can be used without first reading all of it. A sync only syncs the wrapped device, the missing blocks
+ * are only all read by lazy_blockdevice_fill.
+ * A PNFS on it reads the metadata of all its groups when it is mounted, so that part of the image is read up front.
+ * \relates fs_blockdevice
+ */
+struct lazy_blockdevice {
+	/// The base lazy_blockdevice extends
+	struct fs_blockdevice base;
+
+	/// The blockdevice that holds the blocks, it is owned by the lazy_blockdevice
+	struct fs_blockdevice * bd;
+
+	/// Where the missing blocks are read from, it is owned by the lazy_blockdevice. NULL if no blocks are missing
+	struct fs_blockdevice * image;
+
+	/// Bitmap of the blocks that have not been read from the image yet
+	uint8_t * missing;
+
+	/// How many bits that are set in \ref missing
+	uint32_t missingCount;
+};
+
+/**
+ * Constructor for the lazy_blockdevice.
+ * No blocks are missing until lazy_blockdevice_setImage is called.
+ * \param bd The blockdevice to keep the blocks in, the lazy_blockdevice takes ownership of it if it succeeds
+ * \return The lazy_blockdevice instance, or NULL if it could not be allocated
+ * \relates lazy_blockdevice
+ */
+struct lazy_blockdevice * lazy_blockdevice_init(struct fs_blockdevice * bd);
+
+/**
+ * Restore the device from a image, without reading any of it yet.
+ * The device is resized to the size of the image and every block is read from it when it is first used.
+ * \param lazy The lazy_blockdevice instance
+ * \param image The image as a blockdevice, the lazy_blockdevice takes ownership of it if it succeeds
+ * \return If the device could be resized to fit the image
+ * \relates lazy_blockdevice
+ */
+bool lazy_blockdevice_setImage(struct lazy_blockdevice * lazy, struct fs_blockdevice * image);
+
+/**
+ * Read all the missing blocks from the image and close it.
+ * \param lazy The lazy_blockdevice instance
+ * \relates lazy_blockdevice
+ */
+void lazy_blockdevice_fill(struct lazy_blockdevice * lazy);
+
+#endif
@@ -0,0 +1,153 @@
+#include "bd_mmap.h"
+#include "bd_file.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// VTables functions
+static void mmap_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void mmap_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void mmap_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static void mmap_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static struct fs_block * mmap_blockdevice_get(struct fs_blockdevice * bd, fs_block_id idx);
+static void mmap_blockdevice_put(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty);
+static bool mmap_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount);
+static void mmap_blockdevice_clear(struct fs_blockdevice * bd);
+static void mmap_blockdevice_sync(struct fs_blockdevice * bd);
+static void mmap_blockdevice_free(struct fs_blockdevice * bd);
+
+// VTables
+static struct fs_blockdevice_vtbl mmap_blockdevice_vtbl = {
+	.read = &mmap_blockdevice_read,
+	.write = &mmap_blockdevice_write,
+	.readv = &mmap_blockdevice_readv,
+	.writev = &mmap_blockdevice_writev,
+	.readList = NULL,
+	.writeList = NULL,
+	.get = &mmap_blockdevice_get,
+	.put = &mmap_blockdevice_put,
+	.resize = &mmap_blockdevice_resize,
+	.clear = &mmap_blockdevice_clear,
+	.sync = &mmap_blockdevice_sync,
+	.free = &mmap_blockdevice_free
+};
+
+// Local functions
+static struct fs_block * mmap_blockdevice_map(int fd, uint32_t blockCount);
+
+// Code
+struct mmap_blockdevice * mmap_blockdevice_init(const char * file, uint32_t blockCount) {
+	bool isBlockDevice;
+	int fd = file_blockdevice_open(file, &blockCount, &isBlockDevice);
+	if (fd < 0)
+		return NULL;
+
+	struct fs_block * blocks = mmap_blockdevice_map(fd, blockCount);
+	if (!blocks) {
+		close(fd);
+		return NULL;
+	}
+
+	struct mmap_blockdevice * bd = malloc(sizeof(struct mmap_blockdevice));
+	if (!bd) {
+		munmap(blocks, (size_t)blockCount * BLOCK_SIZE);
+		close(fd);
+		return NULL;
+	}
+
+	bd->base.vtbl = &mmap_blockdevice_vtbl;
+	bd->base.blockCount = blockCount;
+	bd->base.changed = NULL;
+	bd->base.stats = NULL;
+	bd->fd = fd;
+	bd->isBlockDevice = isBlockDevice;
+	bd->blocks = blocks;
+	return bd;
+}
+
+static struct fs_block * mmap_blockdevice_map(int fd, uint32_t blockCount) {
+	void * map = mmap(NULL, (size_t)blockCount * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+static void mmap_blockdevice_read(struct fs_blockdevice * bd_, fs_block_id idx, struct fs_block * block) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	memcpy(block, &bd->blocks[idx], sizeof(*block));
+}
+
+static void mmap_blockdevice_write(struct fs_blockdevice * bd_, fs_block_id idx, struct fs_block * block) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	memcpy(&bd->blocks[idx], block, sizeof(*block));
+}
+
+static void mmap_blockdevice_readv(struct fs_blockdevice * bd_, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	memcpy(blocks, &bd->blocks[first], (size_t)count * sizeof(struct fs_block));
+}
+
+static void mmap_blockdevice_writev(struct fs_blockdevice * bd_, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	memcpy(&bd->blocks[first], blocks, (size_t)count * sizeof(struct fs_block));
+}
+
+static struct fs_block * mmap_blockdevice_get(struct fs_blockdevice * bd_, fs_block_id idx) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	return &bd->blocks[idx];
+}
+
+static void mmap_blockdevice_put(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty) {
+	(void)bd; // The page is already dirty in the mapping, the kernel will write it back
+	(void)idx;
+	(void)block;
+	(void)dirty;
+}
+
+static bool mmap_blockdevice_resize(struct fs_blockdevice * bd_, uint32_t blockCount) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	if (bd->isBlockDevice)
+		return false;
+	if (blockCount == bd->base.blockCount)
+		return true;
+
+	// A file that grows is extended before it is mapped, one that shrinks is cut after
+	bool grow = blockCount > bd->base.blockCount;
+	if (grow && ftruncate(bd->fd, (off_t)blockCount * BLOCK_SIZE))
+		return false;
+
+	// The old mapping is kept until the new one is made, so the device is left as it was if it fails.
+	// A file that was extended is left bigger, the end of it is not used
+	struct fs_block * blocks = mmap_blockdevice_map(bd->fd, blockCount);
+	if (!blocks)
+		return false;
+	if (!grow && ftruncate(bd->fd, (off_t)blockCount * BLOCK_SIZE)) {
+		munmap(blocks, (size_t)blockCount * BLOCK_SIZE);
+		return false;
+	}
+
+	munmap(bd->blocks, (size_t)bd->base.blockCount * BLOCK_SIZE);
+	bd->blocks = blocks;
+	bd->base.blockCount = blockCount;
+	return true;
+}
+
+static void mmap_blockdevice_clear(struct fs_blockdevice * bd_) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	size_t size = (size_t)bd->base.blockCount * BLOCK_SIZE;
+	// Truncating a file is the cheap way to zero it, the mapping will just see the new zero pages
+	if (!bd->isBlockDevice && !ftruncate(bd->fd, 0) && !ftruncate(bd->fd, size))
+		return;
+	memset(bd->blocks, 0, size);
+}
+
+static void mmap_blockdevice_sync(struct fs_blockdevice * bd_) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	msync(bd->blocks, (size_t)bd->base.blockCount * BLOCK_SIZE, MS_SYNC);
+}
+
+static void mmap_blockdevice_free(struct fs_blockdevice * bd_) {
+	struct mmap_blockdevice * bd = (struct mmap_blockdevice *)bd_;
+	munmap(bd->blocks, (size_t)bd->base.blockCount * BLOCK_SIZE);
+	close(bd->fd);
+	free(bd);
+}
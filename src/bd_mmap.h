@@ -0,0 +1,36 @@
+#ifndef BD_MMAP_H
+#define BD_MMAP_H
+
+#include "bd.h"
+
+/**
+ * A blockdevice that maps a file or device on the host computer into memory.
+ * Blocks can be borrowed with fs_blockdevice_get without being copied.
+ * \relates fs_blockdevice
+ */
+struct mmap_blockdevice {
+	/// The base mmap_blockdevice extends
+	struct fs_blockdevice base;
+
+	/// The file descriptor
+	int fd;
+
+	/// If \ref fd is a block device, which can't be resized
+	bool isBlockDevice;
+
+	/// The mapping of the whole file
+	struct fs_block * blocks;
+};
+
+/**
+ * Constructor for the mmap_blockdevice.
+ * The file will be created if it does not exist.
+ * \param file The file or device on the host computer
+ * \param blockCount The amount of blocks, if 0 it will be based on the size of \a file.
+ * If the file is smaller than this, it will be extended.
+ * \return The mmap_blockdevice instance, or NULL if it could not be opened, mapped or allocated
+ * \relates mmap_blockdevice
+ */
+struct mmap_blockdevice * mmap_blockdevice_init(const char * file, uint32_t blockCount);
+
+#endif
@@ -0,0 +1,114 @@
+#include "bd_ram.h"
+#include <stdlib.h>
+#include <string.h>
+
+// VTables functions
+static void ram_blockdevice_read(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void ram_blockdevice_write(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block);
+static void ram_blockdevice_readv(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static void ram_blockdevice_writev(struct fs_blockdevice * bd, fs_block_id first, uint32_t count, struct fs_block * blocks);
+static struct fs_block * ram_blockdevice_get(struct fs_blockdevice * bd, fs_block_id idx);
+static void ram_blockdevice_put(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty);
+static bool ram_blockdevice_resize(struct fs_blockdevice * bd, uint32_t blockCount);
+static void ram_blockdevice_clear(struct fs_blockdevice * bd);
+static void ram_blockdevice_sync(struct fs_blockdevice * bd);
+static void ram_blockdevice_free(struct fs_blockdevice * bd);
+
+// VTables
+static struct fs_blockdevice_vtbl ram_blockdevice_vtbl = {
+	.read = &ram_blockdevice_read,
+	.write = &ram_blockdevice_write,
+	.readv = &ram_blockdevice_readv,
+	.writev = &ram_blockdevice_writev,
+	.readList = NULL,
+	.writeList = NULL,
+	.get = &ram_blockdevice_get,
+	.put = &ram_blockdevice_put,
+	.resize = &ram_blockdevice_resize,
+	.clear = &ram_blockdevice_clear,
+	.sync = &ram_blockdevice_sync,
+	.free = &ram_blockdevice_free
+};
+
+// Code
+struct ram_blockdevice * ram_blockdevice_init(uint32_t blockCount) {
+	struct ram_blockdevice * bd = malloc(sizeof(struct ram_blockdevice));
+	if (!bd)
+		return NULL;
+
+	bd->base.vtbl = &ram_blockdevice_vtbl;
+	bd->base.blockCount = 0;
+	bd->base.changed = NULL;
+	bd->base.stats = NULL;
+	bd->blocks = NULL;
+
+	if (!ram_blockdevice_resize((struct fs_blockdevice *)bd, blockCount)) {
+		free(bd);
+		return NULL;
+	}
+	return bd;
+}
+
+static void ram_blockdevice_read(struct fs_blockdevice * bd_, fs_block_id idx, struct fs_block * block) {
+	struct ram_blockdevice * bd = (struct ram_blockdevice *)bd_;
+	memcpy(block, &bd->blocks[idx], sizeof(*block));
+}
+
+static void ram_blockdevice_write(struct fs_blockdevice * bd_, fs_block_id idx, struct fs_block * block) {
+	struct ram_blockdevice * bd = (struct ram_blockdevice *)bd_;
+	memcpy(&bd->blocks[idx], block, sizeof(*block));
+}
+
+static void ram_blockdevice_readv(struct fs_blockdevice * bd_, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct ram_blockdevice * bd = (struct ram_blockdevice *)bd_;
+	memcpy(blocks, &bd->blocks[first], (size_t)count * sizeof(struct fs_block));
+}
+
+static void ram_blockdevice_writev(struct fs_blockdevice * bd_, fs_block_id first, uint32_t count, struct fs_block * blocks) {
+	struct ram_blockdevice * bd = (struct ram_blockdevice *)bd_;
+	memcpy(&bd->blocks[first], blocks, (size_t)count * sizeof(struct fs_block));
+}
+
+static struct fs_block * ram_blockdevice_get(struct fs_blockdevice * bd_, fs_block_id idx) {
+	struct ram_blockdevice * bd = (struct ram_blockdevice *)bd_;
+	return &bd->blocks[idx];
+}
+
+static void ram_blockdevice_put(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block, bool dirty) {
+	(void)bd; // The block was modified in place, nothing to write back
+	(void)idx;
+	(void)block;
+	(void)dirty;
+}
+
+static bool ram_blockdevice_resize(struct fs_blockdevice * bd_, uint32_t blockCount) {
+	struct ram_blockdevice * bd = (struct ram_blockdevice *)bd_;
+	if (!blockCount)
+		return false;
+
+	struct fs_block * blocks = realloc(bd->blocks, (size_t)blockCount * sizeof(struct fs_block));
+	if (!blocks)
+		return false;
+
+	if (blockCount > bd->base.blockCount)
+		memset(&blocks[bd->base.blockCount], 0, (size_t)(blockCount - bd->base.blockCount) * sizeof(struct fs_block));
+
+	bd->blocks = blocks;
+	bd->base.blockCount = blockCount;
+	return true;
+}
+
+static void ram_blockdevice_clear(struct fs_blockdevice * bd_) {
+	struct ram_blockdevice * bd = (struct ram_blockdevice *)bd_;
+	memset(bd->blocks, 0, (size_t)bd->base.blockCount * sizeof(struct fs_block));
+}
+
+static void ram_blockdevice_sync(struct fs_blockdevice * bd) {
+	(void)bd; // Nothing to sync, everything is already in memory
+}
+
+static void ram_blockdevice_free(struct fs_blockdevice * bd_) {
+	struct ram_blockdevice * bd = (struct ram_blockdevice *)bd_;
+	free(bd->blocks);
+	free(bd);
+}
@@ -0,0 +1,27 @@
+#ifndef BD_RAM_H
+#define BD_RAM_H
+
+#include "bd.h"
+
+/**
+ * A blockdevice that keeps all the blocks in memory.
+ * \relates fs_blockdevice
+ */
+struct ram_blockdevice {
+	/// The base ram_blockdevice extends
+	struct fs_blockdevice base;
+
+	/// The blocks
+	struct fs_block * blocks;
+};
+
+/**
+ * Constructor for the ram_blockdevice.
+ * All the blocks will be zero.
+ * \param blockCount The amount of blocks the device should have
+ * \return The ram_blockdevice instance, or NULL if it could not be allocated
+ * \relates ram_blockdevice
+ */
+struct ram_blockdevice * ram_blockdevice_init(uint32_t blockCount);
+
+#endif
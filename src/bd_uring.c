@@ -0,0 +1,205 @@
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // linux/io_uring.h pulls in linux/fs.h, which has its own BLOCK_SIZE
+#include "bd_uring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+static int fs_uring_setup(uint32_t entries, struct io_uring_params * params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int fs_uring_enter(int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+struct fs_uring * fs_uring_init(uint32_t depth) {
+	struct fs_uring * uring = calloc(1, sizeof(struct fs_uring));
+	if (!uring)
+		return NULL;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	uring->fd = fs_uring_setup(depth, &params);
+	if (uring->fd < 0) {
+		free(uring);
+		return NULL;
+	}
+
+	uring->sqEntries = params.sq_entries;
+	uring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	uring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMmap && uring->cqRingSize > uring->sqRingSize)
+		uring->sqRingSize = uring->cqRingSize;
+
+	uring->sqRing = mmap(NULL, uring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sqRing == MAP_FAILED)
+		goto sqRingError;
+
+	if (singleMmap) {
+		uring->cqRing = uring->sqRing;
+		uring->cqRingSize = uring->sqRingSize;
+	} else {
+		uring->cqRing = mmap(NULL, uring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cqRing == MAP_FAILED)
+			goto cqRingError;
+	}
+
+	uring->sqes = mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+		goto sqesError;
+
+	uring->completed = malloc(uring->sqEntries * sizeof(bool));
+	uring->iovecs = malloc(uring->sqEntries * sizeof(struct iovec));
+	if (!uring->completed || !uring->iovecs)
+		goto completedError;
+
+	uint8_t * sq = uring->sqRing;
+	uring->sqHead = (uint32_t *)(sq + params.sq_off.head);
+	uring->sqTail = (uint32_t *)(sq + params.sq_off.tail);
+	uring->sqMask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+	uring->sqArray = (uint32_t *)(sq + params.sq_off.array);
+
+	uint8_t * cq = uring->cqRing;
+	uring->cqHead = (uint32_t *)(cq + params.cq_off.head);
+	uring->cqTail = (uint32_t *)(cq + params.cq_off.tail);
+	uring->cqMask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return uring;
+
+completedError:
+	free(uring->completed);
+	free(uring->iovecs);
+	munmap(uring->sqes, uring->sqesSize);
+sqesError:
+	if (!singleMmap)
+		munmap(uring->cqRing, uring->cqRingSize);
+cqRingError:
+	munmap(uring->sqRing, uring->sqRingSize);
+sqRingError:
+	close(uring->fd);
+	free(uring);
+	return NULL;
+}
+
+void fs_uring_free(struct fs_uring * uring) {
+	if (!uring)
+		return;
+	free(uring->completed);
+	free(uring->iovecs);
+	munmap(uring->sqes, uring->sqesSize);
+	if (uring->cqRing != uring->sqRing)
+		munmap(uring->cqRing, uring->cqRingSize);
+	munmap(uring->sqRing, uring->sqRingSize);
+	if (uring->fd >= 0)
+		close(uring->fd);
+	free(uring);
+}
+
+/**
+ * Stop using the ring after io_uring_enter failed, when the requests the kernel took are done.
+ * Until then they can still read into or write from the blocks, so the blocks can not be given to the fallback.
+ * \param tail The tail of the submission queue after the batch
+ * \param pending How many requests of the batch that have not been reaped
+ */
+static void fs_uring_abort(struct fs_uring * uring, uint32_t tail, uint32_t pending) {
+	uring->broken = true;
+
+	// Only io_uring_enter reads the submission queue, so the entries it did not take are taken back
+	uint32_t sqHead = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+	pending -= tail - sqHead;
+	__atomic_store_n(uring->sqTail, sqHead, __ATOMIC_RELEASE);
+
+	while (pending) {
+		if (fs_uring_enter(uring->fd, 0, pending, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN) {
+			// Closing the ring makes the kernel cancel what is left
+			close(uring->fd);
+			uring->fd = -1;
+			return;
+		}
+
+		uint32_t head = *uring->cqHead;
+		uint32_t cqTail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+		pending -= cqTail - head;
+		__atomic_store_n(uring->cqHead, cqTail, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Submit one batch that fits in the submission queue, and wait for all of it to complete.
+ * \return If the ring is still usable
+ */
+static bool fs_uring_batch(struct fs_uring * uring, int fd, bool write, struct fs_blockio * ios, uint32_t count) {
+	uint32_t tail = *uring->sqTail;
+	uint32_t requests = 0;
+	for (uint32_t i = 0; i < count;) {
+		uint32_t length = 1;
+		while (i + length < count && ios[i + length].id == ios[i].id + length)
+			length++;
+
+		for (uint32_t j = i; j < i + length; j++) {
+			uring->iovecs[j].iov_base = ios[j].block;
+			uring->iovecs[j].iov_len = sizeof(struct fs_block);
+			uring->completed[j] = false;
+		}
+
+		uint32_t idx = tail & uring->sqMask;
+		struct io_uring_sqe * sqe = &uring->sqes[idx];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)&uring->iovecs[i];
+		sqe->len = length;
+		sqe->off = (uint64_t)ios[i].id * BLOCK_SIZE;
+		sqe->user_data = (uint64_t)length << 32 | i; // The run is needed to know what completed
+		uring->sqArray[idx] = idx;
+		tail++;
+		requests++;
+		i += length;
+	}
+	__atomic_store_n(uring->sqTail, tail, __ATOMIC_RELEASE);
+
+	uint32_t reaped = 0;
+	while (reaped < requests) {
+		uint32_t toSubmit = tail - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+		if (fs_uring_enter(uring->fd, toSubmit, requests - reaped, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN) {
+			fs_uring_abort(uring, tail, requests - reaped);
+			return false;
+		}
+
+		uint32_t head = *uring->cqHead;
+		uint32_t cqTail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+		for (; head != cqTail; head++) {
+			struct io_uring_cqe * cqe = &uring->cqes[head & uring->cqMask];
+			uint32_t first = (uint32_t)cqe->user_data;
+			uint32_t length = (uint32_t)(cqe->user_data >> 32);
+			if (first + length <= count && cqe->res == (int32_t)(length * sizeof(struct fs_block)))
+				memset(&uring->completed[first], true, length * sizeof(bool));
+			reaped++;
+		}
+		__atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+void fs_uring_transfer(struct fs_uring * uring, int fd, bool write, struct fs_blockio * ios, uint32_t count,
+	struct fs_blockdevice * bd, void (*fallback)(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block)) {
+	while (count) {
+		uint32_t batch = count < uring->sqEntries ? count : uring->sqEntries;
+		bool ok = !uring->broken && fs_uring_batch(uring, fd, write, ios, batch);
+
+		for (uint32_t i = 0; i < batch; i++)
+			if (!ok || !uring->completed[i]) // Short, failed or never sent
+				fallback(bd, ios[i].id, ios[i].block);
+
+		ios += batch;
+		count -= batch;
+	}
+}
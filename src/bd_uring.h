@@ -0,0 +1,108 @@
+#ifndef BD_URING_H
+#define BD_URING_H
+
+#include <stddef.h>
+#include "bd.h"
+
+/**
+ * The default amount of submission queue entries, the biggest batch that is sent in one go.
+ * \relates fs_uring
+ */
+#define URING_DEFAULT_DEPTH 64
+
+/**
+ * A io_uring instance that is used to send batches of block reads or writes to a file descriptor.
+ * It uses the raw syscalls, so it does not depend on liburing.
+ */
+struct fs_uring {
+	/// The io_uring file descriptor, -1 if the ring was closed after it failed
+	int fd;
+
+	/// How many entries the submission queue has
+	uint32_t sqEntries;
+
+	/// If the ring has failed and should not be used anymore
+	bool broken;
+
+	/// The submission queue head, owned by the kernel
+	uint32_t * sqHead;
+
+	/// The submission queue tail
+	uint32_t * sqTail;
+
+	/// The mask to get the submission queue index from a head or tail
+	uint32_t sqMask;
+
+	/// The submission queue index array
+	uint32_t * sqArray;
+
+	/// The submission queue entries
+	struct io_uring_sqe * sqes;
+
+	/// The completion queue head
+	uint32_t * cqHead;
+
+	/// The completion queue tail, owned by the kernel
+	uint32_t * cqTail;
+
+	/// The mask to get the completion queue index from a head or tail
+	uint32_t cqMask;
+
+	/// The completion queue entries
+	struct io_uring_cqe * cqes;
+
+	/// The mapping of the submission queue
+	void * sqRing;
+
+	/// The size of \ref sqRing
+	size_t sqRingSize;
+
+	/// The mapping of the completion queue, can be the same as \ref sqRing
+	void * cqRing;
+
+	/// The size of \ref cqRing
+	size_t cqRingSize;
+
+	/// The size of the \ref sqes mapping
+	size_t sqesSize;
+
+	/// Which of the blocks in the current batch that have completed
+	bool * completed;
+
+	/// The iovecs for the blocks in the current batch
+	struct iovec * iovecs;
+};
+
+/**
+ * Constructor for the fs_uring.
+ * \param depth How many entries the submission queue should have
+ * \return The fs_uring instance, or NULL if io_uring is not available
+ * \relates fs_uring
+ */
+struct fs_uring * fs_uring_init(uint32_t depth);
+
+/**
+ * Destructor for the fs_uring.
+ * \param uring The fs_uring instance
+ * \relates fs_uring
+ */
+void fs_uring_free(struct fs_uring * uring);
+
+/**
+ * Read or write a list of blocks, the whole list is submitted in batches of \ref fs_uring::sqEntries
+ * and the completions of each batch are reaped together.
+ * Blocks with adjacent indices are coalesced into one vectored request.
+ * Operations that fail, or are short, are redone with \a fallback.
+ * \param uring The fs_uring instance
+ * \param fd The file descriptor to read from or write to
+ * \param write If it should write instead of read
+ * \param ios The blocks, none of them may be outside the file
+ * \param count The amount of blocks in \a ios
+ * \param bd The blockdevice that is passed to \a fallback
+ * \param fallback The synchronous version of the operation
+ * \relates fs_uring
+ */
+void fs_uring_transfer(struct fs_uring * uring, int fd, bool write, struct fs_blockio * ios, uint32_t count,
+	struct fs_blockdevice * bd, void (*fallback)(struct fs_blockdevice * bd, fs_block_id idx, struct fs_block * block));
+
+#endif
@@ -1,14 +1,22 @@
 #include "fs_node.h"
 
-uint16_t fs_node_readData(struct fs_node * node, void * buffer, uint16_t offset, uint16_t size) {
+uint64_t fs_node_readData(struct fs_node * node, void * buffer, uint64_t offset, uint64_t size) {
 	return node->vtbl->readData(node, buffer, offset, size);
 }
 
-uint16_t fs_node_writeData(struct fs_node * node, const void * buffer, uint16_t offset, uint16_t size) {
+uint64_t fs_node_writeData(struct fs_node * node, const void * buffer, uint64_t offset, uint64_t size) {
 	return node->vtbl->writeData(node, buffer, offset, size);
 }
 
-struct fs_direntry * fs_node_directoryEntries(struct fs_node * node, uint16_t * amount) {
+bool fs_node_allocate(struct fs_node * node, uint64_t offset, uint64_t size) {
+	return node->vtbl->allocate(node, offset, size);
+}
+
+bool fs_node_truncate(struct fs_node * node, uint64_t size) {
+	return node->vtbl->truncate(node, size);
+}
+
+struct fs_direntry * fs_node_directoryEntries(struct fs_node * node, uint32_t * amount) {
 	return node->vtbl->directoryEntries(node, amount);
 }
 
@@ -12,19 +12,31 @@ struct fs_node_vtbl {
 	 * Prototype of fs_node_readData.
 	 * \see fs_node_readData
 	 */
-	uint16_t (*readData)(struct fs_node * node, void * buffer, uint16_t offset, uint16_t size);
+	uint64_t (*readData)(struct fs_node * node, void * buffer, uint64_t offset, uint64_t size);
 
 	/**
 	 * Prototype of fs_node_writeData.
 	 * \see fs_node_writeData
 	 */
-	uint16_t (*writeData)(struct fs_node * node, const void * buffer, uint16_t offset, uint16_t size);
+	uint64_t (*writeData)(struct fs_node * node, const void * buffer, uint64_t offset, uint64_t size);
+
+	/**
+	 * Prototype of fs_node_allocate.
+	 * \see fs_node_allocate
+	 */
+	bool (*allocate)(struct fs_node * node, uint64_t offset, uint64_t size);
+
+	/**
+	 * Prototype of fs_node_truncate.
+	 * \see fs_node_truncate
+	 */
+	bool (*truncate)(struct fs_node * node, uint64_t size);
 
 	/**
 	 * Prototype of fs_node_directoryEntries.
 	 * \see fs_node_directoryEntries
 	 */
-	struct fs_direntry * (*directoryEntries)(struct fs_node * node, uint16_t * amount);
+	struct fs_direntry * (*directoryEntries)(struct fs_node * node, uint32_t * amount);
 
 	/**
 	 * Prototype of fs_node_findNode.
@@ -60,11 +72,11 @@ struct fs_node {
 	/// \relates fs_node_type
 	uint16_t type;
 
-	/// The size
-	uint16_t size;
+	/// The amount of blocks it uses
+	uint32_t blockCount;
 
-	/// The amount of nodes it uses
-	uint16_t blockCount;
+	/// The size in bytes
+	uint64_t size;
 };
 
 /**
@@ -76,7 +88,7 @@ struct fs_node {
  * \return The amount of data read
  * \relates fs_node
  */
-uint16_t fs_node_readData(struct fs_node * node, void * buffer, uint16_t offset, uint16_t size);
+uint64_t fs_node_readData(struct fs_node * node, void * buffer, uint64_t offset, uint64_t size);
 
 /**
  * Write data to the node.
@@ -87,7 +99,29 @@ uint16_t fs_node_readData(struct fs_node * node, void * buffer, uint16_t offset,
  * \return The amount of data written
  * \relates fs_node
  */
-uint16_t fs_node_writeData(struct fs_node * node, const void * buffer, uint16_t offset, uint16_t size);
+uint64_t fs_node_writeData(struct fs_node * node, const void * buffer, uint64_t offset, uint64_t size);
+
+/**
+ * Reserve the blocks for a range of the node, without changing its size.
+ * Writes to the range later on does not need to allocate anything.
+ * \param node The file node
+ * \param offset Where the range starts in the node
+ * \param size How big the range is
+ * \return If all the blocks could be reserved
+ * \relates fs_node
+ */
+bool fs_node_allocate(struct fs_node * node, uint64_t offset, uint64_t size);
+
+/**
+ * Change the size of the node.
+ * If it shrinks, the blocks after the new end are freed, also the ones reserved with fs_node_allocate.
+ * If it grows, the new part is filled with zeros.
+ * \param node The file node
+ * \param size The new size
+ * \return If the node got the new size
+ * \relates fs_node
+ */
+bool fs_node_truncate(struct fs_node * node, uint64_t size);
 
 /**
  * Get a array of all the entries in a directory
@@ -96,7 +130,7 @@ uint16_t fs_node_writeData(struct fs_node * node, const void * buffer, uint16_t
  * \return The directory entry array, if the node is of the type NODETYPE_DIRECTORY, else NULL
  * \relates fs_node
  */
-struct fs_direntry * fs_node_directoryEntries(struct fs_node * node, uint16_t * amount);
+struct fs_direntry * fs_node_directoryEntries(struct fs_node * node, uint32_t * amount);
 
 /**
  * Search for a node based on the \a path.
@@ -8,6 +8,10 @@ void fs_supernode_saveNode(struct fs_supernode * sn, struct fs_node * node) {
 	return sn->vtbl->saveNode(sn, node);
 }
 
+void fs_supernode_putNode(struct fs_supernode * sn, struct fs_node * node) {
+	return sn->vtbl->putNode(sn, node);
+}
+
 struct fs_node * fs_supernode_addNode(struct fs_supernode * sn, struct fs_node * parent, enum fs_node_type type, const char * name) {
 	return sn->vtbl->addNode(sn, parent, type, name);
 }
@@ -31,3 +35,15 @@ void fs_supernode_setBlockUsed(struct fs_supernode * sn, fs_block_id id) {
 void fs_supernode_setBlockFree(struct fs_supernode * sn, fs_block_id id) {
 	return sn->vtbl->setBlockFree(sn, id);
 }
+
+void fs_supernode_begin(struct fs_supernode * sn) {
+	return sn->vtbl->begin(sn);
+}
+
+void fs_supernode_commit(struct fs_supernode * sn) {
+	return sn->vtbl->commit(sn);
+}
+
+void fs_supernode_sync(struct fs_supernode * sn) {
+	return sn->vtbl->sync(sn);
+}
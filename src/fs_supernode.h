@@ -21,6 +21,12 @@ struct fs_supernode_vtbl {
 	 */
 	void (*saveNode)(struct fs_supernode * sn, struct fs_node * node);
 
+	/**
+	 * Prototype of fs_supernode_putNode.
+	 * \see fs_supernode_putNode
+	 */
+	void (*putNode)(struct fs_supernode * sn, struct fs_node * node);
+
 	/**
 	 * Prototype of fs_supernode_addNode.
 	 * \see fs_supernode_addNode
@@ -56,6 +62,24 @@ struct fs_supernode_vtbl {
 	 * \see fs_supernode_setBlockFree
 	 */
 	void (*setBlockFree)(struct fs_supernode * sn, fs_block_id id);
+
+	/**
+	 * Prototype of fs_supernode_begin.
+	 * \see fs_supernode_begin
+	 */
+	void (*begin)(struct fs_supernode * sn);
+
+	/**
+	 * Prototype of fs_supernode_commit.
+	 * \see fs_supernode_commit
+	 */
+	void (*commit)(struct fs_supernode * sn);
+
+	/**
+	 * Prototype of fs_supernode_sync.
+	 * \see fs_supernode_sync
+	 */
+	void (*sync)(struct fs_supernode * sn);
 };
 
 /**
@@ -68,6 +92,9 @@ struct fs_supernode {
 
 /**
  * Get the node corresponding to the \a id.
+ * Getting the same node again gives the same object, so changes to it are seen by everyone that has it.
+ * It has to be returned with fs_supernode_putNode, as do the nodes from fs_supernode_addNode, fs_node_findNode
+ * and fs_node_getParent.
  * \param sn The supernode
  * \param id The index
  * \return The node
@@ -77,12 +104,21 @@ struct fs_node * fs_supernode_getNode(struct fs_supernode * sn, fs_node_id id);
 
 /**
  * Save the changes of a node to disk.
+ * In a transaction the node is only marked as changed, and it is written when the outermost one is committed.
  * \param sn The supernode
  * \param node The node to save
  * \relates fs_supernode
  */
 void fs_supernode_saveNode(struct fs_supernode * sn, struct fs_node * node);
 
+/**
+ * Return a node, it can not be used after this.
+ * \param sn The supernode
+ * \param node The node, can be NULL
+ * \relates fs_supernode
+ */
+void fs_supernode_putNode(struct fs_supernode * sn, struct fs_node * node);
+
 /**
  * Create a new node.
  * \param sn The supernode
@@ -136,4 +172,30 @@ void fs_supernode_setBlockUsed(struct fs_supernode * sn, fs_block_id id);
  */
 void fs_supernode_setBlockFree(struct fs_supernode * sn, fs_block_id id);
 
+/**
+ * Start a transaction.
+ * Until it is committed, the changes to the supernode are only kept in memory, so a operation that changes
+ * many blocks writes each of its blocks once. Transactions can be nested, the changes are written when the
+ * outermost one is committed.
+ * Data that is appended to a file in a transaction only gets its blocks on the commit, when the final size
+ * of the file is known.
+ * \param sn The supernode
+ * \relates fs_supernode
+ */
+void fs_supernode_begin(struct fs_supernode * sn);
+
+/**
+ * End a transaction that was started with fs_supernode_begin.
+ * \param sn The supernode
+ * \relates fs_supernode
+ */
+void fs_supernode_commit(struct fs_supernode * sn);
+
+/**
+ * Write all the changes to the supernode that are kept in memory, even if a transaction is open.
+ * \param sn The supernode
+ * \relates fs_supernode
+ */
+void fs_supernode_sync(struct fs_supernode * sn);
+
 #endif
@@ -4,9 +4,16 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "fs.h"
 #include "bd.h"
+#include "bd_ram.h"
+#include "bd_file.h"
+#include "bd_mmap.h"
+#include "bd_cache.h"
+#include "bd_uring.h"
+#include "bd_lazy.h"
 #include "pnfs.h"
 #include "block.h"
 
@@ -14,6 +21,11 @@ static void doCommand(char * cmd);
 
 static bool quit;
 static struct fs_blockdevice * bd;
+static struct cache_blockdevice * cache; // NULL if bd is not cached
+static struct lazy_blockdevice * lazy; // NULL if no image has been opened lazily on bd
+static uint32_t cacheCapacity = BLOCKCACHE_DEFAULT_CAPACITY;
+static char * lastImage; // The image the tracked changes are relative to, NULL if there is none
+static bool deltaSaved; // If a delta was saved since lastImage, the tracked changes are relative to the delta then
 static struct fs_supernode * sn;
 
 static struct fs_node * cwd = NULL;
@@ -35,7 +47,7 @@ char * getCWD(struct fs_node * current, char * str, int * left) {
 
 	str = getCWD(parent, str, left);
 	name = fs_node_getName(current, parent);
-	free(parent);
+	fs_supernode_putNode(sn, parent);
 	if (!name)
 		return str;
 
@@ -47,35 +59,106 @@ char * getCWD(struct fs_node * current, char * str, int * left) {
 	return str;
 }
 
+/**
+ * Parse a block count argument.
+ * \param str The argument, NULL gives ::BLOCKDEVICE_DEFAULT_COUNT
+ * \return The block count, 0 if it is not valid
+ */
+static uint32_t parseBlockCount(const char * str) {
+	if (!str)
+		return BLOCKDEVICE_DEFAULT_COUNT;
+
+	char * end;
+	unsigned long count = strtoul(str, &end, 0);
+	if (*end || count < PNFS_MIN_BLOCKCOUNT || count > UINT32_MAX)
+		return 0;
+	return count;
+}
+
+/**
+ * Switch to a new HDD and load the filesystem from it.
+ * The old HDD will be freed if it succeeds, else \a newBD will be freed.
+ * \param newBD The new HDD
+ * \param cached If a cache_blockdevice should be put in front of \a newBD
+ * \return If the filesystem could be loaded
+ */
+static bool useDevice(struct fs_blockdevice * newBD, bool cached) {
+	struct cache_blockdevice * newCache = NULL;
+	if (cached && (newCache = cache_blockdevice_init(newBD, cacheCapacity)))
+		newBD = (struct fs_blockdevice *)newCache;
+
+	struct fs_supernode * newSN = (struct fs_supernode *)pnfs_init(newBD);
+	if (!newSN) {
+		fs_blockdevice_free(newBD);
+		return false;
+	}
+
+	pnfs_free((struct pnfs_supernode *)sn);
+	fs_blockdevice_free(bd);
+
+	bd = newBD;
+	cache = newCache;
+	lazy = NULL;
+	sn = newSN;
+	fs_blockdevice_trackChanges(bd);
+	fs_blockdevice_trackStats(bd);
+	if (cache)
+		fs_blockdevice_trackStats(cache->bd);
+	free(lastImage);
+	lastImage = NULL;
+	deltaSaved = false;
+	cwd = fs_supernode_getNode(sn, NODE_ROOT);
+	return true;
+}
+
+/**
+ * Use the filesystem that was loaded on the HDD, the old one should already be freed.
+ * \param newSN The filesystem, NULL leaves the shell without one until the HDD is formatted or restored
+ */
+static void useFS(struct fs_supernode * newSN) {
+	sn = newSN;
+	cwd = sn ? fs_supernode_getNode(sn, NODE_ROOT) : NULL;
+	if (!sn)
+		printf("[-] There is no filesystem on the HDD now, use format or restoreImage to get one\n");
+}
+
 int main(int argc, char ** argv) {
 	printf("Welcome to the PNFS test shell!\n");
 
-	bd = malloc(sizeof(struct fs_blockdevice));
-	fs_blockdevice_clear(bd);
-
-	sn = (struct fs_supernode *)pnfs_init(bd);
+	struct fs_blockdevice * newBD = NULL;
+	bool cached = false;
+	if (argc < 2 || argv[1][strspn(argv[1], "0123456789")] == '\0') { // No argument or a block count
+		uint32_t blockCount = parseBlockCount(argc < 2 ? NULL : argv[1]);
+		if (blockCount)
+			newBD = (struct fs_blockdevice *)ram_blockdevice_init(blockCount);
+	} else { // A file on the host
+		uint32_t blockCount = argc > 2 ? parseBlockCount(argv[2]) : 0;
+		if (argc < 3 || blockCount)
+			newBD = (struct fs_blockdevice *)file_blockdevice_init(argv[1], blockCount);
+		cached = true;
+	}
 
-	char * PS1 = malloc(0x1000);
-	PS1[0] = '/';
-	PS1[1] = '\0';
-	struct fs_node * oldCwd = NULL;
+	if (!newBD) {
+		printf("Usage: %s [block count]\n", argv[0]);
+		printf("       %s <file or device on host> [block count]\n", argv[0]);
+		printf("The block count needs to be atleast %u\n", PNFS_MIN_BLOCKCOUNT);
+		return 1;
+	}
 
-	oldCwd = cwd = fs_supernode_getNode(sn, NODE_ROOT);
+	if (!useDevice(newBD, cached)) {
+		printf("[-] Failed to load a filesystem from the HDD!\n");
+		return 1;
+	}
 
-	int len = 0x1000;
-	getCWD(cwd, PS1, &len);
-	strncat(PS1, "$ ", 0x1000);
+	char * PS1 = malloc(0x1000);
 	quit = false;
 	while (!quit) {
-		if (oldCwd != cwd) {
-			len = 0x1000;
-			PS1[0] = '/';
-			PS1[1] = '\0';
-			getCWD(cwd, PS1, &len);
-			strncat(PS1, "$ ", 0x1000);
-			free(oldCwd);
-			oldCwd = cwd;
-		}
+		// The nodes on the way up are cached, so this does not need to wait for cwd to change
+		int len = 0x1000;
+		PS1[0] = '/';
+		PS1[1] = '\0';
+		getCWD(cwd, PS1, &len);
+		strncat(PS1, "$ ", 0x1000);
 		char * line = readline(PS1);
 		if (!line)
 			continue;
@@ -85,24 +168,34 @@ int main(int argc, char ** argv) {
 		free(line);
 	}
 	free(PS1);
-	free(cwd);
-	free(sn);
-	free(bd);
+	if (sn)
+		fs_supernode_putNode(sn, cwd);
+	pnfs_free((struct pnfs_supernode *)sn);
+	fs_blockdevice_free(bd);
+	free(lastImage);
 	return 0;
 }
 
+static void allocate_cmd();
+static void cache_cmd();
 static void cat_cmd();
 static void cd_cmd();
 static void copy_cmd();
 static void create_cmd();
+static void createDelta_cmd();
 static void createImage_cmd();
 static void exit_cmd();
 static void format_cmd();
 static void ls_cmd();
 static void mkdir_cmd();
+static void mount_cmd();
+static void openImage_cmd();
 static void pwd_cmd();
 static void restoreImage_cmd();
 static void rm_cmd();
+static void stats_cmd();
+static void sync_cmd();
+static void truncate_cmd();
 
 /**
  * Helper struct for command parsing
@@ -116,6 +209,8 @@ struct cmd {
 	const char * args;
 	/// The description of the command - For printing help
 	const char * desc;
+	/// If the command needs a filesystem on the HDD
+	bool needsFS;
 };
 
 static void doCommand(char * line) {
@@ -123,26 +218,39 @@ static void doCommand(char * line) {
 	if (!part)
 		return;
 
-	struct cmd validCommands[13] = {
-		{"cat", &cat_cmd, "<file>", "Print the content of file(s)"},
-		{"cd", &cd_cmd, "<path>", "Change the working directory"},
-		{"copy", &copy_cmd, "<from> <to>", "Copy a file or directory"},
-		{"create", &create_cmd, "<filename>", "Create a text file"},
-		{"createImage", &createImage_cmd, "<filename on host>", "Save the HDD to a file on the host"},
-		{"exit", &exit_cmd, "", "Exit the shell"},
-		{"format", &format_cmd, "", "Format the HDD"},
-		{"ls", &ls_cmd, "", "List all the file and folder"},
-		{"mkdir", &mkdir_cmd, "<dirname>", "Make a directory"},
-		{"pwd", &pwd_cmd, "", "Print the current working directory"},
-		{"restoreImage", &restoreImage_cmd, "<filename on host>", "Load the HDD from a file on the host"},
-		{"rm", &rm_cmd, "Remove a file or folder"},
-		{"quit", &exit_cmd, "", "Quit the shell"}
+	struct cmd validCommands[21] = {
+		{"allocate", &allocate_cmd, "<file> <size>", "Reserve the blocks for a file to grow to size", true},
+		{"cache", &cache_cmd, "[blocks]", "Show the block cache, or change how many blocks it keeps", false},
+		{"cat", &cat_cmd, "<file>", "Print the content of file(s)", true},
+		{"cd", &cd_cmd, "<path>", "Change the working directory", true},
+		{"copy", &copy_cmd, "<from> <to>", "Copy a file or directory", true},
+		{"create", &create_cmd, "<filename>", "Create a text file", true},
+		{"createDelta", &createDelta_cmd, "<filename on host>", "Save the blocks changed since the last image or delta", false},
+		{"createImage", &createImage_cmd, "<filename on host> [raw|sparse|compressed]", "Save the HDD to a file on the host, only changes if it is the last raw image", false},
+		{"exit", &exit_cmd, "", "Exit the shell", false},
+		{"format", &format_cmd, "[block count] [node count]", "Format the HDD, optionally with a new size and room for more nodes to begin with", false},
+		{"ls", &ls_cmd, "", "List all the file and folder", true},
+		{"mkdir", &mkdir_cmd, "<dirname>", "Make a directory", true},
+		{"mount", &mount_cmd, "<file on host> [blocks] [file|uring|mmap]", "Use a file or device on the host as the HDD", false},
+		{"openImage", &openImage_cmd, "<image> [deltas...]", "Like restoreImage, but the blocks are read from the image when first used", false},
+		{"pwd", &pwd_cmd, "", "Print the current working directory", true},
+		{"restoreImage", &restoreImage_cmd, "<image> [deltas...]", "Load the HDD from a file on the host, and apply deltas over it", false},
+		{"rm", &rm_cmd, "<path>", "Remove a file or folder", true},
+		{"stats", &stats_cmd, "[reset]", "Show the requests made to the HDD and the heap allocations of PNFS, and optionally reset the counters", false},
+		{"sync", &sync_cmd, "", "Write all cached blocks to the HDD", false},
+		{"truncate", &truncate_cmd, "<file> <size>", "Shrink or grow a file to size", true},
+		{"quit", &exit_cmd, "", "Quit the shell", false}
 	};
 
 
 	for (int i = 0; i < sizeof(validCommands) / sizeof(*validCommands); i++)
-		if (!strcasecmp(part, validCommands[i].name))
+		if (!strcasecmp(part, validCommands[i].name)) {
+			if (validCommands[i].needsFS && !sn) {
+				printf("[-] There is no filesystem on the HDD, use format or restoreImage first!\n");
+				return;
+			}
 			return validCommands[i].func();
+		}
 
 
 	printf("Unknown command!\n");
@@ -155,6 +263,74 @@ static void doCommand(char * line) {
 
 #define NEXT_TOKEN strtok_r(NULL, " ", &globalSaveptr)
 
+/**
+ * Find the file and parse the size for allocate and truncate.
+ * \param size Where the size is stored
+ * \return The file node, NULL if it could not be found or the arguments are wrong
+ */
+static struct fs_node * fileAndSizeArgs(uint64_t * size) {
+	char * path = NEXT_TOKEN;
+	char * arg = NEXT_TOKEN;
+	if (!path || !arg) {
+		printf("[-] A path and a size is required!\n");
+		return NULL;
+	}
+
+	char * end;
+	unsigned long long value = strtoull(arg, &end, 0);
+	if (*end || value > PNFS_MAX_FILE_SIZE) {
+		printf("[-] Invalid size '%s'!\n", arg);
+		return NULL;
+	}
+	*size = value;
+
+	struct fs_node * node = fs_node_findNode(cwd, path);
+	if (!node) {
+		printf("[-] Could not find node!\n");
+		return NULL;
+	}
+	if (node->type != NODETYPE_FILE) {
+		printf("[-] %s is not a file!\n", path);
+		fs_supernode_putNode(sn, node);
+		return NULL;
+	}
+	return node;
+}
+
+static void allocate_cmd() {
+	uint64_t size;
+	struct fs_node * node = fileAndSizeArgs(&size);
+	if (!node)
+		return;
+
+	if (fs_node_allocate(node, 0, size))
+		printf("[+] The file has %u blocks\n", node->blockCount);
+	else
+		printf("[-] Failed to allocate the blocks!\n");
+	fs_supernode_putNode(sn, node);
+}
+
+static void cache_cmd() {
+	char * arg = NEXT_TOKEN;
+	if (arg) {
+		char * end;
+		unsigned long capacity = strtoul(arg, &end, 0);
+		if (*end || capacity > UINT32_MAX) {
+			printf("[-] Invalid block count '%s'!\n", arg);
+			return;
+		}
+		cacheCapacity = capacity;
+		if (cache)
+			cache_blockdevice_setCapacity(cache, cacheCapacity);
+	}
+
+	if (!cache) {
+		printf("[*] The current HDD is not cached, mounts with the file backend will keep %u blocks\n", cacheCapacity);
+		return;
+	}
+	printf("[*] Cache: %u/%u blocks, %u dirty\n", cache->count, cache->capacity, cache_blockdevice_dirtyCount(cache));
+}
+
 static void cat_cmd() {
 	char * path = NEXT_TOKEN;
 	if (!path) {
@@ -174,7 +350,7 @@ static void cat_cmd() {
 	fs_node_readData(node, buf, 0, node->size);
 	printf("%s\n", buf);
 	free(buf);
-	free(node);
+	fs_supernode_putNode(sn, node);
 }
 
 static void cd_cmd() {
@@ -191,11 +367,12 @@ static void cd_cmd() {
 	else if (node->type != NODETYPE_DIRECTORY)
 		printf("[-] Can only cd into directories!\n");
 	else {
+		fs_supernode_putNode(sn, cwd);
 		cwd = node;
 		return;
 	}
 
-	free(node);
+	fs_supernode_putNode(sn, node);
 }
 
 static void copy_cmd() {
@@ -235,15 +412,17 @@ static void copy_cmd() {
 		goto earlyRet;
 	}
 
-	uint16_t size = fromNode->size;
+	uint64_t size = fromNode->size;
 	char * buf = malloc(size);
 	fs_node_readData(fromNode, buf, 0, size);
 	fs_node_writeData(toNode, buf, 0, size);
 	free(buf);
 
-	free(toNode);
+	fs_supernode_putNode(sn, toNode);
 earlyRet:
-	free(fromNode);
+	if (lastSlash)
+		fs_supernode_putNode(sn, parent);
+	fs_supernode_putNode(sn, fromNode);
 }
 
 static void create_cmd() {
@@ -275,7 +454,10 @@ static void create_cmd() {
 
 	printf("Please write the content you want in the file. End with a Ctrl-D on a empty line.\n");
 
-	uint16_t offset = 0;
+	// The allocations for all the lines are written in one go
+	fs_supernode_begin(sn);
+
+	uint64_t offset = 0;
 	while (true) {
 		char * line = readline("");
 
@@ -283,7 +465,7 @@ static void create_cmd() {
 			break;
 
 		if (*line) {
-			uint16_t wrote = fs_node_writeData(node, line, offset, strlen(line));
+			uint64_t wrote = fs_node_writeData(node, line, offset, strlen(line));
 			if (!wrote) {
 				printf("[-] Failed to write to file. Probably out of disk storage\n");
 				free(line);
@@ -297,12 +479,50 @@ static void create_cmd() {
 
 		free(line);
 	}
+	fs_supernode_commit(sn);
 
-	free(node);
+	fs_supernode_putNode(sn, node);
 
 ret:
 	if (lastSlash)
-		free(parent);
+		fs_supernode_putNode(sn, parent);
+}
+
+/**
+ * Remember which image the tracked changes are relative to.
+ * \param filename The image, NULL if there is none
+ */
+static void setLastImage(const char * filename) {
+	free(lastImage);
+	lastImage = filename ? strdup(filename) : NULL;
+	deltaSaved = false;
+}
+
+static void createDelta_cmd() {
+	char * filename = NEXT_TOKEN;
+	if (!filename) {
+		printf("[-] A filename is required!\n");
+		return;
+	}
+
+	if (!lastImage) {
+		printf("[-] A delta needs a image to be relative to, use createImage or restoreImage first!\n");
+		return;
+	}
+
+	// The delta could be written over the image the missing blocks are read from
+	if (lazy)
+		lazy_blockdevice_fill(lazy);
+
+	uint32_t changed = fs_blockdevice_changedCount(bd);
+	if (!fs_blockdevice_saveDelta(bd, filename)) {
+		printf("[-] Failed to save the delta!\n");
+		return;
+	}
+	// The changes in the delta are not tracked anymore, so the image can only be saved whole
+	deltaSaved = true;
+
+	printf("[+] Saved %u changed blocks, restore with: restoreImage %s ... %s\n", changed, lastImage, filename);
 }
 
 static void createImage_cmd() {
@@ -312,11 +532,36 @@ static void createImage_cmd() {
 		return;
 	}
 
-	if (!fs_blockdevice_save(bd, filename)) {
+	char * format = NEXT_TOKEN;
+	bool sparse = format && (!strcmp(format, "sparse") || !strcmp(format, "compressed"));
+	if (format && !sparse && strcmp(format, "raw")) {
+		printf("[-] Unknown image format %s!\n", format);
+		return;
+	}
+
+	uint32_t changed = fs_blockdevice_changedCount(bd);
+	if (!sparse && lastImage && !deltaSaved && !strcmp(lastImage, filename) && fs_blockdevice_saveChanges(bd, filename)) {
+		printf("[+] Saved %u changed blocks to the HDD image\n", changed);
+		return;
+	}
+
+	// The image that is being written could be the one the missing blocks are read from
+	if (lazy)
+		lazy_blockdevice_fill(lazy);
+
+	// Sparse images leave out the blocks the filesystem does not use
+	struct pnfs_supernode * psn = (struct pnfs_supernode *)sn;
+	bool saved = sparse
+		? fs_blockdevice_saveSparse(bd, filename, psn ? psn->runtimeStorage.freeBlocksBitmap : NULL, psn ? psn->blockCount : 0,
+			!strcmp(format, "compressed"))
+		: fs_blockdevice_save(bd, filename);
+	if (!saved) {
 		printf("[-] Failed to save HDD image!\n");
+		setLastImage(NULL);
 		return;
 	}
 
+	setLastImage(filename);
 	printf("[+] Saved HDD image correctly\n");
 }
 
@@ -325,15 +570,43 @@ static void exit_cmd() {
 }
 
 static void format_cmd() {
-	free(sn);
+	char * count = NEXT_TOKEN;
+	uint32_t blockCount = count ? parseBlockCount(count) : bd->blockCount;
+	if (!blockCount) {
+		printf("[-] The block count needs to be atleast %u!\n", PNFS_MIN_BLOCKCOUNT);
+		return;
+	}
+
+	char * nodes = NEXT_TOKEN;
+	uint32_t nodeCount = 0;
+	if (nodes) {
+		char * end;
+		unsigned long value = strtoul(nodes, &end, 0);
+		if (*end || !value || value > UINT16_MAX) {
+			printf("[-] Invalid node count '%s'!\n", nodes);
+			return;
+		}
+		nodeCount = value;
+	}
+
+	if (blockCount != bd->blockCount && !fs_blockdevice_resize(bd, blockCount)) {
+		printf("[-] Could not resize the HDD to %u blocks!\n", blockCount);
+		return;
+	}
+
+	pnfs_free((struct pnfs_supernode *)sn);
 	fs_blockdevice_clear(bd);
 	printf("[+] Formatted!\n");
-	sn = (struct fs_supernode *)pnfs_init(bd);
-	cwd = fs_supernode_getNode(sn, NODE_ROOT);
+	sn = (struct fs_supernode *)pnfs_format(bd, nodeCount);
+	if (!sn) {
+		printf("[-] There is no room for %u nodes, formatting with the default amount\n", nodeCount);
+		sn = (struct fs_supernode *)pnfs_format(bd, 0);
+	}
+	useFS(sn);
 }
 
 static void ls_cmd() {
-	uint16_t amount;
+	uint32_t amount;
 	struct fs_direntry * dir = fs_node_directoryEntries(cwd, &amount);
 	const char* nodetypeName[] = {
 		[NODETYPE_INVALID] = "Invalid",
@@ -347,12 +620,12 @@ static void ls_cmd() {
 	}
 
 	printf("| %-8s | %-62s | %-16s | %-16s |\n", "ID", "Name", "Type", "Size");
-	for (uint16_t i = 0; i < amount; i++) {
+	for (uint32_t i = 0; i < amount; i++) {
 		struct fs_node * node = fs_supernode_getNode(sn, dir[i].id);
 		if (!node)
 			continue;
-		printf("| %-8d | %-62s | %-16s | %-16u |\n", dir[i].id, dir[i].name, nodetypeName[node->type], node->size);
-		free(node);
+		printf("| %-8d | %-62s | %-16s | %-16llu |\n", dir[i].id, dir[i].name, nodetypeName[node->type], (unsigned long long)node->size);
+		fs_supernode_putNode(sn, node);
 	}
 
 	free(dir);
@@ -367,7 +640,7 @@ static void mkdir_cmd() {
 
 	struct fs_node * n = fs_node_findNode(cwd, path);
 	if (n) {
-		free(n);
+		fs_supernode_putNode(sn, n);
 		printf("[-] There is already a node with that name\n");
 		return;
 	}
@@ -389,38 +662,163 @@ static void mkdir_cmd() {
 	struct fs_node * node = fs_supernode_addNode(sn, parent, NODETYPE_DIRECTORY, path);
 	if (!node) {
 		printf("[-] Could not add node!\n");
+		goto ret;
+	}
+
+	fs_supernode_putNode(sn, node);
+ret:
+	if (lastSlash)
+		fs_supernode_putNode(sn, parent);
+}
+
+static void mount_cmd() {
+	char * filename = NEXT_TOKEN;
+	if (!filename) {
+		printf("[-] A filename is required!\n");
+		return;
+	}
+
+	uint32_t blockCount = 0;
+	const char * backend = "file";
+	for (char * arg = NEXT_TOKEN; arg; arg = NEXT_TOKEN) {
+		if (arg[strspn(arg, "0123456789")] != '\0')
+			backend = arg;
+		else if (!(blockCount = parseBlockCount(arg))) {
+			printf("[-] The block count needs to be atleast %u!\n", PNFS_MIN_BLOCKCOUNT);
+			return;
+		}
+	}
+
+	struct fs_blockdevice * newBD;
+	bool cached = false;
+	if (!strcasecmp(backend, "file")) {
+		newBD = (struct fs_blockdevice *)file_blockdevice_init(filename, blockCount);
+		cached = true;
+	} else if (!strcasecmp(backend, "uring")) {
+		struct file_blockdevice * fileBD = file_blockdevice_init(filename, blockCount);
+		if (fileBD && !file_blockdevice_useUring(fileBD, URING_DEFAULT_DEPTH))
+			printf("[*] io_uring is not available, using pread/pwrite\n");
+		newBD = (struct fs_blockdevice *)fileBD;
+		cached = true;
+	} else if (!strcasecmp(backend, "mmap"))
+		newBD = (struct fs_blockdevice *)mmap_blockdevice_init(filename, blockCount);
+	else {
+		printf("[-] Unknown backend '%s', valid backends are: file, uring, mmap\n", backend);
+		return;
+	}
+
+	if (!newBD) {
+		printf("[-] Failed to open %s! New files need a block count\n", filename);
 		return;
 	}
 
-	free(node);
-	if (parent != cwd)
-		free(parent);
+	if (!useDevice(newBD, cached)) {
+		printf("[-] Failed to mount %s!\n", filename);
+		return;
+	}
+
+	printf("[+] Mounted %s (%u blocks, %s)\n", filename, bd->blockCount, backend);
 }
 
-static void pwd_cmd() {
-	char buf[0x1000];
-	int len = sizeof(buf);
-	getCWD(cwd, buf, &len);
-	printf("%s\n", buf);
+/**
+ * Restore the HDD from a raw image, without reading any of it yet.
+ * The blocks are read from the image the first time they are used.
+ * Mounting it still reads the group descriptors, bitmaps and node maps of every group, as pnfs_init keeps them in memory,
+ * so only the nodes and data blocks are read on demand.
+ * \param filename The image
+ * \return If the image could be opened
+ */
+static bool openLazily(char * filename) {
+	if (access(filename, R_OK)) // file_blockdevice_init would create it
+		return false;
+
+	struct file_blockdevice * image = file_blockdevice_init(filename, 0);
+	if (!image)
+		return false;
+	file_blockdevice_useUring(image, URING_DEFAULT_DEPTH);
+
+	if (!lazy) {
+		struct lazy_blockdevice * newLazy = lazy_blockdevice_init(bd);
+		if (!newLazy) {
+			fs_blockdevice_free((struct fs_blockdevice *)image);
+			return false;
+		}
+		lazy = newLazy;
+		bd = (struct fs_blockdevice *)lazy;
+		fs_blockdevice_trackChanges(bd);
+		fs_blockdevice_trackStats(bd);
+	}
+
+	if (!lazy_blockdevice_setImage(lazy, (struct fs_blockdevice *)image)) {
+		fs_blockdevice_free((struct fs_blockdevice *)image);
+		return false;
+	}
+	fs_blockdevice_resetChanges(bd);
+	return true;
 }
 
-static void restoreImage_cmd() {
+/**
+ * Restore the HDD from a image, and apply the deltas that are given after it.
+ * \param lazily If the blocks should be read from the image when they are first used
+ */
+static void restoreImage(bool lazily) {
 	char * filename = NEXT_TOKEN;
 	if (!filename) {
 		printf("[-] A filename is required!\n");
 		return;
 	}
 
-	free(sn);
+	if (lazily && fs_blockdevice_isSparseImage(filename)) {
+		printf("[*] Sparse images can not be opened lazily, all of it will be loaded\n");
+		lazily = false;
+	}
 
-	if (!fs_blockdevice_load(bd, filename)) {
+	if (!(lazily ? openLazily(filename) : fs_blockdevice_load(bd, filename))) {
 		printf("[-] Failed to loaded HDD image!\n");
 		return;
 	}
+	setLastImage(filename);
 
-	printf("[+] Loaded HDD image correctly\n");
-	sn = (struct fs_supernode *)pnfs_init(bd);
-	cwd = fs_supernode_getNode(sn, NODE_ROOT);
+	pnfs_free((struct pnfs_supernode *)sn);
+	if (lazily)
+		printf("[+] Opened HDD image (%u blocks), the blocks will be read when they are used\n", bd->blockCount);
+	else
+		printf("[+] Loaded HDD image correctly (%u blocks)\n", bd->blockCount);
+
+	// The deltas count as changes, so createImage on the image will write them into it.
+	// The HDD is only part of the way to what was saved if one of them fails, so it is not mounted then
+	for (char * delta = NEXT_TOKEN; delta; delta = NEXT_TOKEN)
+		if (fs_blockdevice_loadDelta(bd, delta))
+			printf("[+] Applied delta %s\n", delta);
+		else {
+			printf("[-] Failed to apply delta %s, the image is not mounted!\n", delta);
+			setLastImage(NULL);
+			useFS(NULL);
+			return;
+		}
+
+	struct fs_supernode * newSN = (struct fs_supernode *)pnfs_init(bd);
+	if (!newSN && bd->blockCount < PNFS_MIN_BLOCKCOUNT) {
+		printf("[-] The image is too small, formatting it as %u blocks\n", PNFS_MIN_BLOCKCOUNT);
+		if (fs_blockdevice_resize(bd, PNFS_MIN_BLOCKCOUNT))
+			newSN = (struct fs_supernode *)pnfs_init(bd);
+	}
+	useFS(newSN);
+}
+
+static void openImage_cmd() {
+	restoreImage(true);
+}
+
+static void pwd_cmd() {
+	char buf[0x1000] = "/";
+	int len = sizeof(buf);
+	getCWD(cwd, buf, &len);
+	printf("%s\n", buf);
+}
+
+static void restoreImage_cmd() {
+	restoreImage(false);
 }
 
 static void rm_cmd() {
@@ -446,13 +844,13 @@ static void rm_cmd() {
 	}
 
 	if (!parent) {
-		free(node);
+		fs_supernode_putNode(sn, node);
 		printf("[-] Could not find parent!\n");
 		return;
 	}
 
 	fs_node_id id = node->id;
-	free(node);
+	fs_supernode_putNode(sn, node);
 
 	if (id == NODE_ROOT)
 		printf("[-] You can't remove the root node!\n", path);
@@ -461,8 +859,107 @@ static void rm_cmd() {
 	else
 		printf("[-] Failed to remove %s\n", path);
 
-	if (parent != cwd)
-		free(parent);
+	if (lastSlash)
+		fs_supernode_putNode(sn, parent);
+}
+
+/**
+ * Print the request statistics of a blockdevice, if it keeps them.
+ * \param name What the blockdevice is
+ * \param device The blockdevice, can be NULL
+ * \param reset If the statistics should be zeroed after they are printed
+ */
+static void printStats(const char * name, struct fs_blockdevice * device, bool reset) {
+	if (!device || !device->stats)
+		return;
+
+	printf("[*] %s:\n", name);
+	printf("\t%-10s %10s %10s %10s %10s  %s\n", "request", "calls", "blocks", "KiB", "avg us", "latency histogram");
+	for (int op = 0; op < BLOCKDEVICE_OP_COUNT; op++) {
+		struct fs_blockdevice_opStats * stats = &device->stats->ops[op];
+		if (!stats->calls)
+			continue;
+
+		printf("\t%-10s %10llu %10llu %10llu %10.1f ", fs_blockdevice_opName(op), (unsigned long long)stats->calls,
+			(unsigned long long)stats->blocks, (unsigned long long)(stats->blocks * BLOCK_SIZE / 1024),
+			stats->nanoseconds / 1000.0 / stats->calls);
+		for (int i = 0; i < BLOCKDEVICE_STATS_BUCKETS; i++)
+			if (stats->histogram[i] && i == BLOCKDEVICE_STATS_BUCKETS - 1)
+				printf(" >=%lluus:%llu", 1ULL << (i - 1), (unsigned long long)stats->histogram[i]);
+			else if (stats->histogram[i])
+				printf(" <%lluus:%llu", 1ULL << i, (unsigned long long)stats->histogram[i]);
+		printf("\n");
+	}
+
+	if (reset)
+		fs_blockdevice_resetStats(device);
+}
+
+/**
+ * Print how many heap allocations the filesystem operations have made.
+ * \param reset If the counters should be zeroed after they are printed
+ */
+static void printAllocations(bool reset) {
+	struct pnfs_supernode * pnfs = (struct pnfs_supernode *)sn;
+	printf("[*] PNFS heap allocations:\n");
+	printf("\t%-10s %10s %10s %10s\n", "operation", "calls", "allocs", "per call");
+	for (int op = 0; op < PNFS_OP_COUNT; op++) {
+		struct pnfs_opAllocations * allocs = &pnfs->runtimeStorage.opAllocations[op];
+		if (!allocs->calls)
+			continue;
+
+		printf("\t%-10s %10llu %10llu %10.2f\n", pnfs_opName(op), (unsigned long long)allocs->calls,
+			(unsigned long long)allocs->allocations, (double)allocs->allocations / allocs->calls);
+	}
+
+	if (reset)
+		pnfs_resetAllocations(pnfs);
+}
+
+static void stats_cmd() {
+	char * arg = NEXT_TOKEN;
+	bool reset = arg && !strcmp(arg, "reset");
+	if (arg && !reset) {
+		printf("[-] Unknown argument '%s'!\n", arg);
+		return;
+	}
+
+	printStats("HDD", bd, reset);
+	if (sn)
+		printAllocations(reset);
+	if (lazy)
+		printStats("Below the lazy image", lazy->bd, reset);
+	if (cache) {
+		uint64_t lookups = cache->hits + cache->misses;
+		printf("[*] Cache: %llu hits, %llu misses (%.1f%% hits), %llu evictions, %llu write backs\n",
+			(unsigned long long)cache->hits, (unsigned long long)cache->misses, lookups ? 100.0 * cache->hits / lookups : 0.0,
+			(unsigned long long)cache->evictions, (unsigned long long)cache->writeBacks);
+		if (reset)
+			cache_blockdevice_resetStats(cache);
+		printStats("Below the cache", cache->bd, reset);
+	}
+	if (reset)
+		printf("[+] The statistics have been reset\n");
+}
+
+static void sync_cmd() {
+	if (sn)
+		fs_supernode_sync(sn);
+	fs_blockdevice_sync(bd);
+	printf("[+] Synced\n");
+}
+
+static void truncate_cmd() {
+	uint64_t size;
+	struct fs_node * node = fileAndSizeArgs(&size);
+	if (!node)
+		return;
+
+	if (fs_node_truncate(node, size))
+		printf("[+] The file is now %llu bytes in %u blocks\n", (unsigned long long)node->size, node->blockCount);
+	else
+		printf("[-] Failed to truncate the file!\n");
+	fs_supernode_putNode(sn, node);
 }
 
 #undef NEXT_TOKEN
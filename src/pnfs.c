@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <endian.h>
+#include <assert.h>
 #include "fs_supernode.h"
 
 #define min(x_, y_) ({													\
@@ -10,9 +12,16 @@
 			(void)(&x == &y);													\
 			x < y ? x : y; })
 
+#define max(x_, y_) ({													\
+			__typeof__ (x_) x = (x_);									\
+			__typeof__ (y_) y = (y_);									\
+			(void)(&x == &y);													\
+			x > y ? x : y; })
+
 // VTables functions
 static struct fs_node * pnfs_supernode_getNode(struct fs_supernode * sn, fs_node_id id);
 static void pnfs_supernode_saveNode(struct fs_supernode * sn, struct fs_node * node);
+static void pnfs_supernode_putNode(struct fs_supernode * sn, struct fs_node * node);
 
 static struct fs_node * pnfs_supernode_addNode(struct fs_supernode * sn, struct fs_node * parent, enum fs_node_type type, const char * name);
 static bool pnfs_supernode_removeNode(struct fs_supernode * sn, struct fs_node * parent, fs_node_id id);
@@ -23,10 +32,16 @@ static fs_block_id pnfs_supernode_getFreeBlockID(struct fs_supernode * sn);
 static void pnfs_supernode_setBlockUsed(struct fs_supernode * sn, fs_block_id id);
 static void pnfs_supernode_setBlockFree(struct fs_supernode * sn, fs_block_id id);
 
-static uint16_t pnfs_node_readData(struct fs_node * node, void * buffer, uint16_t offset, uint16_t size);
-static uint16_t pnfs_node_writeData(struct fs_node * node, const void * buffer, uint16_t offset, uint16_t size);
+static void pnfs_supernode_begin(struct fs_supernode * sn);
+static void pnfs_supernode_commit(struct fs_supernode * sn);
+static void pnfs_supernode_sync(struct fs_supernode * sn);
 
-static struct fs_direntry * pnfs_node_directoryEntries(struct fs_node * node, uint16_t * amount);
+static uint64_t pnfs_node_readData(struct fs_node * node, void * buffer, uint64_t offset, uint64_t size);
+static uint64_t pnfs_node_writeData(struct fs_node * node, const void * buffer, uint64_t offset, uint64_t size);
+static bool pnfs_node_allocate(struct fs_node * node, uint64_t offset, uint64_t size);
+static bool pnfs_node_truncate(struct fs_node * node, uint64_t size);
+
+static struct fs_direntry * pnfs_node_directoryEntries(struct fs_node * node, uint32_t * amount);
 static struct fs_node * pnfs_node_findNode(struct fs_node * node, const char * path);
 
 static char * pnfs_node_getName(struct fs_node * node, struct fs_node * parent);
@@ -36,6 +51,7 @@ static struct fs_node * pnfs_node_getParent(struct fs_node * node);
 static struct fs_supernode_vtbl pnfs_supernode_vtbl = {
 	.getNode = &pnfs_supernode_getNode,
 	.saveNode = &pnfs_supernode_saveNode,
+	.putNode = &pnfs_supernode_putNode,
 
 	.addNode = &pnfs_supernode_addNode,
 	.removeNode = &pnfs_supernode_removeNode,
@@ -44,12 +60,18 @@ static struct fs_supernode_vtbl pnfs_supernode_vtbl = {
 	.getFreeBlockID = &pnfs_supernode_getFreeBlockID,
 
 	.setBlockUsed = &pnfs_supernode_setBlockUsed,
-	.setBlockFree = &pnfs_supernode_setBlockFree
+	.setBlockFree = &pnfs_supernode_setBlockFree,
+
+	.begin = &pnfs_supernode_begin,
+	.commit = &pnfs_supernode_commit,
+	.sync = &pnfs_supernode_sync
 };
 
 static struct fs_node_vtbl pnfs_node_vtbl = {
 	.readData = &pnfs_node_readData,
 	.writeData = &pnfs_node_writeData,
+	.allocate = &pnfs_node_allocate,
+	.truncate = &pnfs_node_truncate,
 
 	.directoryEntries = &pnfs_node_directoryEntries,
 	.findNode = &pnfs_node_findNode,
@@ -63,94 +85,399 @@ static struct fs_node_vtbl pnfs_node_vtbl = {
 /**
  * Helper structure reference for how the node blocks should look like
  */
-struct pnfs_nodeBlock { // This is to help with the reading
-	/// 8 nodes in raw form
+union pnfs_nodeBlock { // This is to help with the reading
+	/// PNFS_NODES_PER_BLOCK nodes in raw form
 	struct {
 		uint8_t _[sizeof(struct pnfs_node) - sizeof(void * /* Vtbl */)-sizeof(((struct pnfs_node *)NULL)->runtimeStorage)];
-	} blocks[8];
+	} blocks[PNFS_NODES_PER_BLOCK];
+
+	/// Makes sure the whole block fits
+	struct fs_block block;
 };
 
+/**
+ * The size of the part of pnfs_supernode that is stored in the header block.
+ * \relates pnfs_supernode
+ */
+#define PNFS_HEADER_SIZE (sizeof(struct pnfs_supernode) - sizeof(void * /* Vtbl */) - sizeof(((struct pnfs_supernode *)NULL)->runtimeStorage))
+
+/**
+ * The amount of nodes in each group.
+ * \relates pnfs_group
+ */
+#define PNFS_NODES_PER_GROUP(sn_) ((sn_)->nodeBlocksPerGroup * PNFS_NODES_PER_BLOCK)
+
+/**
+ * The amount of blocks the node map of each group spans.
+ * \relates pnfs_group
+ */
+#define PNFS_NODE_MAP_BLOCKS(sn_) (((sn_)->nodeBlocksPerGroup + PNFS_NODE_MAP_ENTRIES - 1) / PNFS_NODE_MAP_ENTRIES)
+
 
 
 /**
- * The amount of datablock a pnfs_blockBlock have.
- * \relates pnfs_blockBlock
+ * The amount of extents a pnfs_extentBlock have.
+ * \relates pnfs_extentBlock
  */
-#define PNFS_BLOCKBLOCK_BLOCKCOUNT (uint16_t)(NODE_SIZE/2 - 1)
+#define PNFS_EXTENTBLOCK_EXTENTS (uint16_t)((BLOCK_SIZE - sizeof(uint32_t) - sizeof(fs_block_id))/sizeof(struct pnfs_extent))
 
 /**
- * Helper struct for handling block blocks.
- * This is what nodes reference in the next pointer.
+ * Helper struct for handling extent blocks.
+ * This is what nodes reference in the extentBlock pointer.
  */
-struct pnfs_blockBlock {
-	/// Extra data blocks
-	fs_block_id dataBlocks[PNFS_BLOCKBLOCK_BLOCKCOUNT];
-	/// If the node requires yet another pnfs_blockBlock
+struct pnfs_extentBlock {
+	/// Extra extents, they continue where the ones before ended
+	struct pnfs_extent extents[PNFS_EXTENTBLOCK_EXTENTS];
+	/// The amount of used extents in \ref extents
+	uint32_t count;
+	/// If the node requires yet another pnfs_extentBlock
 	fs_block_id next;
 };
 
+/**
+ * The decoded extents of a node.
+ * Where each extent ends in the file is kept with it, so the extent for a block can be found with a binary search.
+ */
+struct pnfs_extentMap {
+	/// The node the extents are for, ::NODE_INVALID if the map is unused
+	fs_node_id id;
+	/// The amount of extents
+	uint32_t count;
+	/// The extents, in the order they are in the file
+	struct pnfs_extent * extents;
+	/// The first block in the file after each extent
+	uint32_t * ends;
+};
+
+/**
+ * Data written to the end of a file in a transaction.
+ * It is kept in memory and gets its blocks when the transaction is committed, when the final size is known,
+ * so the whole file can be allocated as one run.
+ */
+struct pnfs_delayedWrite {
+	/// The node the data is for, ::NODE_INVALID if unused
+	fs_node_id id;
+	/// Where in the file the data starts
+	uint64_t offset;
+	/// The amount of bytes in \ref data
+	uint32_t size;
+	/// The amount of bytes \ref data has room for
+	uint32_t capacity;
+	/// The data
+	uint8_t * data;
+};
+
+/**
+ * A slab of nodes, they are handed out one at a time and are all freed with the pnfs_supernode.
+ */
+struct pnfs_nodeSlab {
+	/// The slab that was allocated before this one
+	struct pnfs_nodeSlab * next;
+	/// The nodes
+	struct pnfs_node nodes[PNFS_SLAB_NODES];
+};
+
 // Local functions
-static struct pnfs_supernode * pnfs_initFS(struct fs_blockdevice * bd, struct pnfs_supernode * sn);
+static struct pnfs_supernode * pnfs_initFS(struct fs_blockdevice * bd, struct pnfs_supernode * sn, uint32_t nodeCount);
+static bool pnfs_readGroups(struct pnfs_supernode * sn); /// Read the group descriptors, bitmaps and node maps of all the groups
+static void pnfs_writeHeader(struct pnfs_supernode * sn);
+static void pnfs_writeBitmapBlock(struct pnfs_supernode * sn, fs_block_id id);
+static bool pnfs_deferWrite(struct pnfs_supernode * sn, fs_block_id blockID); /// Mark a bitmap or group descriptor block as dirty if a transaction is open
+static void pnfs_flushMeta(struct pnfs_supernode * sn); /// Write the dirty bitmap and group descriptor blocks
+static void pnfs_flushNodes(struct pnfs_supernode * sn); /// Write the dirty nodes, each node block once
+static void pnfs_changeGroup(struct pnfs_supernode * sn, uint32_t group, int32_t freeBlocks, int32_t freeNodes, int32_t directories); /// Update the counts of a group
+static fs_block_id pnfs_groupGoal(struct pnfs_supernode * sn, fs_node_id id); /// Where the search for the first blocks of a node starts
+static uint64_t pnfs_bitmapWord(struct pnfs_supernode * sn, uint32_t word);
+static bool pnfs_buildFullWords(struct pnfs_supernode * sn); /// Build the summary of the free block bitmap
+static fs_block_id pnfs_findFreeBlock(struct pnfs_supernode * sn, fs_block_id from); /// The first free block from \a from, 0 if none
+static void pnfs_setNodeUsed(struct pnfs_supernode * sn, fs_node_id id); /// Mark a node as used in the free node bitmap
+static void pnfs_setNodeFree(struct pnfs_supernode * sn, fs_node_id id); /// Mark a node as free in the free node bitmap
+static fs_node_id pnfs_findFreeNode(struct pnfs_supernode * sn, uint32_t from); /// The first free node from \a from, ::NODE_INVALID if none
+static fs_node_id pnfs_findGroupNode(struct pnfs_supernode * sn, uint32_t group); /// A free node, in \a group if it has one
+static bool pnfs_growNodeTable(struct pnfs_supernode * sn, uint32_t group); /// Give a group another node block
+static fs_block_id * pnfs_nodeMap(struct pnfs_supernode * sn, uint32_t group); /// The node map of a group
+static uint32_t pnfs_directoryGroup(struct pnfs_supernode * sn, uint32_t parentGroup); /// The group a new directory is put in
+static void * pnfs_heapAlloc(struct pnfs_supernode * sn, size_t size); /// A malloc that is counted
+static struct fs_node * pnfs_getNode(struct pnfs_supernode * sn, fs_node_id id); /// Get a node from memory, or read it in
+static uint64_t pnfs_readData(struct pnfs_node * node, void * buffer, uint64_t offset, uint64_t size); /// Read from the blocks and the delayed write
+static void pnfs_countOp(struct pnfs_supernode * sn, enum pnfs_op op, uint64_t allocations); /// Count a operation, \a allocations is the counter from when it started
+static struct pnfs_node * pnfs_allocNode(struct pnfs_supernode * sn); /// Take a node from the slabs
+static void pnfs_releaseNode(struct pnfs_supernode * sn, struct pnfs_node * node); /// Give a node back to the slabs
+static void * pnfs_scratchAlloc(struct pnfs_supernode * sn, size_t size); /// Temporary memory, given back in the reverse order with pnfs_scratchFree
+static void pnfs_scratchFree(struct pnfs_supernode * sn, void * ptr); /// Give back \a ptr and all scratch memory taken after it
+static struct fs_direntry * pnfs_readDirectory(struct pnfs_node * node, uint32_t * amount); /// The entries of a directory, in scratch memory
+static struct fs_node * pnfs_findNode(struct pnfs_node * node, const char * path); /// Look up a path, relative to \a node if it does not start with a '/'
 static void pnfs_insertDirEntry(struct pnfs_node * node, struct fs_direntry * entry);
 static void pnfs_removeDirEntry(struct pnfs_node * node, fs_node_id id);
 
-static void pnfs_addBlock(struct pnfs_node * node); /// Add one block
+static void pnfs_setBlockRun(struct pnfs_supernode * sn, fs_block_id first, uint32_t count, bool used); /// Mark a run of blocks as used or free
+static uint32_t pnfs_allocateRun(struct pnfs_supernode * sn, fs_block_id goal, uint32_t want, fs_block_id * start); /// Allocate up to \a want blocks that follow each other
+
+static struct pnfs_extent * pnfs_readExtents(struct pnfs_node * node, uint32_t room); /// Read all the extents, with \a room for more after them
+static bool pnfs_writeExtents(struct pnfs_node * node, const struct pnfs_extent * extents, uint32_t count); /// Replace the extents
+static uint32_t pnfs_freeExtents(struct pnfs_supernode * sn, struct pnfs_extent * extents, uint32_t count, uint32_t from); /// Free the blocks from block \a from
+static struct pnfs_extentMap * pnfs_getExtentMap(struct pnfs_node * node); /// Get the decoded extents of a node with extent blocks
+static void pnfs_dropExtentMap(struct pnfs_supernode * sn, fs_node_id id); /// Forget the decoded extents of a node
+static uint64_t pnfs_writeBlocks(struct pnfs_node * node, const void * buffer, uint64_t offset, uint64_t size); /// Write the data straight to the blocks
+static bool pnfs_writeInline(struct pnfs_node * node, const void * buffer, uint64_t offset, uint64_t size); /// Keep the data in the node, if the file fits in it
+static bool pnfs_moveInlineData(struct pnfs_node * node); /// Move the data of a file from the node to a data block
+static struct pnfs_delayedWrite * pnfs_findDelayedWrite(struct pnfs_supernode * sn, fs_node_id id); /// The delayed write of a node, if it has one
+static bool pnfs_delayWrite(struct pnfs_node * node, const void * buffer, uint64_t offset, uint64_t size); /// Keep the data in memory until the commit, if it can
+static void pnfs_flushDelayedWrite(struct pnfs_supernode * sn, struct pnfs_delayedWrite * delayed); /// Allocate the blocks and write the data
+static void pnfs_dropDelayedWrite(struct pnfs_delayedWrite * delayed); /// Forget the data
+static uint32_t pnfs_getDataBlocks(struct pnfs_node * node, uint32_t first, uint32_t count, struct fs_blockio * ios); /// Look up the ids of a range of data blocks
+static uint32_t pnfs_addBlocks(struct pnfs_node * node, uint32_t count); /// Add blocks to the end, returns how many that could be added
 static void pnfs_removeBlocks(struct pnfs_node * node); /// Remove all unneeded blocks (Based on size)
 
 // Code
-struct pnfs_supernode * pnfs_init(struct fs_blockdevice * bd) {
-	struct fs_block block;
+/**
+ * Allocate the pnfs_supernode and its runtime storage, the header is not read.
+ */
+static struct pnfs_supernode * pnfs_alloc(struct fs_blockdevice * bd) {
 	struct pnfs_supernode * sn = malloc(sizeof(struct pnfs_supernode));
-	fs_blockdevice_read(bd, PNFS_BLOCK_HEADER, &block);
-	memcpy(((void *)sn) + sizeof(void *), &block, sizeof(struct pnfs_supernode)-sizeof(void * /*vtbl*/)-sizeof(sn->runtimeStorage));
+	if (!sn)
+		return NULL;
 	sn->base.vtbl = &pnfs_supernode_vtbl;
 	sn->runtimeStorage.bd = bd;
+	sn->runtimeStorage.groups = NULL;
+	sn->runtimeStorage.freeBlocksBitmap = NULL;
+	sn->runtimeStorage.fullWords = NULL;
+	sn->runtimeStorage.nextFreeBlock = 0;
+	sn->runtimeStorage.freeNodesBitmap = NULL;
+	sn->runtimeStorage.nextFreeNode = 0;
+	sn->runtimeStorage.nodeMaps = NULL;
+	sn->runtimeStorage.extentMaps = calloc(PNFS_EXTENT_MAPS, sizeof(struct pnfs_extentMap));
+	sn->runtimeStorage.nextExtentMap = 0;
+	sn->runtimeStorage.nodeBuckets = calloc(PNFS_NODE_BUCKETS, sizeof(struct pnfs_node *));
+	sn->runtimeStorage.firstUnused = NULL;
+	sn->runtimeStorage.lastUnused = NULL;
+	sn->runtimeStorage.unusedCount = 0;
+	sn->runtimeStorage.dirtyNodes = NULL;
+	sn->runtimeStorage.nodeSlabs = NULL;
+	sn->runtimeStorage.freeNodes = NULL;
+	sn->runtimeStorage.scratch = malloc(PNFS_SCRATCH_SIZE);
+	sn->runtimeStorage.scratchSize = PNFS_SCRATCH_SIZE;
+	sn->runtimeStorage.scratchUsed = 0;
+	sn->runtimeStorage.scratchPeak = 0;
+	sn->runtimeStorage.allocations = 0;
+	memset(sn->runtimeStorage.opAllocations, 0, sizeof(sn->runtimeStorage.opAllocations));
+	sn->runtimeStorage.transactions = 0;
+	sn->runtimeStorage.dirtyMeta = NULL;
+	sn->runtimeStorage.delayedWrites = calloc(PNFS_DELAYED_WRITES, sizeof(struct pnfs_delayedWrite));
+	sn->runtimeStorage.nextDelayedWrite = 0;
+	if (!sn->runtimeStorage.extentMaps || !sn->runtimeStorage.nodeBuckets || !sn->runtimeStorage.scratch || !sn->runtimeStorage.delayedWrites) {
+		pnfs_free(sn);
+		return NULL;
+	}
+	return sn;
+}
+
+/**
+ * Finish the loading, when the groups are read or created.
+ */
+static struct pnfs_supernode * pnfs_loaded(struct pnfs_supernode * sn) {
+	if (!sn)
+		return NULL;
+
+	sn->runtimeStorage.dirtyMeta = calloc((sn->blockCount + 7) / 8, 1);
+	if (!sn->runtimeStorage.dirtyMeta) {
+		pnfs_free(sn);
+		return NULL;
+	}
+
+	printf("[+] Loaded PNFS correctly!\n");
+
+	return sn;
+}
+
+struct pnfs_supernode * pnfs_init(struct fs_blockdevice * bd) {
+	struct fs_block block;
+	struct pnfs_supernode * sn = pnfs_alloc(bd);
+	if (!sn)
+		return NULL;
+	fs_blockdevice_read(bd, PNFS_BLOCK_HEADER, &block);
+	memcpy(((void *)sn) + sizeof(void *), &block, PNFS_HEADER_SIZE);
 
 	if (sn->magic != PNFS_MAGIC) {
 		printf("[-] No PNFS found on disk!\n");
-		sn = pnfs_initFS(bd, sn);
+		sn = pnfs_initFS(bd, sn, 0);
+	} else if (sn->version != PNFS_VERSION) { // The data is kept, only a format replaces it
+		printf("[-] Unsupported PNFS version %u, this shell uses version %u!\n", sn->version, PNFS_VERSION);
+		pnfs_free(sn);
+		return NULL;
+	} else if (sn->blockCount > bd->blockCount) {
+		printf("[-] PNFS is bigger than the disk!\n");
+		pnfs_free(sn);
+		return NULL;
+	} else if (!pnfs_readGroups(sn) || !pnfs_buildFullWords(sn)) {
+		pnfs_free(sn);
+		return NULL;
 	}
 
-	printf("[+] Loaded PNFS correctly!\n");
+	return pnfs_loaded(sn);
+}
 
-	(void)pnfs_removeBlocks;
+struct pnfs_supernode * pnfs_format(struct fs_blockdevice * bd, uint32_t nodeCount) {
+	struct pnfs_supernode * sn = pnfs_alloc(bd);
+	if (!sn)
+		return NULL;
+	return pnfs_loaded(pnfs_initFS(bd, sn, nodeCount));
+}
 
-	return sn;
+void pnfs_free(struct pnfs_supernode * sn) {
+	if (!sn)
+		return;
+	free(sn->runtimeStorage.groups);
+	free(sn->runtimeStorage.freeBlocksBitmap);
+	free(sn->runtimeStorage.fullWords);
+	free(sn->runtimeStorage.freeNodesBitmap);
+	free(sn->runtimeStorage.nodeMaps);
+	for (uint32_t i = 0; sn->runtimeStorage.extentMaps && i < PNFS_EXTENT_MAPS; i++) {
+		free(sn->runtimeStorage.extentMaps[i].extents);
+		free(sn->runtimeStorage.extentMaps[i].ends);
+	}
+	free(sn->runtimeStorage.extentMaps);
+	free(sn->runtimeStorage.nodeBuckets);
+	// The nodes that are still used goes away with the supernode
+	for (struct pnfs_nodeSlab * slab = sn->runtimeStorage.nodeSlabs, * next; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	free(sn->runtimeStorage.scratch);
+	free(sn->runtimeStorage.dirtyMeta);
+	for (uint32_t i = 0; sn->runtimeStorage.delayedWrites && i < PNFS_DELAYED_WRITES; i++)
+		free(sn->runtimeStorage.delayedWrites[i].data);
+	free(sn->runtimeStorage.delayedWrites);
+	free(sn);
 }
 
+const char * pnfs_opName(enum pnfs_op op) {
+	static const char * names[PNFS_OP_COUNT] = {
+		"getNode", "findNode", "dirEntries", "readData", "writeData"
+	};
+	return op < PNFS_OP_COUNT ? names[op] : "?";
+}
 
-struct pnfs_supernode * pnfs_initFS(struct fs_blockdevice * bd, struct pnfs_supernode * sn) {
+void pnfs_resetAllocations(struct pnfs_supernode * sn) {
+	memset(sn->runtimeStorage.opAllocations, 0, sizeof(sn->runtimeStorage.opAllocations));
+}
+
+/**
+ * The most node blocks each group can have, so the node ids of all the groups fit in a fs_node_id.
+ */
+static uint32_t pnfs_nodeBlocksPerGroup(uint32_t groupCount) {
+	return min((uint32_t)PNFS_MAX_GROUP_NODE_BLOCKS, (uint32_t)(PNFS_MAX_GROUPS / groupCount));
+}
+
+static struct pnfs_supernode * pnfs_initFS(struct fs_blockdevice * bd, struct pnfs_supernode * sn, uint32_t nodeCount) {
 	printf("[*] Initializing filesystem...\n");
 
+	if (bd->blockCount < PNFS_MIN_BLOCKCOUNT) {
+		printf("[-] The disk is too small, it needs to be atleast %u blocks!\n", PNFS_MIN_BLOCKCOUNT);
+		pnfs_free(sn);
+		return NULL;
+	}
+
+	uint32_t blockCount = bd->blockCount;
+	uint32_t groupCount = (blockCount + PNFS_BLOCKS_PER_GROUP - 1) / PNFS_BLOCKS_PER_GROUP;
+	if (groupCount > PNFS_MAX_GROUPS) {
+		groupCount = PNFS_MAX_GROUPS;
+		blockCount = groupCount * PNFS_BLOCKS_PER_GROUP;
+	}
+
+	// The node blocks are spread evenly over the groups
+	uint32_t nodeBlocks = PNFS_NODE_BLOCKS;
+	if (nodeCount)
+		nodeBlocks = (nodeCount + groupCount * PNFS_NODES_PER_BLOCK - 1) / (groupCount * PNFS_NODES_PER_BLOCK);
+	nodeBlocks = min(max(nodeBlocks, (uint32_t)1), pnfs_nodeBlocksPerGroup(groupCount));
+	uint32_t mapBlocks = (pnfs_nodeBlocksPerGroup(groupCount) + PNFS_NODE_MAP_ENTRIES - 1) / PNFS_NODE_MAP_ENTRIES;
+
+	// A last group without room for any data after its bitmaps and nodes is left out
+	if (groupCount > 1 && blockCount - (groupCount - 1) * PNFS_BLOCKS_PER_GROUP <= 2 + mapBlocks + nodeBlocks) {
+		groupCount--;
+		blockCount = groupCount * PNFS_BLOCKS_PER_GROUP;
+	}
+
 	sn->magic = PNFS_MAGIC;
+	sn->version = PNFS_VERSION;
+	sn->blockCount = blockCount;
+	sn->groupFirst = PNFS_BLOCK_HEADER + 1;
+	sn->groupBlocks = (groupCount + PNFS_GROUPS_PER_BLOCK - 1) / PNFS_GROUPS_PER_BLOCK;
+	sn->groupCount = groupCount;
+	sn->nodeBlocksPerGroup = pnfs_nodeBlocksPerGroup(groupCount);
+	if (sn->groupFirst + sn->groupBlocks + 2 + PNFS_NODE_MAP_BLOCKS(sn) + nodeBlocks >= sn->blockCount) {
+		printf("[-] The disk is too small for %u node blocks in each group!\n", nodeBlocks);
+		pnfs_free(sn);
+		return NULL;
+	}
+	pnfs_writeHeader(sn);
+
+	free(sn->runtimeStorage.groups);
+	free(sn->runtimeStorage.freeBlocksBitmap);
+	free(sn->runtimeStorage.freeNodesBitmap);
+	free(sn->runtimeStorage.nodeMaps);
+	sn->runtimeStorage.groups = calloc(sn->groupBlocks, BLOCK_SIZE);
+	sn->runtimeStorage.freeBlocksBitmap = calloc(sn->groupCount, BLOCK_SIZE);
+	sn->runtimeStorage.freeNodesBitmap = calloc(sn->groupCount, BLOCK_SIZE);
+	sn->runtimeStorage.nodeMaps = calloc((size_t)sn->groupCount * PNFS_NODE_MAP_BLOCKS(sn), BLOCK_SIZE);
+	sn->runtimeStorage.nextFreeBlock = 0;
+	sn->runtimeStorage.nextFreeNode = 0;
+	union pnfs_nodeBlock * emptyNodeBlocks = calloc(nodeBlocks, sizeof(union pnfs_nodeBlock)); // NODETYPE_INVALID is 0
+	if (!sn->runtimeStorage.groups || !sn->runtimeStorage.freeBlocksBitmap || !sn->runtimeStorage.freeNodesBitmap
+		|| !sn->runtimeStorage.nodeMaps || !emptyNodeBlocks) {
+		free(emptyNodeBlocks);
+		pnfs_free(sn);
+		return NULL;
+	}
 
-	// Setup freeBlocksBitmap
-	printf("[*] Initializing blocks...\n");
-	memset(sn->freeBlocksBitmap, 0, sizeof(sn->freeBlocksBitmap));
-	{
-		struct fs_block block;
-		memset(&block, 0, sizeof(struct fs_block));
-		memcpy(&block, ((void *)sn) + sizeof(void *), sizeof(struct pnfs_supernode) - sizeof(void *) - sizeof(sn->runtimeStorage));
-		fs_blockdevice_write(bd, PNFS_BLOCK_HEADER, &block);
-	}
-	fs_supernode_setBlockUsed((struct fs_supernode *)sn, PNFS_BLOCK_HEADER);
-
-	for (fs_block_id b = PNFS_BLOCK_NODE_FIRST; b <= PNFS_BLOCK_NODE_LAST; b++)
-		fs_supernode_setBlockUsed((struct fs_supernode *)sn, b);
-
-	// Setup nodes
-	printf("[*] Initializing nodes...\n");
-	struct pnfs_nodeBlock emptyNodeBlock;
-	memset(&emptyNodeBlock, 0, sizeof(struct pnfs_nodeBlock));
-	for (int i = 0; i < 8; i++) {
-		struct pnfs_node * node = (struct pnfs_node *) (&emptyNodeBlock.blocks[i] - sizeof(void* /* VTbl */));
-		node->base.type = NODETYPE_INVALID;
-		node->base.size = 0;
-		node->base.blockCount = 0;
+	// Setup the groups, the bitmaps come first in every group and the first group has the header and the descriptors before them
+	printf("[*] Initializing groups...\n");
+	uint8_t * bitmap = sn->runtimeStorage.freeBlocksBitmap;
+	for (uint32_t g = 0; g < sn->groupCount; g++) {
+		struct pnfs_group * group = &sn->runtimeStorage.groups[g];
+		group->bitmap = g ? g * PNFS_BLOCKS_PER_GROUP : sn->groupFirst + sn->groupBlocks;
+		group->nodeBitmap = group->bitmap + 1;
+		group->nodeMap = group->nodeBitmap + 1;
+		group->nodeBlocks = nodeBlocks;
+		group->freeNodes = nodeBlocks * PNFS_NODES_PER_BLOCK;
+		group->directories = 0;
+
+		fs_block_id nodeFirst = group->nodeMap + PNFS_NODE_MAP_BLOCKS(sn);
+		fs_block_id * map = pnfs_nodeMap(sn, g);
+		for (uint32_t i = 0; i < nodeBlocks; i++)
+			map[i] = nodeFirst + i;
+
+		for (fs_block_id b = g * PNFS_BLOCKS_PER_GROUP; b < nodeFirst + nodeBlocks; b++)
+			bitmap[b / 8] |= 1 << (b % 8);
+
+		// The bits after the last node is marked as used, so they are not handed out before the group has the node blocks
+		uint8_t * nodeBitmap = &sn->runtimeStorage.freeNodesBitmap[g * BLOCK_SIZE];
+		for (uint32_t n = nodeBlocks * PNFS_NODES_PER_BLOCK; n < PNFS_BITS_PER_BLOCK; n++)
+			nodeBitmap[n / 8] |= 1 << (n % 8);
 	}
 
-	for (fs_block_id b = PNFS_BLOCK_NODE_FIRST; b <= PNFS_BLOCK_NODE_LAST; b++)
-		fs_blockdevice_write(bd, b, (struct fs_block *)&emptyNodeBlock);
+	// Like with the nodes, the bits after the last block is marked as used
+	for (uint32_t b = sn->blockCount; b < sn->groupCount * PNFS_BLOCKS_PER_GROUP; b++)
+		bitmap[b / 8] |= 1 << (b % 8);
+	if (!pnfs_buildFullWords(sn)) {
+		free(emptyNodeBlocks);
+		pnfs_free(sn);
+		return NULL;
+	}
+
+	for (uint32_t g = 0; g < sn->groupCount; g++) {
+		struct pnfs_group * group = &sn->runtimeStorage.groups[g];
+		group->freeBlocks = 0;
+		for (uint32_t word = g * PNFS_BLOCKS_PER_GROUP / 64; word < (g + 1) * PNFS_BLOCKS_PER_GROUP / 64; word++)
+			group->freeBlocks += __builtin_popcountll(~pnfs_bitmapWord(sn, word));
+
+		fs_blockdevice_write(bd, group->bitmap, (struct fs_block *)&bitmap[g * BLOCK_SIZE]);
+		fs_blockdevice_write(bd, group->nodeBitmap, (struct fs_block *)&sn->runtimeStorage.freeNodesBitmap[g * BLOCK_SIZE]);
+		fs_blockdevice_writev(bd, group->nodeMap, PNFS_NODE_MAP_BLOCKS(sn), (struct fs_block *)pnfs_nodeMap(sn, g));
+		fs_blockdevice_writev(bd, pnfs_nodeMap(sn, g)[0], nodeBlocks, (struct fs_block *)emptyNodeBlocks);
+	}
+	fs_blockdevice_writev(bd, sn->groupFirst, sn->groupBlocks, (struct fs_block *)sn->runtimeStorage.groups);
+	free(emptyNodeBlocks);
 
 
 	printf("[*] \tCreating NODE_INVALID...\n");
@@ -159,7 +486,8 @@ struct pnfs_supernode * pnfs_initFS(struct fs_blockdevice * bd, struct pnfs_supe
 		node->base.id = NODE_INVALID;
 		node->base.type = NODETYPE_NEVER_VALID;
 		fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
-		free(node);
+		pnfs_setNodeUsed(sn, NODE_INVALID);
+		fs_supernode_putNode((struct fs_supernode *)sn, (struct fs_node *)node);
 	}
 
 	printf("[*] \tCreating NODE_ROOT...\n");
@@ -169,10 +497,14 @@ struct pnfs_supernode * pnfs_initFS(struct fs_blockdevice * bd, struct pnfs_supe
 		node->base.type = NODETYPE_DIRECTORY;
 		node->base.size = sizeof(struct fs_direntry) * 2;
 		node->base.blockCount = 1;
-		fs_block_id id = node->dataBlocks[0] = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-		fs_supernode_setBlockUsed((struct fs_supernode *)sn, id);
+		fs_block_id id;
+		pnfs_allocateRun(sn, pnfs_groupGoal(sn, NODE_ROOT), 1, &id);
+		node->extents[0] = (struct pnfs_extent){ .start = id, .length = 1 };
+		node->extentCount = 1;
 		fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
-		free(node);
+		pnfs_setNodeUsed(sn, NODE_ROOT);
+		pnfs_changeGroup(sn, 0, 0, 0, 1);
+		fs_supernode_putNode((struct fs_supernode *)sn, (struct fs_node *)node);
 
 		struct fs_direntry entries[8];
 		memset(entries, 0, sizeof(entries));
@@ -189,40 +521,519 @@ struct pnfs_supernode * pnfs_initFS(struct fs_blockdevice * bd, struct pnfs_supe
 	return sn;
 }
 
+static bool pnfs_readGroups(struct pnfs_supernode * sn) {
+	struct fs_blockdevice * bd = sn->runtimeStorage.bd;
+	sn->runtimeStorage.groups = malloc((size_t)sn->groupBlocks * BLOCK_SIZE);
+	sn->runtimeStorage.freeBlocksBitmap = malloc((size_t)sn->groupCount * BLOCK_SIZE);
+	sn->runtimeStorage.freeNodesBitmap = malloc((size_t)sn->groupCount * BLOCK_SIZE);
+	sn->runtimeStorage.nodeMaps = malloc((size_t)sn->groupCount * PNFS_NODE_MAP_BLOCKS(sn) * BLOCK_SIZE);
+	uint32_t perGroup = 2 + PNFS_NODE_MAP_BLOCKS(sn);
+	struct fs_blockio * ios = malloc(sn->groupCount * perGroup * sizeof(struct fs_blockio));
+	if (!sn->runtimeStorage.groups || !sn->runtimeStorage.freeBlocksBitmap || !sn->runtimeStorage.freeNodesBitmap
+		|| !sn->runtimeStorage.nodeMaps || !ios) {
+		free(ios);
+		return false;
+	}
+
+	fs_blockdevice_readv(bd, sn->groupFirst, sn->groupBlocks, (struct fs_block *)sn->runtimeStorage.groups);
+
+	// The bitmaps and node maps of all the groups are read as one list
+	for (uint32_t g = 0; g < sn->groupCount; g++) {
+		struct fs_blockio * group = &ios[g * perGroup];
+		group[0] = (struct fs_blockio){ .id = sn->runtimeStorage.groups[g].bitmap, .block = (struct fs_block *)&sn->runtimeStorage.freeBlocksBitmap[g * BLOCK_SIZE] };
+		group[1] = (struct fs_blockio){ .id = sn->runtimeStorage.groups[g].nodeBitmap, .block = (struct fs_block *)&sn->runtimeStorage.freeNodesBitmap[g * BLOCK_SIZE] };
+		for (uint32_t i = 0; i < PNFS_NODE_MAP_BLOCKS(sn); i++)
+			group[2 + i] = (struct fs_blockio){ .id = sn->runtimeStorage.groups[g].nodeMap + i, .block = (struct fs_block *)&pnfs_nodeMap(sn, g)[i * PNFS_NODE_MAP_ENTRIES] };
+	}
+	fs_blockdevice_readList(bd, ios, sn->groupCount * perGroup);
+	free(ios);
+	return true;
+}
+
+static void pnfs_writeHeader(struct pnfs_supernode * sn) {
+	struct fs_block block;
+	memset(&block, 0, sizeof(struct fs_block));
+	memcpy(&block, ((void *)sn) + sizeof(void *), PNFS_HEADER_SIZE);
+	fs_blockdevice_write(sn->runtimeStorage.bd, PNFS_BLOCK_HEADER, &block);
+}
+
+static bool pnfs_deferWrite(struct pnfs_supernode * sn, fs_block_id blockID) {
+	if (!sn->runtimeStorage.transactions || !sn->runtimeStorage.dirtyMeta)
+		return false;
+	sn->runtimeStorage.dirtyMeta[blockID / 8] |= 1 << (blockID % 8);
+	return true;
+}
+
+/**
+ * Add a block to the list of blocks to write, if it is dirty.
+ * Without a list it is written right away.
+ */
+static void pnfs_addDirtyBlock(struct pnfs_supernode * sn, fs_block_id id, void * data, struct fs_blockio * ios, uint32_t * count) {
+	uint8_t * dirty = sn->runtimeStorage.dirtyMeta;
+	if (!(dirty[id / 8] & (1 << (id % 8))))
+		return;
+
+	dirty[id / 8] &= ~(1 << (id % 8));
+	if (ios)
+		ios[(*count)++] = (struct fs_blockio){ .id = id, .block = data };
+	else
+		fs_blockdevice_write(sn->runtimeStorage.bd, id, data);
+}
+
+static void pnfs_flushMeta(struct pnfs_supernode * sn) {
+	// The dirty blocks are spread over the groups, so they are written as one list
+	struct fs_blockio * ios = malloc((sn->groupBlocks + sn->groupCount * (2 + PNFS_NODE_MAP_BLOCKS(sn))) * sizeof(struct fs_blockio));
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < sn->groupBlocks; i++)
+		pnfs_addDirtyBlock(sn, sn->groupFirst + i, &sn->runtimeStorage.groups[i * PNFS_GROUPS_PER_BLOCK], ios, &count);
+	for (uint32_t g = 0; g < sn->groupCount; g++) {
+		pnfs_addDirtyBlock(sn, sn->runtimeStorage.groups[g].bitmap, &sn->runtimeStorage.freeBlocksBitmap[g * BLOCK_SIZE], ios, &count);
+		pnfs_addDirtyBlock(sn, sn->runtimeStorage.groups[g].nodeBitmap, &sn->runtimeStorage.freeNodesBitmap[g * BLOCK_SIZE], ios, &count);
+		for (uint32_t i = 0; i < PNFS_NODE_MAP_BLOCKS(sn); i++)
+			pnfs_addDirtyBlock(sn, sn->runtimeStorage.groups[g].nodeMap + i, &pnfs_nodeMap(sn, g)[i * PNFS_NODE_MAP_ENTRIES], ios, &count);
+	}
+
+	if (count)
+		fs_blockdevice_writeList(sn->runtimeStorage.bd, ios, count);
+	free(ios);
+}
+
+static void pnfs_writeBitmapBlock(struct pnfs_supernode * sn, fs_block_id id) {
+	uint32_t group = id / PNFS_BLOCKS_PER_GROUP;
+	fs_block_id blockID = sn->runtimeStorage.groups[group].bitmap;
+	if (pnfs_deferWrite(sn, blockID))
+		return;
+	fs_blockdevice_write(sn->runtimeStorage.bd, blockID, (struct fs_block *)&sn->runtimeStorage.freeBlocksBitmap[group * BLOCK_SIZE]);
+}
+
+static void pnfs_changeGroup(struct pnfs_supernode * sn, uint32_t group, int32_t freeBlocks, int32_t freeNodes, int32_t directories) {
+	struct pnfs_group * desc = &sn->runtimeStorage.groups[group];
+	desc->freeBlocks += freeBlocks;
+	desc->freeNodes += freeNodes;
+	desc->directories += directories;
+
+	uint32_t idx = group / PNFS_GROUPS_PER_BLOCK;
+	if (pnfs_deferWrite(sn, sn->groupFirst + idx))
+		return;
+	fs_blockdevice_write(sn->runtimeStorage.bd, sn->groupFirst + idx, (struct fs_block *)&sn->runtimeStorage.groups[idx * PNFS_GROUPS_PER_BLOCK]);
+}
+
+static fs_block_id pnfs_groupGoal(struct pnfs_supernode * sn, fs_node_id id) {
+	// The bitmap block is always used, so the search starts there instead of extending it
+	return sn->runtimeStorage.groups[id / PNFS_NODES_PER_GROUP(sn)].bitmap;
+}
+
+/**
+ * The amount of 64 bit words in the free block bitmap, one pnfs_supernode::fullWords bit each.
+ */
+#define PNFS_BITMAP_WORDS(sn_) ((sn_)->groupCount * (BLOCK_SIZE / sizeof(uint64_t)))
+
+/**
+ * Get 64 bits of the free block bitmap, bit i is block word * 64 + i.
+ */
+static uint64_t pnfs_bitmapWord(struct pnfs_supernode * sn, uint32_t word) {
+	uint64_t bits;
+	memcpy(&bits, &sn->runtimeStorage.freeBlocksBitmap[word * sizeof(uint64_t)], sizeof(bits));
+	return le64toh(bits); // The bitmap is stored byte by byte
+}
+
+/**
+ * Update the pnfs_supernode::fullWords bit for the word that has \a id.
+ */
+static void pnfs_updateFullWord(struct pnfs_supernode * sn, fs_block_id id) {
+	uint32_t word = id / 64;
+	if (pnfs_bitmapWord(sn, word) == UINT64_MAX)
+		sn->runtimeStorage.fullWords[word / 64] |= UINT64_C(1) << (word % 64);
+	else
+		sn->runtimeStorage.fullWords[word / 64] &= ~(UINT64_C(1) << (word % 64));
+}
+
+static bool pnfs_buildFullWords(struct pnfs_supernode * sn) {
+	free(sn->runtimeStorage.fullWords);
+	sn->runtimeStorage.fullWords = calloc(sn->groupCount, sizeof(uint64_t));
+	if (!sn->runtimeStorage.fullWords)
+		return false;
+
+	for (uint32_t word = 0; word < PNFS_BITMAP_WORDS(sn); word++)
+		if (pnfs_bitmapWord(sn, word) == UINT64_MAX)
+			sn->runtimeStorage.fullWords[word / 64] |= UINT64_C(1) << (word % 64);
+	return true;
+}
+
+static fs_block_id pnfs_findFreeBlock(struct pnfs_supernode * sn, fs_block_id from) {
+	uint32_t word = from / 64;
+	if (word >= PNFS_BITMAP_WORDS(sn))
+		return 0;
+
+	uint64_t free = ~pnfs_bitmapWord(sn, word) & (UINT64_MAX << (from % 64));
+	if (free)
+		return word * 64 + __builtin_ctzll(free);
+
+	// The rest is found through the summary, which skips 64 full words at the time
+	word++;
+	for (uint32_t summary = word / 64; summary < sn->groupCount; summary++) {
+		uint64_t notFull = ~sn->runtimeStorage.fullWords[summary];
+		if (summary == word / 64)
+			notFull &= UINT64_MAX << (word % 64);
+		if (notFull) {
+			uint32_t found = summary * 64 + __builtin_ctzll(notFull);
+			return found * 64 + __builtin_ctzll(~pnfs_bitmapWord(sn, found));
+		}
+	}
+	return 0;
+}
+
+/**
+ * The bit of a node in pnfs_supernode::freeNodesBitmap, every group has its own block in it.
+ */
+static uint32_t pnfs_nodeBit(struct pnfs_supernode * sn, fs_node_id id) {
+	return id / PNFS_NODES_PER_GROUP(sn) * PNFS_BITS_PER_BLOCK + id % PNFS_NODES_PER_GROUP(sn);
+}
+
+static void pnfs_writeNodeBitmapBlock(struct pnfs_supernode * sn, fs_node_id id) {
+	uint32_t group = id / PNFS_NODES_PER_GROUP(sn);
+	fs_block_id blockID = sn->runtimeStorage.groups[group].nodeBitmap;
+	if (pnfs_deferWrite(sn, blockID))
+		return;
+	fs_blockdevice_write(sn->runtimeStorage.bd, blockID, (struct fs_block *)&sn->runtimeStorage.freeNodesBitmap[group * BLOCK_SIZE]);
+}
+
+static void pnfs_setNodeUsed(struct pnfs_supernode * sn, fs_node_id id) {
+	uint32_t bit = pnfs_nodeBit(sn, id);
+	if (sn->runtimeStorage.freeNodesBitmap[bit / 8] & (1 << (bit % 8)))
+		return;
+	sn->runtimeStorage.freeNodesBitmap[bit / 8] |= 1 << (bit % 8);
+	if (id == sn->runtimeStorage.nextFreeNode)
+		sn->runtimeStorage.nextFreeNode++;
+	pnfs_writeNodeBitmapBlock(sn, id);
+	pnfs_changeGroup(sn, id / PNFS_NODES_PER_GROUP(sn), 0, -1, 0);
+}
+
+static void pnfs_setNodeFree(struct pnfs_supernode * sn, fs_node_id id) {
+	uint32_t bit = pnfs_nodeBit(sn, id);
+	if (!(sn->runtimeStorage.freeNodesBitmap[bit / 8] & (1 << (bit % 8))))
+		return;
+	sn->runtimeStorage.freeNodesBitmap[bit / 8] &= ~(1 << (bit % 8));
+	if (id < sn->runtimeStorage.nextFreeNode)
+		sn->runtimeStorage.nextFreeNode = id;
+	pnfs_writeNodeBitmapBlock(sn, id);
+	pnfs_changeGroup(sn, id / PNFS_NODES_PER_GROUP(sn), 0, 1, 0);
+}
+
+static fs_node_id pnfs_findFreeNode(struct pnfs_supernode * sn, uint32_t from) {
+	uint8_t * bitmap = sn->runtimeStorage.freeNodesBitmap;
+	uint32_t perGroup = PNFS_NODES_PER_GROUP(sn);
+	uint32_t nodeCount = sn->groupCount * perGroup;
+	for (uint32_t i = from; i < nodeCount; i++) {
+		if (!(i % perGroup) && !sn->runtimeStorage.groups[i / perGroup].freeNodes) {
+			i += perGroup - 1;
+			continue;
+		}
+
+		uint32_t bit = pnfs_nodeBit(sn, i);
+		if (!(bit % 8) && bitmap[bit / 8] == 0xFF) {
+			i += 7;
+			continue;
+		}
+		if (!(bitmap[bit / 8] & (1 << (bit % 8))))
+			return i;
+	}
+	return NODE_INVALID;
+}
+
+static fs_node_id pnfs_findGroupNode(struct pnfs_supernode * sn, uint32_t group) {
+	// A full group gets another node block before its nodes spill over to the other groups
+	if (!sn->runtimeStorage.groups[group].freeNodes)
+		pnfs_growNodeTable(sn, group);
+
+	// Every node below nextFreeNode is used, so when the group is full the search continues in the groups after it
+	uint32_t from = max(group * PNFS_NODES_PER_GROUP(sn), sn->runtimeStorage.nextFreeNode);
+	fs_node_id id = pnfs_findFreeNode(sn, from);
+	if (id == NODE_INVALID && from > sn->runtimeStorage.nextFreeNode)
+		id = pnfs_findFreeNode(sn, sn->runtimeStorage.nextFreeNode);
+
+	// Every group is full, so the first one that can grow is used
+	for (uint32_t g = 0; id == NODE_INVALID && g < sn->groupCount; g++)
+		if (pnfs_growNodeTable(sn, g))
+			id = pnfs_findFreeNode(sn, g * PNFS_NODES_PER_GROUP(sn));
+	return id;
+}
+
+static bool pnfs_growNodeTable(struct pnfs_supernode * sn, uint32_t group) {
+	struct pnfs_group * desc = &sn->runtimeStorage.groups[group];
+	if (desc->nodeBlocks >= sn->nodeBlocksPerGroup)
+		return false;
+
+	fs_block_id blockID;
+	if (!pnfs_allocateRun(sn, desc->bitmap, 1, &blockID))
+		return false;
+
+	union pnfs_nodeBlock empty; // NODETYPE_INVALID is 0
+	memset(&empty, 0, sizeof(empty));
+	fs_blockdevice_write(sn->runtimeStorage.bd, blockID, &empty.block);
+
+	uint32_t idx = desc->nodeBlocks / PNFS_NODE_MAP_ENTRIES;
+	fs_block_id * map = pnfs_nodeMap(sn, group);
+	map[desc->nodeBlocks] = blockID;
+	if (!pnfs_deferWrite(sn, desc->nodeMap + idx))
+		fs_blockdevice_write(sn->runtimeStorage.bd, desc->nodeMap + idx, (struct fs_block *)&map[idx * PNFS_NODE_MAP_ENTRIES]);
+
+	// The nodes of the new block were marked as used, as they were after the last one
+	// The last block of the last group ends at UINT16_MAX, so the counter is wider than a fs_node_id
+	uint32_t first = group * PNFS_NODES_PER_GROUP(sn) + desc->nodeBlocks * PNFS_NODES_PER_BLOCK;
+	assert(first + PNFS_NODES_PER_BLOCK <= UINT16_MAX + 1);
+	desc->nodeBlocks++;
+	for (uint32_t id = first; id < first + PNFS_NODES_PER_BLOCK; id++)
+		pnfs_setNodeFree(sn, id);
+	return true;
+}
+
+static fs_block_id * pnfs_nodeMap(struct pnfs_supernode * sn, uint32_t group) {
+	return &sn->runtimeStorage.nodeMaps[(size_t)group * PNFS_NODE_MAP_BLOCKS(sn) * PNFS_NODE_MAP_ENTRIES];
+}
+
+static uint32_t pnfs_directoryGroup(struct pnfs_supernode * sn, uint32_t parentGroup) {
+	// Directories are spread out over the groups with more free nodes than average, so their files have room around them
+	uint64_t freeNodes = 0;
+	for (uint32_t g = 0; g < sn->groupCount; g++)
+		freeNodes += sn->runtimeStorage.groups[g].freeNodes;
+	uint32_t average = freeNodes / sn->groupCount;
+
+	uint32_t best = parentGroup;
+	for (uint32_t g = 0; g < sn->groupCount; g++) {
+		struct pnfs_group * group = &sn->runtimeStorage.groups[g];
+		struct pnfs_group * bestGroup = &sn->runtimeStorage.groups[best];
+		if (!group->freeNodes || group->freeNodes < average)
+			continue;
+		if (!bestGroup->freeNodes || bestGroup->freeNodes < average || group->freeBlocks > bestGroup->freeBlocks
+			|| (group->freeBlocks == bestGroup->freeBlocks && group->directories < bestGroup->directories))
+			best = g;
+	}
+	return best;
+}
+
+/**
+ * The node block a node is stored in.
+ */
+static fs_block_id pnfs_nodeBlockID(struct pnfs_supernode * sn, fs_node_id id) {
+	uint32_t perGroup = PNFS_NODES_PER_GROUP(sn);
+	return pnfs_nodeMap(sn, id / perGroup)[id % perGroup / PNFS_NODES_PER_BLOCK];
+}
+
+static void * pnfs_heapAlloc(struct pnfs_supernode * sn, size_t size) {
+	sn->runtimeStorage.allocations++;
+	return malloc(size);
+}
+
+static void pnfs_countOp(struct pnfs_supernode * sn, enum pnfs_op op, uint64_t allocations) {
+	sn->runtimeStorage.opAllocations[op].calls++;
+	sn->runtimeStorage.opAllocations[op].allocations += sn->runtimeStorage.allocations - allocations;
+}
+
+static struct pnfs_node * pnfs_allocNode(struct pnfs_supernode * sn) {
+	if (!sn->runtimeStorage.freeNodes) {
+		struct pnfs_nodeSlab * slab = pnfs_heapAlloc(sn, sizeof(struct pnfs_nodeSlab));
+		if (!slab)
+			return NULL;
+		slab->next = sn->runtimeStorage.nodeSlabs;
+		sn->runtimeStorage.nodeSlabs = slab;
+		for (uint32_t i = 0; i < PNFS_SLAB_NODES; i++)
+			pnfs_releaseNode(sn, &slab->nodes[i]);
+	}
+
+	struct pnfs_node * node = sn->runtimeStorage.freeNodes;
+	sn->runtimeStorage.freeNodes = node->runtimeStorage.nextInBucket;
+	return node;
+}
+
+static void pnfs_releaseNode(struct pnfs_supernode * sn, struct pnfs_node * node) {
+	node->runtimeStorage.nextInBucket = sn->runtimeStorage.freeNodes;
+	sn->runtimeStorage.freeNodes = node;
+}
+
+static void * pnfs_scratchAlloc(struct pnfs_supernode * sn, size_t size) {
+	size = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+	if (!size)
+		size = sizeof(uint64_t);
+
+	uint32_t used = sn->runtimeStorage.scratchUsed;
+	if (size > sn->runtimeStorage.scratchSize - used) { // It grows when it is not used anymore, until then the heap is used
+		if (used + size > sn->runtimeStorage.scratchPeak)
+			sn->runtimeStorage.scratchPeak = min(used + size, (size_t)UINT32_MAX);
+		return pnfs_heapAlloc(sn, size);
+	}
+
+	sn->runtimeStorage.scratchUsed += size;
+	return sn->runtimeStorage.scratch + used;
+}
+
+static void pnfs_scratchFree(struct pnfs_supernode * sn, void * ptr) {
+	uintptr_t scratch = (uintptr_t)sn->runtimeStorage.scratch;
+	if ((uintptr_t)ptr < scratch || (uintptr_t)ptr >= scratch + sn->runtimeStorage.scratchSize)
+		return free(ptr);
+
+	sn->runtimeStorage.scratchUsed = (uintptr_t)ptr - scratch;
+	if (sn->runtimeStorage.scratchUsed || sn->runtimeStorage.scratchPeak <= sn->runtimeStorage.scratchSize)
+		return;
+
+	sn->runtimeStorage.allocations++;
+	uint8_t * bigger = realloc(sn->runtimeStorage.scratch, sn->runtimeStorage.scratchPeak);
+	if (bigger) {
+		sn->runtimeStorage.scratch = bigger;
+		sn->runtimeStorage.scratchSize = sn->runtimeStorage.scratchPeak;
+	}
+}
+
+/**
+ * Take a node out of the list of nodes that nothing uses.
+ */
+static void pnfs_unlinkUnused(struct pnfs_supernode * sn, struct pnfs_node * node) {
+	if (node->runtimeStorage.prevUnused)
+		node->runtimeStorage.prevUnused->runtimeStorage.nextUnused = node->runtimeStorage.nextUnused;
+	else
+		sn->runtimeStorage.firstUnused = node->runtimeStorage.nextUnused;
+	if (node->runtimeStorage.nextUnused)
+		node->runtimeStorage.nextUnused->runtimeStorage.prevUnused = node->runtimeStorage.prevUnused;
+	else
+		sn->runtimeStorage.lastUnused = node->runtimeStorage.prevUnused;
+	node->runtimeStorage.prevUnused = node->runtimeStorage.nextUnused = NULL;
+	sn->runtimeStorage.unusedCount--;
+}
+
 static struct fs_node * pnfs_supernode_getNode(struct fs_supernode * sn_, fs_node_id id) {
 	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
-	struct pnfs_node * node = malloc(sizeof(struct pnfs_node));
+	uint64_t allocations = sn->runtimeStorage.allocations;
+	struct fs_node * node = pnfs_getNode(sn, id);
+	pnfs_countOp(sn, PNFS_OP_GETNODE, allocations);
+	return node;
+}
+
+static struct fs_node * pnfs_getNode(struct pnfs_supernode * sn, fs_node_id id) {
+	struct pnfs_node ** bucket = &sn->runtimeStorage.nodeBuckets[id % PNFS_NODE_BUCKETS];
+	for (struct pnfs_node * node = *bucket; node; node = node->runtimeStorage.nextInBucket)
+		if (node->base.id == id) {
+			if (!node->runtimeStorage.refCount++)
+				pnfs_unlinkUnused(sn, node);
+			return (struct fs_node *)node;
+		}
+
+	struct pnfs_node * node = pnfs_allocNode(sn);
+	if (!node)
+		return NULL;
 
 	node->base.vtbl = &pnfs_node_vtbl;
-	node->runtimeStorage.sn = sn;
 
-	struct pnfs_nodeBlock block;
-	fs_blockdevice_read(sn->runtimeStorage.bd, id / 8 + 1, (struct fs_block *)&block);
+	union pnfs_nodeBlock scratch;
+	fs_block_id blockID = pnfs_nodeBlockID(sn, id);
+	union pnfs_nodeBlock * block = (union pnfs_nodeBlock *)fs_blockdevice_get(sn->runtimeStorage.bd, blockID, &scratch.block);
 
-	memcpy((void *)node + sizeof(void *), &(block.blocks[id%8]), sizeof(struct pnfs_node) - sizeof(void *)-sizeof(sn->runtimeStorage));
+	memcpy((void *)node + sizeof(void *), &(block->blocks[id % PNFS_NODES_PER_BLOCK]), sizeof(struct pnfs_node) - sizeof(void *)-sizeof(node->runtimeStorage));
+	fs_blockdevice_put(sn->runtimeStorage.bd, blockID, &block->block, false);
+
+	// The slot of a node that was never used can have any id in it
+	node->base.id = id;
+	node->runtimeStorage.sn = sn;
+	node->runtimeStorage.refCount = 1;
+	node->runtimeStorage.prevUnused = node->runtimeStorage.nextUnused = NULL;
+	node->runtimeStorage.dirty = false;
+	node->runtimeStorage.nextDirty = NULL;
+	node->runtimeStorage.nextInBucket = *bucket;
+	*bucket = node;
 	return (struct fs_node *)node;
 }
 
+static void pnfs_supernode_putNode(struct fs_supernode * sn_, struct fs_node * node_) {
+	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
+	struct pnfs_node * node = (struct pnfs_node *)node_;
+	if (!node || --node->runtimeStorage.refCount)
+		return;
+
+	node->runtimeStorage.prevUnused = sn->runtimeStorage.lastUnused;
+	if (sn->runtimeStorage.lastUnused)
+		sn->runtimeStorage.lastUnused->runtimeStorage.nextUnused = node;
+	else
+		sn->runtimeStorage.firstUnused = node;
+	sn->runtimeStorage.lastUnused = node;
+	if (++sn->runtimeStorage.unusedCount <= PNFS_CACHED_NODES)
+		return;
+
+	// The one that was put the longest ago is freed
+	struct pnfs_node * old = sn->runtimeStorage.firstUnused;
+	pnfs_unlinkUnused(sn, old);
+	struct pnfs_node ** link = &sn->runtimeStorage.nodeBuckets[old->base.id % PNFS_NODE_BUCKETS];
+	while (*link != old)
+		link = &(*link)->runtimeStorage.nextInBucket;
+	*link = old->runtimeStorage.nextInBucket;
+	pnfs_releaseNode(sn, old);
+}
+
+
+static void pnfs_flushNodes(struct pnfs_supernode * sn) {
+	while (sn->runtimeStorage.dirtyNodes) {
+		fs_block_id blockID = pnfs_nodeBlockID(sn, sn->runtimeStorage.dirtyNodes->base.id);
+		union pnfs_nodeBlock scratch;
+		union pnfs_nodeBlock * block = (union pnfs_nodeBlock *)fs_blockdevice_get(sn->runtimeStorage.bd, blockID, &scratch.block);
+
+		// The other dirty nodes in the same block are written with it
+		for (struct pnfs_node ** link = &sn->runtimeStorage.dirtyNodes; *link;) {
+			struct pnfs_node * node = *link;
+			if (pnfs_nodeBlockID(sn, node->base.id) != blockID) {
+				link = &node->runtimeStorage.nextDirty;
+				continue;
+			}
+
+			*link = node->runtimeStorage.nextDirty;
+			memcpy(&block->blocks[node->base.id % PNFS_NODES_PER_BLOCK], (void *)node + sizeof(void *), sizeof(struct pnfs_node) - sizeof(void *)-sizeof(node->runtimeStorage));
+			node->runtimeStorage.dirty = false;
+			node->runtimeStorage.nextDirty = NULL;
+			fs_supernode_putNode((struct fs_supernode *)sn, (struct fs_node *)node);
+		}
+		fs_blockdevice_put(sn->runtimeStorage.bd, blockID, &block->block, true);
+	}
+}
 
 static void pnfs_supernode_saveNode(struct fs_supernode * sn_, struct fs_node * node) {
 	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
-	struct pnfs_nodeBlock block;
-	fs_blockdevice_read(sn->runtimeStorage.bd, node->id / 8 + 1, (struct fs_block *)&block);
-	memcpy(&block.blocks[node->id % 8], (void *)node + sizeof(void *), sizeof(struct pnfs_node) - sizeof(void *)-sizeof(sn->runtimeStorage));
-	fs_blockdevice_write(sn->runtimeStorage.bd, node->id / 8 + 1, (struct fs_block *)&block);
+	struct pnfs_node * pnode = (struct pnfs_node *)node;
+	if (sn->runtimeStorage.transactions) { // It can be saved many times in the transaction, so it is written on the commit
+		if (!pnode->runtimeStorage.dirty) {
+			if (!pnode->runtimeStorage.refCount++)
+				pnfs_unlinkUnused(sn, pnode);
+			pnode->runtimeStorage.dirty = true;
+			pnode->runtimeStorage.nextDirty = sn->runtimeStorage.dirtyNodes;
+			sn->runtimeStorage.dirtyNodes = pnode;
+		}
+		return;
+	}
+
+	union pnfs_nodeBlock scratch;
+	fs_block_id blockID = pnfs_nodeBlockID(sn, node->id);
+	union pnfs_nodeBlock * block = (union pnfs_nodeBlock *)fs_blockdevice_get(sn->runtimeStorage.bd, blockID, &scratch.block);
+	memcpy(&block->blocks[node->id % PNFS_NODES_PER_BLOCK], (void *)node + sizeof(void *), sizeof(struct pnfs_node) - sizeof(void *)-sizeof(((struct pnfs_node *)node)->runtimeStorage));
+	fs_blockdevice_put(sn->runtimeStorage.bd, blockID, &block->block, true);
 }
 
 static struct fs_node * pnfs_supernode_addNode(struct fs_supernode * sn, struct fs_node * parent, enum fs_node_type type, const char * name) {
 	struct fs_blockdevice * bd = ((struct pnfs_supernode *)sn)->runtimeStorage.bd;
-	fs_node_id id = fs_supernode_getFreeNodeID(sn);
+	// Files are kept in the group of their directory, while directories are spread out
+	uint32_t group = parent->id / PNFS_NODES_PER_GROUP((struct pnfs_supernode *)sn);
+	if (type == NODETYPE_DIRECTORY)
+		group = pnfs_directoryGroup((struct pnfs_supernode *)sn, group);
+	fs_supernode_begin(sn); // Growing the node table is part of it
+	fs_node_id id = pnfs_findGroupNode((struct pnfs_supernode *)sn, group);
 
 	if (id == NODE_INVALID) {
 		printf("[-] No more free nodes\n");
+		fs_supernode_commit(sn);
 		return NULL;
 	}
 
+	pnfs_setNodeUsed((struct pnfs_supernode *)sn, id);
 	struct pnfs_node * node = (struct pnfs_node *)fs_supernode_getNode((struct fs_supernode *)sn, id);
 	node->runtimeStorage.sn = (struct pnfs_supernode *)sn;
+	memset(node->extents, 0, sizeof(node->extents)); // The slot can still have the extents of the node that was removed
+	node->extentCount = 0;
+	node->extentBlock = 0;
 
 	if (type == NODETYPE_FILE) {
 		node->base.id = id;
@@ -235,9 +1046,18 @@ static struct fs_node * pnfs_supernode_addNode(struct fs_supernode * sn, struct
 		node->base.type = NODETYPE_DIRECTORY;
 		node->base.size = sizeof(struct fs_direntry) * 2;
 		node->base.blockCount = 1;
-		fs_block_id blockID = node->dataBlocks[0] = fs_supernode_getFreeBlockID(sn);
-		fs_supernode_setBlockUsed(sn, blockID);
+		fs_block_id blockID;
+		if (!pnfs_allocateRun((struct pnfs_supernode *)sn, pnfs_groupGoal((struct pnfs_supernode *)sn, id), 1, &blockID)) {
+			printf("[-] No more free blocks\n");
+			pnfs_setNodeFree((struct pnfs_supernode *)sn, id);
+			fs_supernode_commit(sn);
+			fs_supernode_putNode(sn, (struct fs_node *)node);
+			return NULL;
+		}
+		node->extents[0] = (struct pnfs_extent){ .start = blockID, .length = 1 };
+		node->extentCount = 1;
 		fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
+		pnfs_changeGroup((struct pnfs_supernode *)sn, id / PNFS_NODES_PER_GROUP((struct pnfs_supernode *)sn), 0, 0, 1);
 
 		struct fs_direntry entries[8];
 		memset(entries, 0, sizeof(entries));
@@ -248,7 +1068,9 @@ static struct fs_node * pnfs_supernode_addNode(struct fs_supernode * sn, struct
 		strncpy(entries[1].name, "..", sizeof(entries[1].name));
 		fs_blockdevice_write(bd, blockID, (struct fs_block *)&entries);
 	} else {
-		free(node);
+		pnfs_setNodeFree((struct pnfs_supernode *)sn, id);
+		fs_supernode_commit(sn);
+		fs_supernode_putNode(sn, (struct fs_node *)node);
 		return NULL;
 	}
 
@@ -256,616 +1078,924 @@ static struct fs_node * pnfs_supernode_addNode(struct fs_supernode * sn, struct
 	entry.id = id;
 	strncpy(entry.name, name, sizeof(entry.name));
 	pnfs_insertDirEntry((struct pnfs_node *)parent, &entry);
+	fs_supernode_commit(sn);
 	return (struct fs_node *)node;
 }
 
 static bool pnfs_supernode_removeNode(struct fs_supernode * sn, struct fs_node * parent, fs_node_id id) {
 	if (parent->id == id) // Trying to remove '.'
 		return false;
+	fs_supernode_begin(sn);
 	struct pnfs_node * node = (struct pnfs_node *)fs_supernode_getNode(sn, id);
-	if (node->base.type == NODETYPE_FILE) {
-		for (int i = 0; i < PNFS_NODE_BLOCKCOUNT; i++) {
-			if (!node->dataBlocks[i])
-				continue;
-			fs_supernode_setBlockFree(sn, node->dataBlocks[i]);
-			node->dataBlocks[i] = 0;
-		}
-
-		fs_block_id blockBlockID = node->next;
-		struct pnfs_blockBlock blockBlock;
-		struct fs_blockdevice * bd = ((struct pnfs_supernode *)sn)->runtimeStorage.bd;
-
-		while (blockBlockID) {
-			fs_blockdevice_read(bd, blockBlockID, (struct fs_block *)&blockBlock);
-
-			for (int i = 0; i < PNFS_BLOCKBLOCK_BLOCKCOUNT; i++) {
-				if (!node->dataBlocks[i])
-					continue;
-				fs_supernode_setBlockFree(sn, node->dataBlocks[i]);
-				node->dataBlocks[i] = 0;
-			}
-
-			fs_supernode_setBlockFree(sn, blockBlockID);
-
-			blockBlockID = blockBlock.next;
-		}
-	}	else if (node->base.type == NODETYPE_DIRECTORY) {
-		uint16_t amount;
-		struct fs_direntry * dir = fs_node_directoryEntries((struct fs_node *)node, &amount);
+	if (node->base.type == NODETYPE_DIRECTORY) {
+		uint32_t amount;
+		struct fs_direntry * dir = pnfs_readDirectory(node, &amount);
 		if (dir) {
-			for (uint16_t i = 0; i < amount; i++) {
+			for (uint32_t i = 0; i < amount; i++) {
 				if (!strcmp(dir[i].name, ".") || !strcmp(dir[i].name, ".."))
 					continue;
 				fs_supernode_removeNode(sn, (struct fs_node *)node, dir[i].id);
 			}
-			free(dir);
+			pnfs_scratchFree((struct pnfs_supernode *)sn, dir);
 		}
 	}
 
+	struct pnfs_delayedWrite * delayed = pnfs_findDelayedWrite((struct pnfs_supernode *)sn, id);
+	if (delayed)
+		pnfs_dropDelayedWrite(delayed);
+
+	// Both files and directories own their data blocks, unless the data is in the node
+	if (node->extentCount == PNFS_INLINE_DATA) {
+		memset(node->inlineData, 0, PNFS_INLINE_SIZE);
+		node->extentCount = 0;
+	}
+	struct pnfs_extent * extents = pnfs_readExtents(node, 0);
+	if (extents) {
+		pnfs_freeExtents((struct pnfs_supernode *)sn, extents, node->extentCount, 0);
+		free(extents);
+	}
+	pnfs_writeExtents(node, NULL, 0);
+
 	pnfs_removeDirEntry((struct pnfs_node *)parent, id);
 
+	if (node->base.type == NODETYPE_DIRECTORY)
+		pnfs_changeGroup((struct pnfs_supernode *)sn, id / PNFS_NODES_PER_GROUP((struct pnfs_supernode *)sn), 0, 0, -1);
 	node->base.type = NODETYPE_INVALID;
 	node->base.size = 0;
 	node->base.blockCount = 0;
 
 	fs_supernode_saveNode(sn, (struct fs_node *)node);
-	free(node);
+	pnfs_setNodeFree((struct pnfs_supernode *)sn, id);
+	fs_supernode_putNode(sn, (struct fs_node *)node);
 
 	parent->size -= sizeof(struct fs_direntry);
 	fs_supernode_saveNode(sn, parent);
+	fs_supernode_commit(sn);
 	return true;
 }
 
-static fs_node_id pnfs_supernode_getFreeNodeID(struct fs_supernode * sn) {
-	for (fs_node_id i = 0; i < 250; i++) {
-		struct fs_node * node = fs_supernode_getNode(sn, i);
-		if (node->type == NODETYPE_INVALID) {
-			free(node);
-			return i;
-		}
-		free(node);
-	}
-	return NODE_INVALID;
+static fs_node_id pnfs_supernode_getFreeNodeID(struct fs_supernode * sn_) {
+	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
+	// Every node below nextFreeNode is used, so it is where the first free one can be
+	fs_node_id id = pnfs_findFreeNode(sn, sn->runtimeStorage.nextFreeNode);
+	sn->runtimeStorage.nextFreeNode = id != NODE_INVALID ? id : sn->groupCount * PNFS_NODES_PER_GROUP(sn);
+	return id;
 }
 
 
 static fs_block_id pnfs_supernode_getFreeBlockID(struct fs_supernode * sn_) {
 	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
-	for (int i = 0; i < 32; i++)
-		if (sn->freeBlocksBitmap[i] != 0xFF) {
-			uint8_t row = sn->freeBlocksBitmap[i];
-			for (int j = 0; j < 8; j++)
-				if (!(row & (1 << j)))
-					return i * 8 + j;
-		}
-	return -1;
+	// Next fit, so the search does not walk over the same used blocks at the start every time
+	fs_block_id id = pnfs_findFreeBlock(sn, sn->runtimeStorage.nextFreeBlock);
+	if (!id && sn->runtimeStorage.nextFreeBlock)
+		id = pnfs_findFreeBlock(sn, 0);
+	if (id)
+		sn->runtimeStorage.nextFreeBlock = id;
+	return id;
 }
 
 static void pnfs_supernode_setBlockUsed(struct fs_supernode * sn_, fs_block_id id) {
 	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
-	sn->freeBlocksBitmap[id/8] |= 1 << (id % 8);
-	struct fs_block block;
-	memset(&block, 0, sizeof(struct fs_block));
-	memcpy(&block, ((void *)sn) + sizeof(void *), sizeof(struct pnfs_supernode) - sizeof(void *) - sizeof(sn->runtimeStorage));
-	fs_blockdevice_write(sn->runtimeStorage.bd, PNFS_BLOCK_HEADER, &block);
+	if (id >= sn->blockCount || (sn->runtimeStorage.freeBlocksBitmap[id/8] & (1 << (id % 8))))
+		return;
+	sn->runtimeStorage.freeBlocksBitmap[id/8] |= 1 << (id % 8);
+	pnfs_updateFullWord(sn, id);
+	pnfs_writeBitmapBlock(sn, id);
+	pnfs_changeGroup(sn, id / PNFS_BLOCKS_PER_GROUP, -1, 0, 0);
 }
 
 static void pnfs_supernode_setBlockFree(struct fs_supernode * sn_, fs_block_id id) {
 	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
-	sn->freeBlocksBitmap[id/8] &= ~(1 << (id % 8));
+	if (id >= sn->blockCount || !(sn->runtimeStorage.freeBlocksBitmap[id/8] & (1 << (id % 8))))
+		return;
+	sn->runtimeStorage.freeBlocksBitmap[id/8] &= ~(1 << (id % 8));
+	pnfs_updateFullWord(sn, id);
+	pnfs_writeBitmapBlock(sn, id);
+	pnfs_changeGroup(sn, id / PNFS_BLOCKS_PER_GROUP, 1, 0, 0);
+}
 
-	struct fs_block block;
-	memset(&block, 0, sizeof(struct fs_block));
-	memcpy(&block, ((void *)sn) + sizeof(void *), sizeof(struct pnfs_supernode) - sizeof(void *) - sizeof(sn->runtimeStorage));
-	fs_blockdevice_write(sn->runtimeStorage.bd, PNFS_BLOCK_HEADER, &block);
+static void pnfs_supernode_begin(struct fs_supernode * sn_) {
+	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
+	sn->runtimeStorage.transactions++;
 }
 
-static uint16_t pnfs_node_readData(struct fs_node * node_, void * buffer, uint16_t offset, uint16_t size) {
-	uint16_t read = 0;
-	struct pnfs_node * node = (struct pnfs_node *)node_;
-	if (offset > node->base.size)
-		return 0;
+static void pnfs_supernode_commit(struct fs_supernode * sn_) {
+	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
+	if (!sn->runtimeStorage.transactions)
+		return;
+	// Synced while the transaction is still open, so the blocks for the delayed writes are batched too
+	if (sn->runtimeStorage.transactions == 1)
+		pnfs_supernode_sync(sn_);
+	sn->runtimeStorage.transactions--;
+}
 
-	struct fs_blockdevice * bd = node->runtimeStorage.sn->runtimeStorage.bd;
+static void pnfs_supernode_sync(struct fs_supernode * sn_) {
+	struct pnfs_supernode * sn = (struct pnfs_supernode *)sn_;
+	for (uint32_t i = 0; sn->runtimeStorage.delayedWrites && i < PNFS_DELAYED_WRITES; i++)
+		if (sn->runtimeStorage.delayedWrites[i].id != NODE_INVALID)
+			pnfs_flushDelayedWrite(sn, &sn->runtimeStorage.delayedWrites[i]);
 
-	for (uint16_t i = 0; i < PNFS_NODE_BLOCKCOUNT && size; i++) {
-		fs_block_id bid = node->dataBlocks[i];
-		if (!bid)
-			return read;
+	pnfs_flushNodes(sn);
+	if (sn->runtimeStorage.dirtyMeta)
+		pnfs_flushMeta(sn);
+}
 
-		if (offset >= sizeof(struct fs_block)) {
-			offset -= sizeof(struct fs_block);
-			continue;
+static void pnfs_setBlockRun(struct pnfs_supernode * sn, fs_block_id first, uint32_t count, bool used) {
+	if (first >= sn->blockCount || !count)
+		return;
+	if (count > sn->blockCount - first)
+		count = sn->blockCount - first;
+
+	fs_block_id end = first + count;
+	int32_t changed = 0;
+	for (fs_block_id id = first; id < end; id++) {
+		if (!(sn->runtimeStorage.freeBlocksBitmap[id/8] & (1 << (id % 8))) == used)
+			changed++;
+		if (used)
+			sn->runtimeStorage.freeBlocksBitmap[id/8] |= 1 << (id % 8);
+		else
+			sn->runtimeStorage.freeBlocksBitmap[id/8] &= ~(1 << (id % 8));
+		if (id % 64 == 63 || id == end - 1)
+			pnfs_updateFullWord(sn, id);
+
+		// Every group the run touches has its bitmap block and counts written once
+		if (id % PNFS_BLOCKS_PER_GROUP == PNFS_BLOCKS_PER_GROUP - 1 || id == end - 1) {
+			pnfs_writeBitmapBlock(sn, id);
+			pnfs_changeGroup(sn, id / PNFS_BLOCKS_PER_GROUP, used ? -changed : changed, 0, 0);
+			changed = 0;
 		}
+	}
+}
 
-		struct fs_block block;
-		fs_blockdevice_read(bd, bid, &block);
-
-		uint16_t readAmount = min((uint16_t)(sizeof(struct fs_block) - offset), size);
+/**
+ * How many free blocks there are in a row from \a from, at most \a max.
+ */
+static uint32_t pnfs_freeRunLength(struct pnfs_supernode * sn, fs_block_id from, uint32_t max) {
+	uint32_t length = 0;
+	while (length < max && from + length < sn->blockCount) {
+		fs_block_id id = from + length;
+		uint64_t used = pnfs_bitmapWord(sn, id / 64) >> (id % 64);
+		if (used & 1)
+			break;
+		length += used ? (uint32_t)__builtin_ctzll(used) : 64 - id % 64;
+	}
+	return min(length, max);
+}
 
-		memcpy(buffer + read, ((void*)&block) + offset, readAmount);
+static uint32_t pnfs_allocateRun(struct pnfs_supernode * sn, fs_block_id goal, uint32_t want, fs_block_id * start) {
+	fs_block_id best = 0;
+	uint32_t bestLength = 0;
+	if (goal && goal < sn->blockCount)
+		bestLength = pnfs_freeRunLength(sn, best = goal, want);
+
+	// Else the first run after the goal that is long enough, or the longest one that was seen
+	fs_block_id cursor = goal ? goal : sn->runtimeStorage.nextFreeBlock;
+	fs_block_id from = cursor;
+	bool wrapped = false;
+	bool extends = bestLength > 0;
+	while (!extends && bestLength < want) {
+		fs_block_id id = pnfs_findFreeBlock(sn, from);
+		if (!id || (wrapped && id >= cursor)) {
+			if (wrapped || !cursor)
+				break;
+			wrapped = true;
+			from = 0;
+			continue;
+		}
 
-		size -= readAmount;
-		read += readAmount;
-		offset = 0;
+		uint32_t length = pnfs_freeRunLength(sn, id, want);
+		if (length > bestLength) {
+			best = id;
+			bestLength = length;
+		}
+		from = id + length;
 	}
+	if (!bestLength)
+		return 0;
 
-	fs_block_id nextBlockID = node->next;
-
-	while (size && nextBlockID) {
-		struct pnfs_blockBlock blockBlock;
-		fs_blockdevice_read(bd, nextBlockID, (struct fs_block *)&blockBlock);
+	pnfs_setBlockRun(sn, best, bestLength, true);
+	sn->runtimeStorage.nextFreeBlock = best + bestLength;
+	*start = best;
+	return bestLength;
+}
 
-		for (uint16_t i = 0; i < PNFS_BLOCKBLOCK_BLOCKCOUNT && size; i++) {
-			fs_block_id bid = blockBlock.dataBlocks[i];
-			if (!bid)
-				return read;
+static uint64_t pnfs_node_readData(struct fs_node * node_, void * buffer, uint64_t offset, uint64_t size) {
+	struct pnfs_supernode * sn = ((struct pnfs_node *)node_)->runtimeStorage.sn;
+	uint64_t allocations = sn->runtimeStorage.allocations;
+	uint64_t read = pnfs_readData((struct pnfs_node *)node_, buffer, offset, size);
+	pnfs_countOp(sn, PNFS_OP_READDATA, allocations);
+	return read;
+}
 
-			if (offset >= sizeof(struct fs_block)) {
-				offset -= sizeof(struct fs_block);
-				continue;
-			}
+static uint64_t pnfs_readData(struct pnfs_node * node, void * buffer, uint64_t offset, uint64_t size) {
+	if (offset >= node->base.size || !size)
+		return 0;
+	if (size > node->base.size - offset)
+		size = node->base.size - offset;
 
-			struct fs_block block;
-			fs_blockdevice_read(bd, bid, &block);
+	// The data was read with the node
+	if (node->extentCount == PNFS_INLINE_DATA) {
+		memcpy(buffer, &node->inlineData[offset], size);
+		return size;
+	}
 
-			uint16_t readAmount = min((uint16_t)(sizeof(struct fs_block) - offset), size);
+	struct fs_blockdevice * bd = node->runtimeStorage.sn->runtimeStorage.bd;
 
-			memcpy(buffer + read, ((void*)&block)+offset, readAmount);
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t count = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+	struct fs_blockio * ios = pnfs_scratchAlloc(node->runtimeStorage.sn, count * sizeof(struct fs_blockio));
+	if (!ios)
+		return 0;
+	count = pnfs_getDataBlocks(node, first, count, ios); // Less if the end is in a delayed write
+
+	// Whole blocks are read straight into the buffer, only the partial first and last block need a copy
+	struct fs_block partial[2];
+	uint64_t end = offset + size;
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t blockStart = (uint64_t)(first + i) * BLOCK_SIZE;
+		if (blockStart < offset || blockStart + BLOCK_SIZE > end)
+			ios[i].block = &partial[i ? 1 : 0];
+		else
+			ios[i].block = (struct fs_block *)((uint8_t *)buffer + blockStart - offset);
+	}
+	fs_blockdevice_readList(bd, ios, count);
 
-			size -= readAmount;
-			read += readAmount;
-			offset = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t blockStart = (uint64_t)(first + i) * BLOCK_SIZE;
+		if (ios[i].block != &partial[i ? 1 : 0])
+			continue;
+		uint64_t from = blockStart < offset ? offset : blockStart;
+		uint64_t to = blockStart + BLOCK_SIZE > end ? end : blockStart + BLOCK_SIZE;
+		memcpy((uint8_t *)buffer + from - offset, ios[i].block->data + from - blockStart, to - from);
+	}
+	pnfs_scratchFree(node->runtimeStorage.sn, ios);
+
+	uint64_t read = count ? (uint64_t)(first + count) * BLOCK_SIZE - offset : 0;
+
+	// The data that does not have any blocks yet is newer than what is on the disk
+	struct pnfs_delayedWrite * delayed = pnfs_findDelayedWrite(node->runtimeStorage.sn, node->base.id);
+	if (delayed) {
+		uint64_t from = delayed->offset > offset ? delayed->offset : offset;
+		uint64_t to = delayed->offset + delayed->size < end ? delayed->offset + delayed->size : end;
+		if (from < to) {
+			memcpy((uint8_t *)buffer + from - offset, delayed->data + from - delayed->offset, to - from);
+			if (to - offset > read)
+				read = to - offset;
 		}
+	}
+	return read < size ? read : size;
+}
 
-		nextBlockID = blockBlock.next;
+static uint64_t pnfs_node_writeData(struct fs_node * node_, const void * buffer, uint64_t offset, uint64_t size) {
+	struct pnfs_node * node = (struct pnfs_node *)node_;
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	if (offset >= PNFS_MAX_FILE_SIZE)
+		return 0;
+	if (size > PNFS_MAX_FILE_SIZE - offset)
+		size = PNFS_MAX_FILE_SIZE - offset;
+
+	uint64_t allocations = sn->runtimeStorage.allocations;
+	// Small files are kept in the node, and in a transaction appends get their blocks on commit
+	uint64_t wrote;
+	if (pnfs_writeInline(node, buffer, offset, size))
+		wrote = size;
+	else if (node->extentCount == PNFS_INLINE_DATA && !pnfs_moveInlineData(node))
+		wrote = 0;
+	else if (sn->runtimeStorage.transactions && pnfs_delayWrite(node, buffer, offset, size))
+		wrote = size;
+	else
+		wrote = pnfs_writeBlocks(node, buffer, offset, size);
+	pnfs_countOp(sn, PNFS_OP_WRITEDATA, allocations);
+	return wrote;
+}
+
+static bool pnfs_writeInline(struct pnfs_node * node, const void * buffer, uint64_t offset, uint64_t size) {
+	if (node->base.type != NODETYPE_FILE || offset + size > PNFS_INLINE_SIZE)
+		return false;
+
+	// Only a file without blocks or delayed data can start to keep its data in the node
+	if (node->extentCount != PNFS_INLINE_DATA) {
+		if (node->base.blockCount || pnfs_findDelayedWrite(node->runtimeStorage.sn, node->base.id))
+			return false;
+		memset(node->inlineData, 0, PNFS_INLINE_SIZE);
+		node->extentCount = PNFS_INLINE_DATA;
 	}
 
-	return read;
+	// The bytes between the size and the offset are already zeros
+	memcpy(&node->inlineData[offset], buffer, size);
+	if (node->base.size < offset + size)
+		node->base.size = offset + size;
+	fs_supernode_saveNode((struct fs_supernode *)node->runtimeStorage.sn, (struct fs_node *)node);
+	return true;
 }
 
-static uint16_t pnfs_node_writeData(struct fs_node * node_, const void * buffer, uint16_t offset, uint16_t size) {
-	uint16_t wrote = 0;
-	struct pnfs_node * node = (struct pnfs_node *)node_;
+static bool pnfs_moveInlineData(struct pnfs_node * node) {
+	uint8_t data[PNFS_INLINE_SIZE];
+	uint64_t size = node->base.size;
+	memcpy(data, node->inlineData, PNFS_INLINE_SIZE);
+	memset(node->extents, 0, sizeof(node->extents));
+	node->extentCount = 0;
+	node->base.size = 0;
+	if (pnfs_writeBlocks(node, data, 0, size) == size)
+		return true;
 
-	uint16_t neededBlocks = (offset+size + sizeof(struct fs_block) - 1) / sizeof(struct fs_block);
-	while (node->base.blockCount < neededBlocks)
-		pnfs_addBlock(node);
+	// No block could be got, so the data stays in the node
+	memcpy(node->inlineData, data, PNFS_INLINE_SIZE);
+	node->extentCount = PNFS_INLINE_DATA;
+	node->base.size = size;
+	fs_supernode_saveNode((struct fs_supernode *)node->runtimeStorage.sn, (struct fs_node *)node);
+	return false;
+}
+
+static uint64_t pnfs_writeBlocks(struct pnfs_node * node, const void * buffer, uint64_t offset, uint64_t size) {
+	uint64_t wrote = 0;
+
+	uint32_t neededBlocks = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	// The blocks from here on hold no data yet, they were just allocated or are after the end of the file
+	uint32_t freshBlocks = (node->base.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (node->base.blockCount < freshBlocks)
+		freshBlocks = node->base.blockCount;
+	fs_supernode_begin((struct fs_supernode *)node->runtimeStorage.sn);
+	if (node->base.blockCount < neededBlocks) {
+		uint32_t missing = neededBlocks - node->base.blockCount;
+		if (pnfs_addBlocks(node, missing) < missing)
+			printf("[-] Out of free blocks\n");
+	}
+
+	uint64_t available = (uint64_t)node->base.blockCount * BLOCK_SIZE;
+	if (offset >= available)
+		goto ret;
+	if (offset + size > available)
+		size = available - offset;
 
 	if (node->base.size < offset + size)
 		node->base.size = offset + size;
 
 	struct fs_blockdevice * bd = node->runtimeStorage.sn->runtimeStorage.bd;
 
-	for (uint16_t i = 0; i < PNFS_NODE_BLOCKCOUNT && size; i++) {
-		fs_block_id bid = node->dataBlocks[i];
-		if (!bid) {
-			printf("[-] Need more blocks for file\n");
-			goto ret;
-		}
+	// The empty blocks between the old end and the offset are included, so they are zeroed
+	uint32_t first = offset / BLOCK_SIZE;
+	if (freshBlocks < first)
+		first = freshBlocks;
+	uint32_t count = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+	struct fs_blockio * ios = pnfs_scratchAlloc(node->runtimeStorage.sn, count * sizeof(struct fs_blockio));
+	if (!ios)
+		goto ret;
+	if (pnfs_getDataBlocks(node, first, count, ios) != count) {
+		printf("[-] Need more blocks for file\n");
+		pnfs_scratchFree(node->runtimeStorage.sn, ios);
+		goto ret;
+	}
 
-		if (offset >= sizeof(struct fs_block)) {
-			offset -= sizeof(struct fs_block);
+	// Empty blocks are written whole, with zeros around the data, so they are never read.
+	// The partial first and last old block are updated in place, the rest is written as one list
+	struct fs_block zero;
+	struct fs_block fresh[2];
+	memset(&zero, 0, sizeof(struct fs_block));
+	uint64_t end = offset + size;
+	uint32_t whole = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t blockStart = (uint64_t)(first + i) * BLOCK_SIZE;
+		if (blockStart + BLOCK_SIZE <= offset) {
+			ios[whole].id = ios[i].id;
+			ios[whole++].block = &zero;
+			continue;
+		}
+		if (blockStart >= offset && blockStart + BLOCK_SIZE <= end) {
+			ios[whole].id = ios[i].id;
+			ios[whole++].block = (struct fs_block *)((const uint8_t *)buffer + blockStart - offset);
 			continue;
 		}
 
-		struct fs_block block;
-		fs_blockdevice_read(bd, bid, &block);
-
-		uint16_t writeAmount = min((uint16_t)(sizeof(struct fs_block) - offset), size);
-
-		memcpy(((void*)&block) + offset, buffer + wrote, writeAmount);
-
-		fs_blockdevice_write(bd, bid, &block);
+		uint64_t from = blockStart < offset ? offset : blockStart;
+		uint64_t to = blockStart + BLOCK_SIZE > end ? end : blockStart + BLOCK_SIZE;
+		if (first + i >= freshBlocks) {
+			struct fs_block * block = &fresh[blockStart < offset ? 0 : 1];
+			memset(block, 0, sizeof(struct fs_block));
+			memcpy(block->data + from - blockStart, (const uint8_t *)buffer + from - offset, to - from);
+			ios[whole].id = ios[i].id;
+			ios[whole++].block = block;
+			continue;
+		}
 
-		size -= writeAmount;
-		wrote += writeAmount;
-		offset = 0;
+		struct fs_block scratch;
+		struct fs_block * block = fs_blockdevice_get(bd, ios[i].id, &scratch);
+		memcpy(block->data + from - blockStart, (const uint8_t *)buffer + from - offset, to - from);
+		fs_blockdevice_put(bd, ios[i].id, block, true);
 	}
+	fs_blockdevice_writeList(bd, ios, whole);
+	pnfs_scratchFree(node->runtimeStorage.sn, ios);
 
-	fs_block_id nextBlockID = node->next;
+	wrote = size;
 
-	while (size && nextBlockID) {
-		struct pnfs_blockBlock blockBlock;
-		fs_blockdevice_read(bd, nextBlockID, (struct fs_block *)&blockBlock);
+ret:
+	fs_supernode_saveNode((struct fs_supernode *)node->runtimeStorage.sn, (struct fs_node *)node);
+	fs_supernode_commit((struct fs_supernode *)node->runtimeStorage.sn);
 
-		for (uint16_t i = 0; i < PNFS_BLOCKBLOCK_BLOCKCOUNT && size; i++) {
-			fs_block_id bid = blockBlock.dataBlocks[i];
-			if (!bid) {
-				printf("[-] Need more blocks for filesdasd\n");
-				goto ret;
-			}
+	return wrote;
+}
 
-			if (offset >= sizeof(struct fs_block)) {
-				offset -= sizeof(struct fs_block);
-				continue;
-			}
+static bool pnfs_node_allocate(struct fs_node * node_, uint64_t offset, uint64_t size) {
+	struct pnfs_node * node = (struct pnfs_node *)node_;
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	if (node->base.type != NODETYPE_FILE || offset > PNFS_MAX_FILE_SIZE || size > PNFS_MAX_FILE_SIZE - offset)
+		return false;
 
-			struct fs_block block;
-			fs_blockdevice_read(bd, bid, &block);
+	uint32_t neededBlocks = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (neededBlocks <= node->base.blockCount || (node->extentCount == PNFS_INLINE_DATA && offset + size <= PNFS_INLINE_SIZE))
+		return true;
+
+	// The delayed data comes before the new blocks, so it gets its blocks first
+	struct pnfs_delayedWrite * delayed = pnfs_findDelayedWrite(sn, node->base.id);
+	fs_supernode_begin((struct fs_supernode *)sn);
+	if (delayed)
+		pnfs_flushDelayedWrite(sn, delayed);
+
+	bool ok = node->extentCount != PNFS_INLINE_DATA || pnfs_moveInlineData(node);
+	if (ok && neededBlocks > node->base.blockCount) {
+		uint32_t missing = neededBlocks - node->base.blockCount;
+		ok = pnfs_addBlocks(node, missing) == missing;
+		fs_supernode_saveNode((struct fs_supernode *)sn, node_);
+	}
+	fs_supernode_commit((struct fs_supernode *)sn);
+	if (!ok)
+		printf("[-] Out of free blocks\n");
+	return ok;
+}
 
-			uint16_t writeAmount = min((uint16_t)(sizeof(struct fs_block) - offset), size);
+static bool pnfs_node_truncate(struct fs_node * node_, uint64_t size) {
+	struct pnfs_node * node = (struct pnfs_node *)node_;
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	if (node->base.type != NODETYPE_FILE || size > PNFS_MAX_FILE_SIZE)
+		return false;
 
-			memcpy(((void*)&block) + offset, buffer + wrote, writeAmount);
+	struct pnfs_delayedWrite * delayed = pnfs_findDelayedWrite(sn, node->base.id);
+	fs_supernode_begin((struct fs_supernode *)sn);
+	if (delayed)
+		pnfs_flushDelayedWrite(sn, delayed);
+
+	bool ok = true;
+	if (size <= PNFS_INLINE_SIZE && (node->extentCount == PNFS_INLINE_DATA || !node->base.blockCount)) {
+		// A small file keeps its data in the node, with zeros after the size
+		if (node->extentCount != PNFS_INLINE_DATA) {
+			memset(node->inlineData, 0, PNFS_INLINE_SIZE);
+			node->extentCount = PNFS_INLINE_DATA;
+		} else if (size < node->base.size)
+			memset(&node->inlineData[size], 0, node->base.size - size);
+		node->base.size = size;
+		fs_supernode_saveNode((struct fs_supernode *)sn, node_);
+	} else if (size > node->base.size) {
+		// The new part reads as zeros. Only the rest of the old last block needs to be written,
+		// the blocks after it are zeroed by the write of the last byte. A file that outgrows the node moves its data first
+		static const uint8_t zeros[BLOCK_SIZE];
+		ok = node->extentCount != PNFS_INLINE_DATA || pnfs_moveInlineData(node);
+		uint64_t oldSize = node->base.size;
+		uint64_t tail = oldSize % BLOCK_SIZE ? min(BLOCK_SIZE - oldSize % BLOCK_SIZE, size - oldSize) : 0;
+		if (ok && tail)
+			ok = pnfs_writeBlocks(node, zeros, oldSize, tail) == tail;
+		if (ok && size > oldSize + tail)
+			ok = pnfs_writeBlocks(node, zeros, size - 1, 1) == 1;
+	} else {
+		node->base.size = size;
+		pnfs_removeBlocks(node);
+		fs_supernode_saveNode((struct fs_supernode *)sn, node_);
+	}
+	fs_supernode_commit((struct fs_supernode *)sn);
+	return ok;
+}
 
-			fs_blockdevice_write(bd, bid, &block);
+static struct pnfs_delayedWrite * pnfs_findDelayedWrite(struct pnfs_supernode * sn, fs_node_id id) {
+	for (uint32_t i = 0; i < PNFS_DELAYED_WRITES; i++)
+		if (sn->runtimeStorage.delayedWrites[i].id == id)
+			return &sn->runtimeStorage.delayedWrites[i];
+	return NULL;
+}
 
-			size -= writeAmount;
-			wrote += writeAmount;
-			offset = 0;
+static bool pnfs_delayWrite(struct pnfs_node * node, const void * buffer, uint64_t offset, uint64_t size) {
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	struct pnfs_delayedWrite * delayed = pnfs_findDelayedWrite(sn, node->base.id);
+	uint64_t end = offset + size;
+	if (delayed) {
+		// Not a append, or too much to keep in memory, it is written in order
+		if (offset < delayed->offset || end - delayed->offset > PNFS_DELAYED_WRITE_SIZE || offset > delayed->offset + delayed->size) {
+			pnfs_flushDelayedWrite(sn, delayed);
+			return false;
 		}
+	} else {
+		// Only writes that need new blocks and do not leave a hole are delayed
+		if (node->base.type != NODETYPE_FILE || !size || end <= (uint64_t)node->base.blockCount * BLOCK_SIZE || offset > node->base.size || size > PNFS_DELAYED_WRITE_SIZE)
+			return false;
+
+		delayed = &sn->runtimeStorage.delayedWrites[sn->runtimeStorage.nextDelayedWrite++ % PNFS_DELAYED_WRITES];
+		if (delayed->id != NODE_INVALID)
+			pnfs_flushDelayedWrite(sn, delayed);
+		delayed->id = node->base.id;
+		delayed->offset = offset;
+		delayed->size = 0;
+	}
 
-		nextBlockID = blockBlock.next;
+	if (end - delayed->offset > delayed->capacity) {
+		uint32_t capacity = delayed->capacity ? delayed->capacity : BLOCK_SIZE;
+		while (capacity < end - delayed->offset)
+			capacity *= 2;
+		sn->runtimeStorage.allocations++;
+		uint8_t * data = realloc(delayed->data, capacity);
+		if (!data) {
+			pnfs_flushDelayedWrite(sn, delayed);
+			return false;
+		}
+		delayed->data = data;
+		delayed->capacity = capacity;
 	}
 
-ret:
-	fs_supernode_saveNode((struct fs_supernode *)node->runtimeStorage.sn, node_);
+	memcpy(&delayed->data[offset - delayed->offset], buffer, size);
+	if (end - delayed->offset > delayed->size)
+		delayed->size = end - delayed->offset;
+	if (node->base.size < end) {
+		node->base.size = end;
+		fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
+	}
+	return true;
+}
 
-	return wrote;
+static void pnfs_flushDelayedWrite(struct pnfs_supernode * sn, struct pnfs_delayedWrite * delayed) {
+	struct pnfs_node * node = (struct pnfs_node *)fs_supernode_getNode((struct fs_supernode *)sn, delayed->id);
+	if (node->base.type == NODETYPE_FILE && pnfs_writeBlocks(node, delayed->data, delayed->offset, delayed->size) < delayed->size) {
+		// The size was raised when the data was delayed, it can only cover the blocks it got
+		uint64_t available = (uint64_t)node->base.blockCount * BLOCK_SIZE;
+		if (node->base.size > available) {
+			node->base.size = available;
+			fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
+		}
+	}
+	fs_supernode_putNode((struct fs_supernode *)sn, (struct fs_node *)node);
+	pnfs_dropDelayedWrite(delayed);
 }
 
+static void pnfs_dropDelayedWrite(struct pnfs_delayedWrite * delayed) {
+	free(delayed->data);
+	memset(delayed, 0, sizeof(struct pnfs_delayedWrite));
+}
 
-static struct fs_direntry * pnfs_node_directoryEntries(struct fs_node * node_, uint16_t * amount) {
-	struct pnfs_node * node = (struct pnfs_node *)node_;
+static struct fs_direntry * pnfs_node_directoryEntries(struct fs_node * node_, uint32_t * amount) {
+	struct pnfs_supernode * sn = ((struct pnfs_node *)node_)->runtimeStorage.sn;
+	uint64_t allocations = sn->runtimeStorage.allocations;
+	// The caller frees the entries, so they are moved out of the scratch memory
+	struct fs_direntry * dir = pnfs_readDirectory((struct pnfs_node *)node_, amount);
+	struct fs_direntry * copy = dir ? pnfs_heapAlloc(sn, *amount ? *amount * sizeof(struct fs_direntry) : sizeof(struct fs_direntry)) : NULL;
+	if (copy)
+		memcpy(copy, dir, *amount * sizeof(struct fs_direntry));
+	else
+		*amount = 0;
+	pnfs_scratchFree(sn, dir);
+	pnfs_countOp(sn, PNFS_OP_DIRECTORYENTRIES, allocations);
+	return copy;
+}
+
+static struct fs_direntry * pnfs_readDirectory(struct pnfs_node * node, uint32_t * amount) {
 	if (node->base.type != NODETYPE_DIRECTORY)
 		goto error;
 
-	struct fs_blockdevice * bd = node->runtimeStorage.sn->runtimeStorage.bd;
-
-	int count = node->base.size / sizeof(struct fs_direntry);
-	*amount = count;
-	int added = 0;
-
-	struct fs_direntry * dir = malloc(node->base.size);
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	struct fs_blockdevice * bd = sn->runtimeStorage.bd;
 
-	const uint16_t blocksInNode = PNFS_NODE_BLOCKCOUNT;
+	const uint32_t perBlock = sizeof(struct fs_block) / sizeof(struct fs_direntry);
+	uint32_t count = node->base.size / sizeof(struct fs_direntry);
+	uint32_t blocks = (count + perBlock - 1) / perBlock;
 
-	for (int i = 0; i < min(node->base.blockCount, blocksInNode); i++) {
-		struct fs_direntry entries[8];
-		fs_blockdevice_read(bd, node->dataBlocks[i], (struct fs_block *)&entries);
-		for (int j = 0; j < 8 && added < count; j++)
-			memcpy(&dir[added++], &entries[j], sizeof(struct fs_direntry));
+	// Rounded up to whole blocks, so all the blocks can be read straight into it
+	struct fs_direntry * dir = pnfs_scratchAlloc(sn, blocks * sizeof(struct fs_block));
+	struct fs_blockio * ios = dir ? pnfs_scratchAlloc(sn, blocks * sizeof(struct fs_blockio)) : NULL;
+	if (!ios) {
+		pnfs_scratchFree(sn, dir);
+		goto error;
 	}
 
-	if (added < count) {
-		struct pnfs_blockBlock block;
-		const int blocksInBlockBlock = sizeof(block.dataBlocks) / sizeof(fs_block_id);
+	blocks = pnfs_getDataBlocks(node, 0, blocks, ios);
+	for (uint32_t i = 0; i < blocks; i++)
+		ios[i].block = (struct fs_block *)&dir[i * perBlock];
+	fs_blockdevice_readList(bd, ios, blocks);
+	pnfs_scratchFree(sn, ios);
 
-		fs_blockdevice_read(bd, node->next, (struct fs_block *)&block);
-
-		int blocksLeft = node->base.blockCount - blocksInNode;
-		while (added < count) {
-			for (int i = 0; i < min(blocksLeft, blocksInBlockBlock); i++) {
-				struct fs_direntry entries[8];
-				fs_blockdevice_read(bd, block.dataBlocks[i], (struct fs_block *)&entries);
-				for (int j = 0; j < 8 && added < count; j++)
-					memcpy(&dir[added], &entries[j], sizeof(struct fs_direntry));
-			}
-			blocksLeft -= blocksInBlockBlock;
-			if (blocksLeft > 0)
-				fs_blockdevice_read(bd, block.next, (struct fs_block *)&block);
-		}
-	}
+	*amount = min(count, blocks * perBlock);
 	return dir;
 
 error:
-	amount = 0;
+	*amount = 0;
 	return NULL;
 }
 
 static void pnfs_insertDirEntry(struct pnfs_node * node, struct fs_direntry * entry) {
 	struct pnfs_supernode * sn = node->runtimeStorage.sn;
 	struct fs_blockdevice * bd = sn->runtimeStorage.bd;
-	uint16_t dirPos = node->base.size / sizeof(struct fs_direntry); // What index it has in dirEntries
-	uint16_t inBlockIdx = dirPos / 8; // What block it is in
-
-	struct fs_direntry entries[8]; // fs_block
-	fs_block_id blockID; // the blockid for the block to write to
-
-	if (inBlockIdx < PNFS_NODE_BLOCKCOUNT) { // Is inBlockId in the node?
-		if (inBlockIdx < node->base.blockCount) { // Block is already allocated
-			blockID = node->dataBlocks[inBlockIdx];
-		}	else { // Allocate needed
-			blockID = node->dataBlocks[inBlockIdx] = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-			fs_supernode_setBlockUsed((struct fs_supernode *)sn, blockID);
-			node->base.blockCount++;
-			fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
-
-			struct fs_block block;
-			memset(&block, 0, sizeof(struct fs_block));
-			fs_blockdevice_write(bd, blockID, &block);
-		}
-	} else {
-		struct pnfs_blockBlock blockBlock;
-		// Need to add another block?
-		if (!node->next) { // We need to allocate .next --> .next.block[0] is the entry that is neede
-			fs_block_id blockBlockIdx = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-			fs_supernode_setBlockUsed((struct fs_supernode *)sn, blockBlockIdx);
-			node->next = blockBlockIdx;
-			node->base.blockCount++;
-			fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
-
-			memset(&blockBlock, 0, sizeof(struct pnfs_blockBlock));
-			blockID = blockBlock.dataBlocks[0] = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-			fs_supernode_setBlockUsed((struct fs_supernode *)sn, blockID);
-			fs_blockdevice_write(bd, blockBlockIdx, (struct fs_block *)&blockBlock);
-		} else {
-			fs_blockdevice_read(bd, node->next, (struct fs_block *)&blockBlock);
-
-			uint16_t walker = inBlockIdx - (PNFS_NODE_BLOCKCOUNT);
-			uint16_t walkNextCount = walker / (PNFS_BLOCKBLOCK_BLOCKCOUNT);
-
-			fs_block_id blockBlockIdx = node->next;
-			for (uint16_t i = 0; i < walkNextCount; i++) {
-				if (!blockBlock.next) { // Need to add block, should be last
-					struct pnfs_blockBlock tmp;
-					memset(&tmp, 0, sizeof(struct pnfs_blockBlock));
-					fs_block_id newBlock = blockBlock.next = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-					fs_supernode_setBlockUsed((struct fs_supernode *)sn, newBlock);
-					fs_blockdevice_write(bd, blockBlockIdx, (struct fs_block *)&blockBlock);
-					blockBlockIdx = newBlock;
-					break;
-				}
-
-				blockBlockIdx = blockBlock.next;
-				fs_blockdevice_read(bd, blockBlockIdx, (struct fs_block *)&blockBlock);
-			}
+	const uint32_t perBlock = sizeof(struct fs_block) / sizeof(struct fs_direntry);
+	uint32_t dirPos = node->base.size / sizeof(struct fs_direntry); // What index it has in dirEntries
+	uint32_t inBlockIdx = dirPos / perBlock; // What block it is in
 
-			uint16_t idx = walker % (PNFS_BLOCKBLOCK_BLOCKCOUNT);
-			if (inBlockIdx < node->base.blockCount)
-				blockID = blockBlock.dataBlocks[idx];
-			else { // Allocate needed
-				blockID = blockBlock.dataBlocks[idx] = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-				fs_supernode_setBlockUsed((struct fs_supernode *)sn, blockID);
-				node->base.blockCount++;
-				fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
-
-				struct fs_block block;
-				memset(&block, 0, sizeof(struct fs_block));
-				fs_blockdevice_write(bd, blockID, &block);
-			}
-		}
+	bool newBlock = inBlockIdx >= node->base.blockCount;
+	if (newBlock && !pnfs_addBlocks(node, 1)) { // Allocate needed
+		printf("[-] Out of free blocks\n");
+		return;
 	}
 
-	fs_blockdevice_read(bd, blockID, (struct fs_block *)&entries);
-	memcpy(&entries[dirPos%8], entry, sizeof(struct fs_direntry));
-	fs_blockdevice_write(bd, blockID, (struct fs_block *)&entries);
+	struct fs_blockio io;
+	if (!pnfs_getDataBlocks(node, inBlockIdx, 1, &io))
+		return;
+
+	struct fs_block scratch;
+	struct fs_direntry * entries = (struct fs_direntry *)fs_blockdevice_get(bd, io.id, &scratch);
+	if (newBlock)
+		memset(entries, 0, sizeof(struct fs_block));
+	memcpy(&entries[dirPos % perBlock], entry, sizeof(struct fs_direntry));
+	fs_blockdevice_put(bd, io.id, (struct fs_block *)entries, true);
 	node->base.size += sizeof(struct fs_direntry);
 	fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
 }
 
 static void pnfs_removeDirEntry(struct pnfs_node * node, fs_node_id id) {
-	struct fs_blockdevice * bd = node->runtimeStorage.sn->runtimeStorage.bd;
-
-	fs_block_id curBlock = 0;
-	struct fs_direntry curBlockData[8];
-
-	fs_block_id oldBlock = 0;
-	struct fs_direntry oldBlockData[8];
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	struct fs_blockdevice * bd = sn->runtimeStorage.bd;
+	const uint32_t perBlock = sizeof(struct fs_block) / sizeof(struct fs_direntry);
 
-	if (node->base.type != NODETYPE_DIRECTORY)
+	uint32_t amount;
+	struct fs_direntry * dir = pnfs_readDirectory(node, &amount);
+	if (!dir)
 		return;
 
-	for (int i = 0; i < PNFS_NODE_BLOCKCOUNT; i++) {
-		curBlock = node->dataBlocks[i];
-		if (!curBlock)
-			return;
-
-		fs_blockdevice_read(bd, curBlock, (struct fs_block *)&curBlockData);
-
-		if (oldBlock) {
-			memcpy(&oldBlockData[7], &curBlockData[0], sizeof(struct fs_direntry));
-			fs_blockdevice_write(bd, oldBlock, (struct fs_block *)&oldBlockData);
-
-			// Shift 1 step right
-			memmove(&curBlockData[0], &curBlockData[1], sizeof(struct fs_direntry) * 7);
-			fs_blockdevice_write(bd, curBlock, (struct fs_block *)&curBlockData);
-
-			// Setup for next move
-			oldBlock = curBlock;
-			memcpy(&oldBlockData, &curBlockData, sizeof(curBlockData));
-		} else
-			for (int j = 0; j < 8; j++) {
-				if (curBlockData[j].id == id) {
-					if (j < 7) {
-						memmove(&curBlockData[j], &curBlockData[j+1], sizeof(struct fs_direntry) * (7 - j));
-						fs_blockdevice_write(bd, curBlock, (struct fs_block *)&curBlockData);
-					}
-					oldBlock = curBlock;
-					memcpy(&oldBlockData, &curBlockData, sizeof(curBlockData));
-				}
-			}
+	uint32_t idx = 0;
+	while (idx < amount && dir[idx].id != id)
+		idx++;
+
+	if (idx < amount) {
+		// The entries after it are moved one step back, so only the blocks from the removed one and on changes
+		memmove(&dir[idx], &dir[idx + 1], (amount - idx - 1) * sizeof(struct fs_direntry));
+		memset(&dir[amount - 1], 0, sizeof(struct fs_direntry));
+
+		uint32_t first = idx / perBlock;
+		uint32_t count = (amount - 1) / perBlock - first + 1;
+		struct fs_blockio * ios = pnfs_scratchAlloc(sn, count * sizeof(struct fs_blockio));
+		if (ios) {
+			count = pnfs_getDataBlocks(node, first, count, ios);
+			for (uint32_t i = 0; i < count; i++)
+				ios[i].block = (struct fs_block *)&dir[(first + i) * perBlock];
+			fs_blockdevice_writeList(bd, ios, count);
+			pnfs_scratchFree(sn, ios);
+		}
 	}
+	pnfs_scratchFree(sn, dir);
+}
 
 
-	struct pnfs_blockBlock blockBlock;
-	blockBlock.next = node->next; // Hack ;)
-
-	while (blockBlock.next) {
-		fs_blockdevice_read(bd, blockBlock.next, (struct fs_block *)&blockBlock);
-		for (int i = 0; i < sizeof(blockBlock.dataBlocks)/sizeof(fs_block_id); i++) {
-			curBlock = blockBlock.dataBlocks[i];
-			if (!curBlock)
-				return;
-
-			fs_blockdevice_read(bd, curBlock, (struct fs_block *)&curBlockData);
-
-			if (oldBlock) {
-				memcpy(&oldBlockData[7], &curBlockData[0], sizeof(struct fs_direntry));
-				fs_blockdevice_write(bd, oldBlock, (struct fs_block *)&oldBlockData);
+static struct pnfs_extent * pnfs_readExtents(struct pnfs_node * node, uint32_t room) {
+	struct fs_blockdevice * bd = node->runtimeStorage.sn->runtimeStorage.bd;
+	uint32_t count = node->extentCount;
+	struct pnfs_extent * extents = pnfs_heapAlloc(node->runtimeStorage.sn, (count + room ? count + room : 1) * sizeof(struct pnfs_extent));
+	if (!extents)
+		return NULL;
 
-				// Shift 1 step right
-				memmove(&curBlockData[0], &curBlockData[1], sizeof(struct fs_direntry) * 7);
-				fs_blockdevice_write(bd, curBlock, (struct fs_block *)&curBlockData);
+	uint32_t found = min(count, (uint32_t)PNFS_NODE_EXTENTS);
+	memcpy(extents, node->extents, found * sizeof(struct pnfs_extent));
 
-				// Setup for next move
-				oldBlock = curBlock;
-				memcpy(&oldBlockData, &curBlockData, sizeof(curBlockData));
-			} else
-				for (int j = 0; j < 8; j++) {
-					if (curBlockData[j].id == id) {
-						if (j < 7) {
-							memmove(&curBlockData[j], &curBlockData[j+1], sizeof(struct fs_direntry) * (7 - j));
-							fs_blockdevice_write(bd, curBlock, (struct fs_block *)&curBlockData);
-						}
+	fs_block_id blockID = node->extentBlock;
+	while (found < count && blockID) {
+		struct fs_block scratch;
+		struct pnfs_extentBlock * block = (struct pnfs_extentBlock *)fs_blockdevice_get(bd, blockID, &scratch);
+		uint32_t amount = min(min(block->count, (uint32_t)PNFS_EXTENTBLOCK_EXTENTS), count - found);
+		memcpy(&extents[found], block->extents, amount * sizeof(struct pnfs_extent));
+		found += amount;
 
-						oldBlock = curBlock;
-						memcpy(&oldBlockData, &curBlockData, sizeof(curBlockData));
-					}
-				}
-		}
+		fs_block_id next = block->next;
+		fs_blockdevice_put(bd, blockID, (struct fs_block *)block, false);
+		blockID = next;
 	}
 
-	memset(&oldBlockData[7], 0, sizeof(struct fs_direntry));
-	fs_blockdevice_read(bd, oldBlock, (struct fs_block *)&oldBlockData);
-
-	node->base.size -= sizeof(struct fs_direntry);
-	fs_supernode_saveNode((struct fs_supernode *)node->runtimeStorage.sn, (struct fs_node *)node);
+	// A broken chain ends the file early
+	memset(&extents[found], 0, (count - found) * sizeof(struct pnfs_extent));
+	return extents;
 }
 
+static bool pnfs_writeExtents(struct pnfs_node * node, const struct pnfs_extent * extents, uint32_t count) {
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	struct fs_blockdevice * bd = sn->runtimeStorage.bd;
+	uint32_t inNode = min(count, (uint32_t)PNFS_NODE_EXTENTS);
+	uint32_t needed = (count - inNode + PNFS_EXTENTBLOCK_EXTENTS - 1) / PNFS_EXTENTBLOCK_EXTENTS;
+	uint32_t oldInNode = min(node->extentCount, (uint32_t)PNFS_NODE_EXTENTS);
+	uint32_t have = (node->extentCount - oldInNode + PNFS_EXTENTBLOCK_EXTENTS - 1) / PNFS_EXTENTBLOCK_EXTENTS;
 
-static void pnfs_addBlock(struct pnfs_node * node) {
-	struct fs_supernode * sn = (struct fs_supernode *)node->runtimeStorage.sn;
-	for (int i = 0; i < PNFS_NODE_BLOCKCOUNT; i++)
-		if (!node->dataBlocks[i]) {
-			fs_supernode_setBlockUsed(sn, node->dataBlocks[i] = fs_supernode_getFreeBlockID(sn));
-			node->base.blockCount++;
-			fs_supernode_saveNode(sn, (struct fs_node*)node);
-			return;
-		}
+	fs_block_id * chain = pnfs_scratchAlloc(sn, ((needed > have ? needed : have) + 1) * sizeof(fs_block_id));
+	if (!chain)
+		return false;
 
-	struct fs_blockdevice * bd = node->runtimeStorage.sn->runtimeStorage.bd;
-	struct pnfs_blockBlock blockBlock;
-	fs_block_id curID = node->next;
-	if (!curID) {
-		curID = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-		fs_supernode_setBlockUsed(sn, curID);
-		node->next = curID;
-		memset(&blockBlock, 0, sizeof(struct pnfs_blockBlock));
-		fs_blockdevice_write(bd, curID, (struct fs_block *)&blockBlock);
-		fs_supernode_saveNode(sn, (struct fs_node*)node);
-	}
-
-	fs_blockdevice_read(bd, curID, (struct fs_block *)&blockBlock);
-	while (true) {
-		for (int i = 0; i < PNFS_BLOCKBLOCK_BLOCKCOUNT; i++)
-			if (!blockBlock.dataBlocks[i]) {
-				fs_supernode_setBlockUsed(sn, blockBlock.dataBlocks[i] = fs_supernode_getFreeBlockID(sn));
-				fs_blockdevice_write(bd, curID, (struct fs_block *)&blockBlock);
-
-				node->base.blockCount++;
-				fs_supernode_saveNode(sn, (struct fs_node*)node);
-				return;
-			}
+	// The old chain of extent blocks is reused, only the missing blocks are allocated and the extra ones freed
+	uint32_t length = 0;
+	for (fs_block_id blockID = node->extentBlock; blockID && length < have;) {
+		chain[length++] = blockID;
+		struct fs_block scratch;
+		struct pnfs_extentBlock * block = (struct pnfs_extentBlock *)fs_blockdevice_get(bd, blockID, &scratch);
+		fs_block_id next = block->next;
+		fs_blockdevice_put(bd, blockID, (struct fs_block *)block, false);
+		blockID = next;
+	}
+	for (uint32_t i = length; i < needed; i++) {
+		chain[i] = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
+		if (!chain[i]) {
+			while (i-- > length)
+				fs_supernode_setBlockFree((struct fs_supernode *)sn, chain[i]);
+			pnfs_scratchFree(sn, chain);
+			return false;
+		}
+		fs_supernode_setBlockUsed((struct fs_supernode *)sn, chain[i]);
+	}
+	for (uint32_t i = needed; i < length; i++)
+		fs_supernode_setBlockFree((struct fs_supernode *)sn, chain[i]);
+
+	pnfs_dropExtentMap(sn, node->base.id);
+	memset(node->extents, 0, sizeof(node->extents));
+	if (inNode)
+		memcpy(node->extents, extents, inNode * sizeof(struct pnfs_extent));
+	node->extentCount = count;
+	node->extentBlock = needed ? chain[0] : 0;
+
+	uint32_t done = inNode;
+	for (uint32_t i = 0; i < needed; i++) {
+		struct pnfs_extentBlock block;
+		memset(&block, 0, sizeof(struct pnfs_extentBlock));
+		block.count = min(count - done, (uint32_t)PNFS_EXTENTBLOCK_EXTENTS);
+		block.next = i + 1 < needed ? chain[i + 1] : 0;
+		memcpy(block.extents, &extents[done], block.count * sizeof(struct pnfs_extent));
+		done += block.count;
+		fs_blockdevice_write(bd, chain[i], (struct fs_block *)&block);
+	}
+	pnfs_scratchFree(sn, chain);
+	return true;
+}
 
-		curID = blockBlock.next;
-		if (!curID)
-			break;
+static uint32_t pnfs_freeExtents(struct pnfs_supernode * sn, struct pnfs_extent * extents, uint32_t count, uint32_t from) {
+	uint32_t logical = 0; // The first block in the file the extent has
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t length = extents[i].length;
+		uint32_t keep = from > logical ? min(from - logical, length) : 0;
+		if (keep < length)
+			pnfs_setBlockRun(sn, extents[i].start + keep, length - keep, false);
+		extents[i].length = keep;
+		if (keep)
+			kept = i + 1;
+		logical += length;
+	}
+	return kept;
+}
 
-		fs_blockdevice_read(bd, curID, (struct fs_block *)&blockBlock);
+static struct pnfs_extentMap * pnfs_getExtentMap(struct pnfs_node * node) {
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	struct pnfs_extentMap * maps = sn->runtimeStorage.extentMaps;
+	for (uint32_t i = 0; i < PNFS_EXTENT_MAPS; i++)
+		if (maps[i].id == node->base.id && maps[i].count == node->extentCount)
+			return &maps[i];
+
+	struct pnfs_extent * extents = pnfs_readExtents(node, 0);
+	uint32_t * ends = pnfs_heapAlloc(sn, node->extentCount * sizeof(uint32_t));
+	if (!extents || !ends) {
+		free(extents);
+		free(ends);
+		return NULL;
 	}
 
-	fs_block_id newBlock = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-	fs_supernode_setBlockUsed(sn, newBlock);
-	blockBlock.next = newBlock;
-	fs_blockdevice_write(bd, curID, (struct fs_block *)&blockBlock);
+	uint32_t end = 0;
+	for (uint32_t i = 0; i < node->extentCount; i++)
+		ends[i] = end += extents[i].length;
+
+	// The maps are replaced in turn, a node with extent blocks is most likely used for a while
+	struct pnfs_extentMap * map = &maps[sn->runtimeStorage.nextExtentMap++ % PNFS_EXTENT_MAPS];
+	free(map->extents);
+	free(map->ends);
+	map->id = node->base.id;
+	map->count = node->extentCount;
+	map->extents = extents;
+	map->ends = ends;
+	return map;
+}
 
-	fs_block_id newEntry = fs_supernode_getFreeBlockID((struct fs_supernode *)sn);
-	fs_supernode_setBlockUsed(sn, newEntry);
+static void pnfs_dropExtentMap(struct pnfs_supernode * sn, fs_node_id id) {
+	struct pnfs_extentMap * maps = sn->runtimeStorage.extentMaps;
+	for (uint32_t i = 0; i < PNFS_EXTENT_MAPS; i++)
+		if (maps[i].id == id) {
+			free(maps[i].extents);
+			free(maps[i].ends);
+			memset(&maps[i], 0, sizeof(struct pnfs_extentMap));
+		}
+}
 
-	memset(&blockBlock, 0, sizeof(struct pnfs_blockBlock));
-	fs_blockdevice_write(bd, newEntry, (struct fs_block *)&blockBlock);
+static uint32_t pnfs_getDataBlocks(struct pnfs_node * node, uint32_t first, uint32_t count, struct fs_blockio * ios) {
+	struct pnfs_extent * extents;
+	uint32_t * ends;
+	uint32_t extentCount = node->extentCount;
+
+	// Most files fit in the extents in the node, so only the ones with extent blocks need a map
+	uint32_t nodeEnds[PNFS_NODE_EXTENTS];
+	if (extentCount <= PNFS_NODE_EXTENTS) {
+		uint32_t end = 0;
+		for (uint32_t i = 0; i < extentCount; i++)
+			nodeEnds[i] = end += node->extents[i].length;
+		extents = node->extents;
+		ends = nodeEnds;
+	} else {
+		struct pnfs_extentMap * map = pnfs_getExtentMap(node);
+		if (!map)
+			return 0;
+		extents = map->extents;
+		ends = map->ends;
+	}
 
-	blockBlock.dataBlocks[0] = newEntry;
-	fs_blockdevice_write(bd, newBlock, (struct fs_block *)&blockBlock);
+	// The first extent that ends after the first block
+	uint32_t low = 0;
+	uint32_t high = extentCount;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (ends[mid] <= first)
+			low = mid + 1;
+		else
+			high = mid;
+	}
 
-	node->base.blockCount++;
-	fs_supernode_saveNode(sn, (struct fs_node*)node);
+	uint32_t found = 0;
+	for (uint32_t i = low; i < extentCount && found < count; i++) {
+		uint32_t logical = ends[i] - extents[i].length; // The first block in the file the extent has
+		for (uint32_t b = first > logical ? first - logical : 0; b < extents[i].length && found < count; b++)
+			ios[found++].id = extents[i].start + b;
+	}
+	return found;
 }
 
-static void pnfs_removeBlockBlock(struct pnfs_supernode * sn, struct pnfs_blockBlock * blockBlock) {
-	struct fs_blockdevice * bd = sn->runtimeStorage.bd;
-	fs_block_id next = blockBlock->next;
+static uint32_t pnfs_addBlocks(struct pnfs_node * node, uint32_t count) {
+	struct pnfs_supernode * sn = node->runtimeStorage.sn;
+	// Every run could end up as its own extent
+	struct pnfs_extent * extents = pnfs_readExtents(node, count);
+	if (!extents)
+		return 0;
 
-	for (int i = 0; i < PNFS_BLOCKBLOCK_BLOCKCOUNT; i++)
-		if (blockBlock->dataBlocks[i])
-			fs_supernode_setBlockFree((struct fs_supernode *)sn, blockBlock->dataBlocks[i]);
+	uint32_t extentCount = node->extentCount;
+	uint32_t added = 0;
+	while (added < count) {
+		struct pnfs_extent * last = extentCount ? &extents[extentCount - 1] : NULL;
+		// Try to continue right after the last extent, so it only grows
+		fs_block_id goal = last ? last->start + last->length : pnfs_groupGoal(sn, node->base.id);
+		fs_block_id start;
+		uint32_t length = pnfs_allocateRun(sn, goal, count - added, &start);
+		if (!length)
+			break;
 
-	if (!next)
-		return;
+		if (last && start == goal)
+			last->length += length;
+		else
+			extents[extentCount++] = (struct pnfs_extent){ .start = start, .length = length };
+		added += length;
+	}
 
-	fs_blockdevice_read(bd, next, (struct fs_block *)blockBlock);
-	fs_supernode_setBlockFree((struct fs_supernode *)sn, next);
-	pnfs_removeBlockBlock(sn, blockBlock);
+	if (added && !pnfs_writeExtents(node, extents, extentCount)) { // No room for the extent blocks
+		pnfs_freeExtents(sn, extents, extentCount, node->base.blockCount);
+		added = 0;
+	}
+	node->base.blockCount += added;
+	free(extents);
+	return added;
 }
 
 #define divRoundUp(a, b) (((a) + (b) - 1) / (b))
 
 static void pnfs_removeBlocks(struct pnfs_node * node) {
 	struct pnfs_supernode * sn = node->runtimeStorage.sn;
-	struct fs_blockdevice * bd = sn->runtimeStorage.bd;
-	uint16_t blocksNeeded = divRoundUp(node->base.size, BLOCK_SIZE);
-	if (blocksNeeded < node->base.blockCount) {
-		if (blocksNeeded <= PNFS_NODE_BLOCKCOUNT) {
-			for (int i = blocksNeeded; i < PNFS_NODE_BLOCKCOUNT; i++)
-				if (node->dataBlocks[i])
-					fs_supernode_setBlockFree((struct fs_supernode *)sn, node->dataBlocks[i]);
-
-			if (node->next) {
-				struct pnfs_blockBlock blockBlock;
-				fs_blockdevice_read(bd, node->next, (struct fs_block *)&blockBlock);
-
-				pnfs_removeBlockBlock(sn, &blockBlock);
-				fs_supernode_setBlockFree((struct fs_supernode *)sn, node->next);
-
-				node->next = 0;
-			}
-		} else if (node->next) {
-			struct pnfs_blockBlock blockBlock;
-			fs_block_id prevID = 0;
-			fs_block_id curID = node->next;
-			fs_blockdevice_read(bd, curID, (struct fs_block *)&blockBlock);
-			blocksNeeded -= PNFS_NODE_BLOCKCOUNT;
-
-			while (blocksNeeded >= PNFS_BLOCKBLOCK_BLOCKCOUNT) {
-				prevID = curID;
-				curID = node->next;
-				fs_blockdevice_read(bd, curID, (struct fs_block *)&blockBlock);
-				blocksNeeded -= PNFS_BLOCKBLOCK_BLOCKCOUNT;
-			}
+	uint32_t blocksNeeded = divRoundUp(node->base.size, BLOCK_SIZE);
+	if (blocksNeeded >= node->base.blockCount)
+		return;
 
-			if (blocksNeeded) { // Leave block
-				for (int i = blocksNeeded; i < PNFS_NODE_BLOCKCOUNT; i++)
-					if (blockBlock.dataBlocks[i])
-						fs_supernode_setBlockFree((struct fs_supernode *)sn, blockBlock.dataBlocks[i]);
-
-				if (blockBlock.next) {
-					struct pnfs_blockBlock blockBlock2;
-					fs_blockdevice_read(bd, node->next, (struct fs_block *)&blockBlock2);
-					pnfs_removeBlockBlock(sn, &blockBlock2);
-					fs_supernode_setBlockFree((struct fs_supernode *)sn, node->next);
-
-					blockBlock.next = 0;
-					fs_blockdevice_write(bd, curID, (struct fs_block *)&blockBlock);
-				}
-			} else { // Remove block aswell
-				pnfs_removeBlockBlock(sn, &blockBlock);
-				fs_supernode_setBlockFree((struct fs_supernode *)sn, curID);
-
-				fs_blockdevice_read(bd, prevID, (struct fs_block *)&blockBlock);
-				blockBlock.next = 0;
-				fs_blockdevice_write(bd, prevID, (struct fs_block *)&blockBlock);
-			}
-		}
-		fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
-	}
+	struct pnfs_extent * extents = pnfs_readExtents(node, 0);
+	if (!extents)
+		return;
+	uint32_t count = pnfs_freeExtents(sn, extents, node->extentCount, blocksNeeded);
+	pnfs_writeExtents(node, extents, count); // Fewer extents never need more extent blocks
+	node->base.blockCount = blocksNeeded;
+	free(extents);
+	fs_supernode_saveNode((struct fs_supernode *)sn, (struct fs_node *)node);
 }
 
 #undef divRoundUp
 
-static struct fs_node * pnfs_node_findNode(struct fs_node * node, const char * path_) {
-	struct fs_supernode * sn = (struct fs_supernode *)((struct pnfs_node *)node)->runtimeStorage.sn;
-	char * path = strdup(path_);
+static struct fs_node * pnfs_node_findNode(struct fs_node * node, const char * path) {
+	struct pnfs_supernode * sn = ((struct pnfs_node *)node)->runtimeStorage.sn;
+	uint64_t allocations = sn->runtimeStorage.allocations;
+	struct fs_node * found = pnfs_findNode((struct pnfs_node *)node, path);
+	pnfs_countOp(sn, PNFS_OP_FINDNODE, allocations);
+	return found;
+}
+
+static struct fs_node * pnfs_findNode(struct pnfs_node * node, const char * path_) {
+	struct fs_supernode * sn = (struct fs_supernode *)node->runtimeStorage.sn;
+	size_t length = strlen(path_) + 1;
+	char * path = pnfs_scratchAlloc(node->runtimeStorage.sn, length);
+	if (!path)
+		return NULL;
+	memcpy(path, path_, length);
 	char * orgPath = path;
 	char * saveptr;
 	char * part = strtok_r(path, "/", &saveptr);
@@ -873,77 +2003,83 @@ static struct fs_node * pnfs_node_findNode(struct fs_node * node, const char * p
 	struct fs_node * cur;
 	if (*path == '/')
 		cur = fs_supernode_getNode(sn, NODE_ROOT);
-	else 	// This is because we will free cur later, so we need a copy
-		cur = fs_supernode_getNode(sn, node->id);
+	else 	// This is because we will put cur later, so we need our own reference
+		cur = fs_supernode_getNode(sn, node->base.id);
 
 	while (part && cur) {
-		uint16_t amount;
-		struct fs_direntry * dir = fs_node_directoryEntries(cur, &amount);
+		uint32_t amount;
+		struct fs_direntry * dir = pnfs_readDirectory((struct pnfs_node *)cur, &amount);
 
 		if (!dir) {
 			printf("[-] Path '%s' contains a entry which isn't a directory!\n", part);
-			free(cur);
-			free(orgPath);
+			fs_supernode_putNode(sn, cur);
+			pnfs_scratchFree(node->runtimeStorage.sn, orgPath);
 			return NULL;
 		}
 
 		fs_node_id id = NODE_INVALID;
-		for (uint16_t i = 0; i < amount; i++)
+		for (uint32_t i = 0; i < amount; i++)
 			if (!strcmp(dir[i].name, part)) {
 				id = dir[i].id;
 				break;
 			}
 
-		free(dir);
+		pnfs_scratchFree(node->runtimeStorage.sn, dir);
 		if (id == NODE_INVALID) {
-			free(cur);
-			free(orgPath);
+			fs_supernode_putNode(sn, cur);
+			pnfs_scratchFree(node->runtimeStorage.sn, orgPath);
 			return NULL;
 		}
 
 		struct fs_node * newCur = fs_supernode_getNode(sn, id);
-		free(cur);
+		fs_supernode_putNode(sn, cur);
 		cur = newCur;
 
 		part = strtok_r(NULL, "/", &saveptr);
 	}
 
-	free(orgPath);
+	pnfs_scratchFree(node->runtimeStorage.sn, orgPath);
 	return cur;
 }
 
 static char * pnfs_node_getName(struct fs_node * node, struct fs_node * parent) {
+	struct pnfs_supernode * sn = ((struct pnfs_node *)parent)->runtimeStorage.sn;
 	char * name = NULL;
-	uint16_t amount;
-	struct fs_direntry * dir = fs_node_directoryEntries(parent, &amount);
+	uint32_t amount;
+	struct fs_direntry * dir = pnfs_readDirectory((struct pnfs_node *)parent, &amount);
 	if (!dir)
 		return NULL;
 
-	for (int i = 0; i < amount; i++)
+	for (uint32_t i = 0; i < amount; i++)
 		if (dir[i].id == node->id) {
-			name = strdup(dir[i].name);
+			size_t length = strnlen(dir[i].name, sizeof(dir[i].name) - 1) + 1;
+			if ((name = pnfs_heapAlloc(sn, length))) {
+				memcpy(name, dir[i].name, length - 1);
+				name[length - 1] = '\0';
+			}
 			break;
 		}
-	free(dir);
+	pnfs_scratchFree(sn, dir);
 
 	return name;
 }
 
 static struct fs_node * pnfs_node_getParent(struct fs_node * node) {
-	uint16_t amount;
-	struct fs_direntry * dir = fs_node_directoryEntries(node, &amount);
+	struct pnfs_supernode * sn = ((struct pnfs_node *)node)->runtimeStorage.sn;
+	uint32_t amount;
+	struct fs_direntry * dir = pnfs_readDirectory((struct pnfs_node *)node, &amount);
 	if (!dir)
 		return NULL;
 
 	fs_node_id id = NODE_INVALID;
-	for (int i = 0; i < amount; i++)
+	for (uint32_t i = 0; i < amount; i++)
 		if (!strcmp(dir[i].name, "..")) {
 			id = dir[i].id;
 			break;
 		}
-	free(dir);
+	pnfs_scratchFree(sn, dir);
 
 	if (id != NODE_INVALID)
-		return fs_supernode_getNode((struct fs_supernode *)((struct pnfs_node *)node)->runtimeStorage.sn, id);
+		return fs_supernode_getNode((struct fs_supernode *)sn, id);
 	return NULL;
 }
@@ -11,10 +11,8 @@
 enum {
 	/// Header/Supernode block
 	PNFS_BLOCK_HEADER = 0,
-	/// Start of nodes block
-	PNFS_BLOCK_NODE_FIRST = 1,
-	/// Last node block
-	PNFS_BLOCK_NODE_LAST = 16,
+	/// The amount of node blocks each group starts with, when no node count is given on format
+	PNFS_NODE_BLOCKS = 16,
 };
 
 /**
@@ -24,10 +22,189 @@ enum {
 #define NODE_SIZE 64
 
 /**
- * The amount of datablock a pnfs_node have.
+ * The amount of nodes that fit in a node block.
  * \relates pnfs_node
  */
-#define PNFS_NODE_BLOCKCOUNT (uint16_t)((NODE_SIZE-sizeof(struct fs_node)+sizeof(void*))/2 - 1)
+#define PNFS_NODES_PER_BLOCK (BLOCK_SIZE / NODE_SIZE)
+
+/**
+ * The amount of blocks or nodes one bitmap block keeps track of.
+ * \relates pnfs_supernode
+ */
+#define PNFS_BITS_PER_BLOCK (BLOCK_SIZE * 8)
+
+/**
+ * The amount of blocks in a group, as many as its bitmap block keeps track of.
+ * \relates pnfs_group
+ */
+#define PNFS_BLOCKS_PER_GROUP PNFS_BITS_PER_BLOCK
+
+/**
+ * The most groups a PNFS can have, so every group can have atleast one node block without running out of node ids.
+ * \relates pnfs_group
+ */
+#define PNFS_MAX_GROUPS ((UINT16_MAX + 1) / PNFS_NODES_PER_BLOCK)
+
+/**
+ * The most node blocks a group can grow to, as many as the node bitmap of the group keeps track of.
+ * Fewer if the disk has so many groups that the node ids would run out.
+ * \relates pnfs_group
+ */
+#define PNFS_MAX_GROUP_NODE_BLOCKS (PNFS_BITS_PER_BLOCK / PNFS_NODES_PER_BLOCK)
+
+/**
+ * The amount of node block ids that fit in a node map block.
+ * \relates pnfs_group
+ */
+#define PNFS_NODE_MAP_ENTRIES (uint32_t)(BLOCK_SIZE / sizeof(fs_block_id))
+
+/**
+ * The smallest amount of blocks a PNFS can be formatted on.
+ * That is the header, one group descriptor block, the bitmap, the node bitmap, the node map, the node blocks and
+ * the root directory block.
+ * \relates pnfs_supernode
+ */
+#define PNFS_MIN_BLOCKCOUNT (PNFS_NODE_BLOCKS + 5 + PNFS_MAX_GROUP_NODE_BLOCKS / PNFS_NODE_MAP_ENTRIES)
+
+/**
+ * The descriptor of a block group.
+ * Every ::PNFS_BLOCKS_PER_GROUP blocks are a group, that starts with its own bitmap, node bitmap, node map and node blocks.
+ * More node blocks are taken from the data blocks of the group when all its nodes are used, and the node map has where
+ * they are, so a node is still found without searching.
+ * Nodes are put in the group of their parent directory and get their data blocks from their own group, so the blocks of
+ * the files in a directory are close to each other.
+ * \relates pnfs_supernode
+ */
+struct pnfs_group {
+	/// The free block bitmap of the group, bit i is block i in the group
+	fs_block_id bitmap;
+	/// The free node bitmap of the group, bit i is node i in the group
+	fs_block_id nodeBitmap;
+	/// The first block of the node map, the ids of the node blocks of the group in order
+	fs_block_id nodeMap;
+	/// The amount of node blocks the group has
+	uint32_t nodeBlocks;
+	/// The amount of free blocks in the group
+	uint32_t freeBlocks;
+	/// The amount of free nodes in the node blocks of the group
+	uint32_t freeNodes;
+	/// The amount of directories in the group
+	uint32_t directories;
+	/// Unused, keeps the descriptors a power of two big
+	uint32_t reserved;
+};
+
+/**
+ * The amount of group descriptors that fit in a block.
+ * \relates pnfs_group
+ */
+#define PNFS_GROUPS_PER_BLOCK (BLOCK_SIZE / sizeof(struct pnfs_group))
+
+/**
+ * A run of data blocks that follow each other on the disk.
+ * \relates pnfs_node
+ */
+struct pnfs_extent {
+	/// The first block of the run
+	fs_block_id start;
+	/// The amount of blocks in the run, 0 if the extent is unused
+	uint32_t length;
+};
+
+/**
+ * The amount of extents a pnfs_node have.
+ * \relates pnfs_node
+ */
+#define PNFS_NODE_EXTENTS (uint16_t)((NODE_SIZE-sizeof(struct fs_node)+sizeof(void*)-sizeof(uint32_t)-sizeof(fs_block_id))/sizeof(struct pnfs_extent))
+
+/**
+ * The most bytes a file can keep in its node instead of in data blocks, the room of the extents.
+ * \relates pnfs_node
+ */
+#define PNFS_INLINE_SIZE (PNFS_NODE_EXTENTS * sizeof(struct pnfs_extent))
+
+/**
+ * The extentCount of a file that has its data in the node, it has no extents then.
+ * \relates pnfs_node
+ */
+#define PNFS_INLINE_DATA UINT32_MAX
+
+/**
+ * The biggest a file can be, the block count of a node is 32 bits.
+ * \relates pnfs_node
+ */
+#define PNFS_MAX_FILE_SIZE ((uint64_t)UINT32_MAX * BLOCK_SIZE)
+
+/**
+ * The amount of nodes the pnfs_supernode keeps the decoded extents for.
+ * Only nodes that have extent blocks are kept, the rest are looked up straight from the node.
+ * \relates pnfs_supernode
+ */
+#define PNFS_EXTENT_MAPS 8
+
+/**
+ * The amount of nodes that nothing uses anymore, that the pnfs_supernode keeps in memory for the next time they are got.
+ * \relates pnfs_supernode
+ */
+#define PNFS_CACHED_NODES 64
+
+/**
+ * The amount of lists the nodes in memory are hashed into by id.
+ * \relates pnfs_supernode
+ */
+#define PNFS_NODE_BUCKETS 64
+
+/**
+ * The amount of nodes that can have delayed writes at the same time.
+ * \relates pnfs_supernode
+ */
+#define PNFS_DELAYED_WRITES 8
+
+/**
+ * The most data a delayed write keeps in memory, appends past it are written right away.
+ * \relates pnfs_supernode
+ */
+#define PNFS_DELAYED_WRITE_SIZE (1024 * 1024)
+
+/**
+ * The amount of nodes that are allocated together, the nodes in memory are taken from these slabs.
+ * \relates pnfs_supernode
+ */
+#define PNFS_SLAB_NODES 32
+
+/**
+ * The amount of bytes the scratch memory starts with.
+ * It holds the temporary buffers of the operations, and grows to the most they have needed at once when it runs out.
+ * \relates pnfs_supernode
+ */
+#define PNFS_SCRATCH_SIZE (32 * BLOCK_SIZE)
+
+/**
+ * The operations that the heap allocations are counted for.
+ * \relates pnfs_opAllocations
+ */
+enum pnfs_op {
+	PNFS_OP_GETNODE = 0,
+	PNFS_OP_FINDNODE,
+	PNFS_OP_DIRECTORYENTRIES,
+	PNFS_OP_READDATA,
+	PNFS_OP_WRITEDATA,
+
+	/// The amount of operations, not a operation
+	PNFS_OP_COUNT
+};
+
+/**
+ * The heap allocations of one kind of operation.
+ * \relates pnfs_supernode
+ */
+struct pnfs_opAllocations {
+	/// How many times it was run
+	uint64_t calls;
+
+	/// The allocations made while it ran, the ones of the operations it used included
+	uint64_t allocations;
+};
 
 /**
  * The nodestructure for the PowerNex FileSystem.
@@ -38,16 +215,43 @@ struct pnfs_node {
 	struct fs_node base;
 
 
-	/// The data block indices
-	fs_block_id dataBlocks[PNFS_NODE_BLOCKCOUNT];
+	union {
+		/// The first runs of data blocks, in the order they are in the file
+		struct pnfs_extent extents[PNFS_NODE_EXTENTS];
 
-	/// The index of a pnfs_blockBlock, when a file needs more block than there are in \ref dataBlocks
-	fs_block_id next;
+		/// The data of a small file, when \ref extentCount is ::PNFS_INLINE_DATA. The bytes after the size are zeros
+		uint8_t inlineData[PNFS_INLINE_SIZE];
+	};
+
+	/// The amount of extents the node has, the ones that do not fit in \ref extents are in the extent blocks.
+	/// ::PNFS_INLINE_DATA if the data is in \ref inlineData
+	uint32_t extentCount;
+
+	/// The index of the first pnfs_extentBlock, when a file needs more extents than there are in \ref extents
+	fs_block_id extentBlock;
 
 	/// Storage for runtime objects
 	struct {
 		/// Pointer to the supernode
 		struct pnfs_supernode * sn;
+
+		/// How many that have got the node and not put it back
+		uint32_t refCount;
+
+		/// The next node in the same hash bucket
+		struct pnfs_node * nextInBucket;
+
+		/// The node that was put before this one, when the refCount is 0
+		struct pnfs_node * prevUnused;
+
+		/// The node that was put after this one, when the refCount is 0
+		struct pnfs_node * nextUnused;
+
+		/// If the node was saved in a transaction and is not written yet, it is kept in memory until it is
+		bool dirty;
+
+		/// The next node in the list of dirty nodes
+		struct pnfs_node * nextDirty;
 	} runtimeStorage;
 };
 
@@ -59,6 +263,12 @@ struct pnfs_node {
  */
 #define PNFS_MAGIC 0x53464E50
 
+/**
+ * The version of the on-disk layout, the layout of the nodes included.
+ * \relates pnfs_supernode
+ */
+#define PNFS_VERSION 8
+
 /**
  * The supernode for PNFS.
  */
@@ -69,21 +279,148 @@ struct pnfs_supernode {
 	/// The magic
 	uint32_t magic;
 
-	/// Bitmap for storing if a block is used or not
-	uint8_t freeBlocksBitmap[32];
+	/// The layout version, see ::PNFS_VERSION
+	uint32_t version;
+
+	/// The amount of blocks the filesystem spans
+	uint32_t blockCount;
+
+	/// The first block of the group descriptors
+	fs_block_id groupFirst;
+
+	/// The amount of blocks the group descriptors span
+	uint32_t groupBlocks;
+
+	/// The amount of block groups
+	uint32_t groupCount;
+
+	/// The most node blocks a group can have, every group has the node ids for this many
+	uint32_t nodeBlocksPerGroup;
 
 	/// Storage for runtime objects
 	struct {
 		/// Pointer to the blockdevice
 		struct fs_blockdevice * bd;
+
+		/// The group descriptors, \ref groupBlocks blocks big
+		struct pnfs_group * groups;
+
+		/// Bitmap for storing if a block is used or not, the bitmaps of all the groups after each other. \ref groupCount blocks big
+		uint8_t * freeBlocksBitmap;
+
+		/// One bit per 64 bit word in \ref freeBlocksBitmap, set if all of its blocks are used. \ref groupCount words big
+		uint64_t * fullWords;
+
+		/// Where the search for a free block starts, it rotates through the disk
+		fs_block_id nextFreeBlock;
+
+		/// Bitmap for storing if a node is used or not, the node bitmap blocks of all the groups after each other. \ref groupCount blocks big
+		uint8_t * freeNodesBitmap;
+
+		/// The node maps of all the groups after each other
+		fs_block_id * nodeMaps;
+
+		/// Every node below this is used, so the search for a free one starts here
+		uint32_t nextFreeNode;
+
+		/// How many transactions that are open, the bitmaps are only written when the last one is committed
+		uint32_t transactions;
+
+		/// One bit per block, set if it is a bitmap, node map or group descriptor block that has changes that are not written yet
+		uint8_t * dirtyMeta;
+
+		/// Data written in a transaction, that gets its blocks when the transaction is committed. ::PNFS_DELAYED_WRITES big
+		struct pnfs_delayedWrite * delayedWrites;
+
+		/// Which of \ref delayedWrites that is reused next when all are taken
+		uint32_t nextDelayedWrite;
+
+		/// The decoded extents of the last used nodes with extent blocks, ::PNFS_EXTENT_MAPS big
+		struct pnfs_extentMap * extentMaps;
+
+		/// Which of \ref extentMaps that is replaced next
+		uint32_t nextExtentMap;
+
+		/// The nodes in memory, hashed by id. ::PNFS_NODE_BUCKETS big
+		struct pnfs_node ** nodeBuckets;
+
+		/// The node that was put the longest ago and has not been got since, it is the first one to be freed
+		struct pnfs_node * firstUnused;
+
+		/// The node that was put last
+		struct pnfs_node * lastUnused;
+
+		/// The amount of nodes in memory that nothing uses, atmost ::PNFS_CACHED_NODES
+		uint32_t unusedCount;
+
+		/// The nodes that were saved in the transaction, they are written together on the commit
+		struct pnfs_node * dirtyNodes;
+
+		/// The slabs the nodes in memory are taken from, ::PNFS_SLAB_NODES nodes each
+		struct pnfs_nodeSlab * nodeSlabs;
+
+		/// The nodes in \ref nodeSlabs that are not in memory, linked through their nextInBucket
+		struct pnfs_node * freeNodes;
+
+		/// Memory for the temporary buffers of the running operations, it is taken and given back like a stack
+		uint8_t * scratch;
+
+		/// The size of \ref scratch
+		uint32_t scratchSize;
+
+		/// How many bytes of \ref scratch that are taken
+		uint32_t scratchUsed;
+
+		/// The most scratch memory that was needed at once, \ref scratch grows to it when it is not used
+		uint32_t scratchPeak;
+
+		/// The amount of heap allocations that have been made
+		uint64_t allocations;
+
+		/// The heap allocations of each operation, indexed with pnfs_op
+		struct pnfs_opAllocations opAllocations[PNFS_OP_COUNT];
 	} runtimeStorage;
 };
 
 /**
  * Constructor for the pnfs_supernode.
+ * If no PNFS is found on the blockdevice, a new one will be created that spans the whole device.
+ * A PNFS of another version, or one bigger than the device, is left as it is.
  * \param bd The blockdevice from where to read the blocks
- * \return The pnfs_supernode instance
+ * \return The pnfs_supernode instance, or NULL if the device is too small or has a PNFS that can not be used
  * \relates pnfs_supernode
  */
 struct pnfs_supernode * pnfs_init(struct fs_blockdevice * bd);
+
+/**
+ * Create a new PNFS that spans the whole blockdevice.
+ * The node table grows when more nodes are needed, \a nodeCount is only how many there is room for to begin with.
+ * \param bd The blockdevice to create it on
+ * \param nodeCount The amount of nodes, 0 for ::PNFS_NODE_BLOCKS node blocks in every group
+ * \return The pnfs_supernode instance, or NULL if the device is too small
+ * \relates pnfs_supernode
+ */
+struct pnfs_supernode * pnfs_format(struct fs_blockdevice * bd, uint32_t nodeCount);
+
+/**
+ * Destructor for the pnfs_supernode.
+ * \param sn The pnfs_supernode instance
+ * \relates pnfs_supernode
+ */
+void pnfs_free(struct pnfs_supernode * sn);
+
+/**
+ * Get the name of a operation.
+ * \param op The operation
+ * \return The name of \a op
+ * \relates pnfs_opAllocations
+ */
+const char * pnfs_opName(enum pnfs_op op);
+
+/**
+ * Zero the heap allocation counters.
+ * \param sn The pnfs_supernode instance
+ * \relates pnfs_supernode
+ */
+void pnfs_resetAllocations(struct pnfs_supernode * sn);
 #endif